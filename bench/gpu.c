@@ -0,0 +1,432 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <drm_fourcc.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <gbm.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vulkan.h"
+
+// Pushes synthetic DMA-BUFs through the same import, luma and readback path as wluma
+
+#define BENCH_ITERATIONS    "200"
+#define BENCH_WARMUP        10
+#define BENCH_BUFFERS       3 // compositors cycle through a few buffers, less than IMPORT_CACHE_SIZE
+#define BENCH_FENCE_WAIT_MS 1000
+#define DRI_PATH            "/dev/dri"
+#define SKIP                77 // meson reports the benchmark as skipped
+
+struct Resolution {
+    uint32_t width;
+    uint32_t height;
+};
+
+static const struct Resolution resolutions[] = {
+    { 1920, 1080 },
+    { 2560, 1440 },
+    { 3840, 2160 },
+    { 5120, 2160 },
+};
+
+struct Format {
+    uint32_t fourcc;
+    const char *name;
+};
+
+static const struct Format formats[] = {
+    { DRM_FORMAT_XRGB8888,    "XRGB8888"    },
+    { DRM_FORMAT_XBGR8888,    "XBGR8888"    },
+    { DRM_FORMAT_ARGB2101010, "ARGB2101010" },
+};
+
+enum Stage {
+    STAGE_RECORD,
+    STAGE_SUBMIT,
+    STAGE_WAIT,
+    STAGE_READBACK,
+    STAGE_GPU,
+    STAGE_COUNT,
+};
+
+static const char *stage_names[STAGE_COUNT] = {
+    "record",
+    "submit",
+    "wait",
+    "readback",
+    "gpu",
+};
+
+struct Buffer {
+    struct gbm_bo *bo;
+    struct Frame frame;
+};
+
+struct Bench {
+    int drm_fd;
+    struct gbm_device *gbm;
+    struct Vulkan vulkan;
+    int iterations;
+
+    // Latency of every iteration per stage, in nanoseconds
+    uint64_t *samples[STAGE_COUNT];
+    int sample_count[STAGE_COUNT];
+};
+
+
+/******************************************************************************
+ * Utilities
+ */
+
+static char* get_env(char *name, char *def) {
+    char *val = getenv(name);
+    return val ? val : def;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int compare_samples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(uint64_t *samples, int count, double pct) {
+    int idx = pct * (count - 1) + 0.5;
+    return samples[idx] / 1000.0;
+}
+
+// Render node given in WLUMA_DRM_DEVICE or the first one found
+static int open_render_node(void) {
+    char *device = get_env("WLUMA_DRM_DEVICE", NULL);
+    if (device) {
+        return open(device, O_RDWR | O_CLOEXEC);
+    }
+
+    DIR *dir = opendir(DRI_PATH);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int fd = -1;
+    struct dirent *entry;
+    while (fd == -1 && (entry = readdir(dir)) != NULL) {
+        if (!strncmp(entry->d_name, "renderD", strlen("renderD"))) {
+            char path[sizeof(DRI_PATH) + 256];
+            snprintf(path, sizeof(path), "%s/%s", DRI_PATH, entry->d_name);
+            fd = open(path, O_RDWR | O_CLOEXEC);
+        }
+    }
+
+    closedir(dir);
+    return fd;
+}
+
+
+/******************************************************************************
+ * Buffers
+ */
+
+static void buffer_free(struct Buffer *buffer) {
+    for (uint32_t i = 0; i < buffer->frame.num_objects; i++) {
+        close(buffer->frame.fds[i]);
+    }
+    if (buffer->bo) gbm_bo_destroy(buffer->bo);
+    memset(buffer, 0, sizeof(struct Buffer));
+}
+
+// Noise keeps compressed modifiers from reading a constant colour
+static void buffer_fill(struct Buffer *buffer, uint32_t seed) {
+    uint32_t stride;
+    void *map_data = NULL;
+    uint32_t width = gbm_bo_get_width(buffer->bo);
+    uint32_t height = gbm_bo_get_height(buffer->bo);
+    unsigned char *pixels = gbm_bo_map(buffer->bo, 0, 0, width, height, GBM_BO_TRANSFER_WRITE, &stride, &map_data);
+    if (pixels == NULL) {
+        return;
+    }
+
+    for (uint32_t y = 0; y < height; y++) {
+        uint32_t *row = (uint32_t*)(pixels + y * stride);
+        for (uint32_t x = 0; x < width; x++) {
+            seed = seed * 1664525 + 1013904223;
+            row[x] = seed;
+        }
+    }
+
+    gbm_bo_unmap(buffer->bo, map_data);
+}
+
+static bool buffer_create(struct Bench *bench, struct Buffer *buffer, const struct Resolution *res, uint32_t format, bool linear) {
+    memset(buffer, 0, sizeof(struct Buffer));
+
+    uint32_t flags = GBM_BO_USE_RENDERING | (linear ? GBM_BO_USE_LINEAR : 0);
+    buffer->bo = gbm_bo_create(bench->gbm, res->width, res->height, format, flags);
+    if (buffer->bo == NULL) {
+        return false;
+    }
+
+    struct Frame *frame = &buffer->frame;
+    frame->capture = buffer;
+    frame->width = res->width;
+    frame->height = res->height;
+    frame->format = format;
+    frame->modifier = gbm_bo_get_modifier(buffer->bo);
+    frame->disjoint = false;
+
+    int planes = gbm_bo_get_plane_count(buffer->bo);
+    for (int i = 0; i < planes; i++) {
+        int fd = gbm_bo_get_fd_for_plane(buffer->bo, i);
+        if (fd < 0) {
+            buffer_free(buffer);
+            return false;
+        }
+
+        frame->fds[i] = fd;
+        frame->offsets[i] = gbm_bo_get_offset(buffer->bo, i);
+        frame->strides[i] = gbm_bo_get_stride_for_plane(buffer->bo, i);
+        frame->plane_indices[i] = i;
+        frame->sizes[i] = lseek(fd, 0, SEEK_END);
+        frame->num_objects++;
+    }
+
+    return true;
+}
+
+
+/******************************************************************************
+ * Benchmark
+ */
+
+static void add_sample(struct Bench *bench, enum Stage stage, uint64_t ns) {
+    bench->samples[stage][bench->sample_count[stage]++] = ns;
+}
+
+// Submission of the single slot in flight, fence is waited on instead of watched by an event loop
+static bool wait_submit(struct Bench *bench, struct VulkanSubmit *submit) {
+    struct Vulkan *vk = &bench->vulkan;
+    if (submit->fence_exported) {
+        if (submit->fence_fd == -1) {
+            return true;
+        }
+
+        struct pollfd pfd = {
+            .fd     = submit->fence_fd,
+            .events = POLLIN,
+        };
+        return poll(&pfd, 1, BENCH_FENCE_WAIT_MS) == 1;
+    }
+
+    return vkWaitForFences(vk->device, 1, &submit->fence, VK_TRUE, BENCH_FENCE_WAIT_MS * 1000000ULL) == VK_SUCCESS;
+}
+
+static bool run_frame(struct Bench *bench, struct VulkanOutput *output, struct Frame *frame, bool measure) {
+    struct Vulkan *vk = &bench->vulkan;
+
+    uint64_t start = now_ns();
+    prepare_frame_vulkan(vk, output, frame->width, frame->height);
+    if (!record_frame_vulkan(vk, output, frame)) {
+        return false;
+    }
+
+    uint64_t recorded = now_ns();
+    if (!submit_pending_vulkan(vk)) {
+        return false;
+    }
+
+    struct VulkanSubmit *submit = NULL;
+    for (int i = 0; i < VULKAN_SUBMITS; i++) {
+        if (vk->submits[i].busy) {
+            submit = &vk->submits[i];
+            break;
+        }
+    }
+
+    if (submit == NULL) {
+        fprintf(stderr, "ERROR: Frame was not submitted!\n");
+        return false;
+    }
+
+    uint64_t submitted = now_ns();
+    if (!wait_submit(bench, submit)) {
+        fprintf(stderr, "ERROR: Failed to wait for Vulkan fence!\n");
+        return false;
+    }
+
+    uint64_t signaled = now_ns();
+    bool ok = true;
+    uint64_t gpu_ns = 0;
+    bool gpu_time = false;
+    struct VulkanSlot *slot, *tmp;
+    wl_list_for_each_safe(slot, tmp, &submit->slots, link) {
+        double difference;
+        ok = ok && read_frame_luma_pct_vulkan(vk, slot, &difference) >= 0;
+        gpu_time = read_gpu_time_vulkan(vk, slot, &gpu_ns);
+        release_slot_vulkan(vk, slot);
+    }
+    ok = release_submit_vulkan(vk, submit) && ok;
+
+    uint64_t read = now_ns();
+    if (ok && measure) {
+        add_sample(bench, STAGE_RECORD, recorded - start);
+        add_sample(bench, STAGE_SUBMIT, submitted - recorded);
+        add_sample(bench, STAGE_WAIT, signaled - submitted);
+        add_sample(bench, STAGE_READBACK, read - signaled);
+        if (gpu_time) {
+            add_sample(bench, STAGE_GPU, gpu_ns);
+        }
+    }
+
+    return ok;
+}
+
+static void print_case(struct Bench *bench, const struct Resolution *res, const struct Format *format, uint64_t modifier) {
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        int count = bench->sample_count[i];
+        if (count == 0) {
+            continue;
+        }
+
+        qsort(bench->samples[i], count, sizeof(uint64_t), compare_samples);
+        printf("%4ux%-4u  %-11s  0x%016llx  %-8s  %9.1f  %9.1f  %9.1f\n",
+            res->width, res->height, format->name, (unsigned long long)modifier, stage_names[i],
+            percentile_us(bench->samples[i], count, 0.50),
+            percentile_us(bench->samples[i], count, 0.90),
+            percentile_us(bench->samples[i], count, 0.99));
+    }
+}
+
+// Every output gets fresh Vulkan objects, like an output that was just attached
+static bool run_case(struct Bench *bench, const struct Resolution *res, const struct Format *format, bool linear) {
+    struct Buffer buffers[BENCH_BUFFERS];
+    struct VulkanOutput output = {
+        .name = "bench",
+    };
+    int buffer_count = 0;
+    for (; buffer_count < BENCH_BUFFERS; buffer_count++) {
+        if (!buffer_create(bench, &buffers[buffer_count], res, format->fourcc, linear)) {
+            break;
+        }
+        buffer_fill(&buffers[buffer_count], buffer_count + 1);
+    }
+
+    // Format or modifier isn't supported by the GPU, nothing to measure
+    bool ok = true;
+    if (buffer_count < BENCH_BUFFERS) {
+        fprintf(stderr, "WARN: Failed to allocate %ux%u %s %s buffers, skipping!\n",
+            res->width, res->height, format->name, linear ? "linear" : "native");
+        goto done;
+    }
+
+    if (!init_output_vulkan(&bench->vulkan, &output)) {
+        fprintf(stderr, "ERROR: Failed to prepare Vulkan objects!\n");
+        ok = false;
+        goto done;
+    }
+
+    memset(bench->sample_count, 0, sizeof(bench->sample_count));
+    for (int i = 0; i < BENCH_WARMUP + bench->iterations && ok; i++) {
+        ok = run_frame(bench, &output, &buffers[i % BENCH_BUFFERS].frame, i >= BENCH_WARMUP);
+    }
+
+    // Frames that can't be imported are skipped like wluma does, warning is already printed
+    if (ok) {
+        print_case(bench, res, format, buffers[0].frame.modifier);
+    } else if (output.import_checked && !output.import_supported) {
+        ok = true;
+    }
+
+    // Submission whose fence timed out still uses the output
+    finish_vulkan(&bench->vulkan);
+    deinit_output_vulkan(&bench->vulkan, &output);
+
+done:
+    for (int i = 0; i < buffer_count; i++) {
+        buffer_free(&buffers[i]);
+    }
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    struct Bench bench = {
+        .drm_fd = -1,
+    };
+    int ret = EXIT_FAILURE;
+
+    bench.iterations = strtol(get_env("WLUMA_BENCH_ITERATIONS", BENCH_ITERATIONS), NULL, 10);
+    if (bench.iterations < 1) {
+        fprintf(stderr, "ERROR: Benchmark needs at least one iteration!\n");
+        return EXIT_FAILURE;
+    }
+
+    bench.drm_fd = open_render_node();
+    if (bench.drm_fd == -1) {
+        fprintf(stderr, "WARN: No DRM render node available, skipping!\n");
+        return SKIP;
+    }
+
+    struct stat st;
+    if (fstat(bench.drm_fd, &st) == -1) {
+        fprintf(stderr, "ERROR: Failed to stat DRM render node!\n");
+        goto fail;
+    }
+
+    bench.gbm = gbm_create_device(bench.drm_fd);
+    if (bench.gbm == NULL) {
+        fprintf(stderr, "ERROR: Failed to create GBM device!\n");
+        goto fail;
+    }
+
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        bench.samples[i] = calloc(bench.iterations, sizeof(uint64_t));
+    }
+
+    // Nobody watches the sync fds, benchmark waits on every submission itself
+    bench.vulkan.settings.region_mode = REGION_FULL;
+    bench.vulkan.settings.statistic = LUMA_MEAN;
+    bench.vulkan.listener = NULL;
+    bench.vulkan.timestamps = true;
+    // Machines without a usable Vulkan device, such as CI runners, have nothing to measure
+    if (!init_vulkan(&bench.vulkan, true, st.st_rdev)) {
+        fprintf(stderr, "WARN: No usable Vulkan device, skipping!\n");
+        ret = SKIP;
+        goto fail;
+    }
+
+    if (!bench.vulkan.timestamps) {
+        fprintf(stderr, "WARN: Vulkan queue has no timestamps, GPU time is not reported!\n");
+    }
+
+    printf("%-9s  %-11s  %-18s  %-8s  %9s  %9s  %9s\n", "size", "format", "modifier", "stage", "p50 us", "p90 us", "p99 us");
+
+    bool ok = true;
+    for (size_t r = 0; r < sizeof(resolutions) / sizeof(resolutions[0]) && ok; r++) {
+        for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]) && ok; f++) {
+            ok = run_case(&bench, &resolutions[r], &formats[f], true)
+                && run_case(&bench, &resolutions[r], &formats[f], false);
+        }
+    }
+
+    finish_vulkan(&bench.vulkan);
+    ret = ok ? EXIT_SUCCESS : EXIT_FAILURE;
+
+fail:
+    deinit_vulkan(&bench.vulkan);
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        free(bench.samples[i]);
+    }
+    if (bench.gbm) gbm_device_destroy(bench.gbm);
+    close(bench.drm_fd);
+    return ret;
+}
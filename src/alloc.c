@@ -0,0 +1,42 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "alloc.h"
+
+// Only calls from wluma and its static libraries are wrapped, libraries loaded at runtime allocate as they please
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void *ptr, size_t size);
+char* __real_strdup(const char *str);
+
+static uint64_t allocs;
+
+static void alloc_counted(void) {
+    __atomic_add_fetch(&allocs, 1, __ATOMIC_RELAXED);
+}
+
+void* __wrap_malloc(size_t size) {
+    alloc_counted();
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t count, size_t size) {
+    alloc_counted();
+    return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void *ptr, size_t size) {
+    alloc_counted();
+    return __real_realloc(ptr, size);
+}
+
+char* __wrap_strdup(const char *str) {
+    alloc_counted();
+    return __real_strdup(str);
+}
+
+uint64_t alloc_count(void) {
+    return __atomic_load_n(&allocs, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,10 @@
+#ifndef WLUMA_ALLOC_H
+#define WLUMA_ALLOC_H
+
+#include <stdint.h>
+
+// Heap allocations made by wluma itself, built with the alloc_stats option which has the linker wrap malloc and friends
+
+uint64_t alloc_count(void);
+
+#endif
@@ -0,0 +1,241 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/i2c-dev.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ddc.h"
+
+#define DDC_ADDRESS                   0x37
+#define DDC_HOST_ADDRESS              0x51
+#define DDC_VCP_BRIGHTNESS            0x10
+#define DDC_REPLY_DELAY_NS            (40 * 1000000L) // monitor needs this long to prepare a reply
+#define DDC_COMMAND_INTERVAL_NS       (50 * 1000000L) // monitors drop commands that follow each other faster
+#define DDC_REFRESH_NS                (2000 * 1000000L) // changes made on the monitor itself show up this late
+#define DDC_RETRIES                   3
+
+struct DdcMonitor {
+    int fd;
+    int probed_fd;
+    pthread_t thread;
+
+    // Shared with the worker
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    long max;
+    long value;
+    long target; // -1 while nothing waits to be written
+    bool quit;
+};
+
+
+/******************************************************************************
+ * Protocol
+ */
+
+static void ddc_sleep(long ns) {
+    struct timespec delay = { .tv_sec = ns / 1000000000L, .tv_nsec = ns % 1000000000L };
+    while (nanosleep(&delay, &delay) == -1 && errno == EINTR);
+}
+
+// Checksum of a message covers the address it goes to, replies are checked against the virtual host address
+static uint8_t ddc_checksum(uint8_t initial, const uint8_t *data, int len) {
+    uint8_t checksum = initial;
+    for (int i = 0; i < len; i++) {
+        checksum ^= data[i];
+    }
+    return checksum;
+}
+
+static bool ddc_get_vcp(int fd, uint8_t code, long *value, long *max) {
+    uint8_t request[] = { DDC_HOST_ADDRESS, 0x82, 0x01, code, 0 };
+    request[4] = ddc_checksum(DDC_ADDRESS << 1, request, 4);
+    if (write(fd, request, sizeof(request)) != sizeof(request)) {
+        return false;
+    }
+
+    ddc_sleep(DDC_REPLY_DELAY_NS);
+
+    // Source address, length, opcode, result, code, type, maximum and current value, checksum
+    uint8_t reply[11];
+    if (read(fd, reply, sizeof(reply)) != sizeof(reply)
+            || reply[1] != 0x88 || reply[2] != 0x02 || reply[3] != 0x00 || reply[4] != code
+            || ddc_checksum(0x50, reply, 10) != reply[10]) {
+        return false;
+    }
+
+    *max = reply[6] << 8 | reply[7];
+    *value = reply[8] << 8 | reply[9];
+    return true;
+}
+
+static bool ddc_set_vcp(int fd, uint8_t code, long value) {
+    uint8_t request[] = { DDC_HOST_ADDRESS, 0x84, 0x03, code, value >> 8, value & 0xff, 0 };
+    request[6] = ddc_checksum(DDC_ADDRESS << 1, request, 6);
+    return write(fd, request, sizeof(request)) == sizeof(request);
+}
+
+
+/******************************************************************************
+ * Worker
+ */
+
+static void deadline_after(struct timespec *deadline, long ns) {
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += (deadline->tv_nsec + ns) / 1000000000L;
+    deadline->tv_nsec = (deadline->tv_nsec + ns) % 1000000000L;
+}
+
+static bool ddc_quitting(struct DdcMonitor *monitor) {
+    pthread_mutex_lock(&monitor->lock);
+    bool quit = monitor->quit;
+    pthread_mutex_unlock(&monitor->lock);
+    return quit;
+}
+
+// Monitors can take a few tries to answer, without an answer the worker is done
+static bool ddc_probe(struct DdcMonitor *monitor) {
+    long value = 0, max = 0;
+    for (int i = 0; i < DDC_RETRIES && !ddc_quitting(monitor); i++) {
+        if (ddc_get_vcp(monitor->fd, DDC_VCP_BRIGHTNESS, &value, &max) && max > 0) {
+            break;
+        }
+        max = 0;
+        ddc_sleep(DDC_COMMAND_INTERVAL_NS);
+    }
+
+    pthread_mutex_lock(&monitor->lock);
+    monitor->max = max;
+    monitor->value = value;
+    pthread_mutex_unlock(&monitor->lock);
+
+    uint64_t done = 1;
+    write(monitor->probed_fd, &done, sizeof(done));
+    return max > 0;
+}
+
+// Only the latest target is written, the monitor is read back while nothing else is going on
+static void* ddc_thread(void *arg) {
+    struct DdcMonitor *monitor = arg;
+    if (!ddc_probe(monitor)) {
+        return NULL;
+    }
+
+    struct timespec refresh;
+    deadline_after(&refresh, DDC_REFRESH_NS);
+
+    pthread_mutex_lock(&monitor->lock);
+    while (!monitor->quit || monitor->target >= 0) {
+        if (monitor->target >= 0) {
+            long target = monitor->target;
+            monitor->target = -1;
+            pthread_mutex_unlock(&monitor->lock);
+
+            ddc_set_vcp(monitor->fd, DDC_VCP_BRIGHTNESS, target);
+            ddc_sleep(DDC_COMMAND_INTERVAL_NS);
+
+            pthread_mutex_lock(&monitor->lock);
+            deadline_after(&refresh, DDC_REFRESH_NS);
+            continue;
+        }
+
+        if (pthread_cond_timedwait(&monitor->wake, &monitor->lock, &refresh) != ETIMEDOUT || monitor->quit) {
+            continue;
+        }
+
+        pthread_mutex_unlock(&monitor->lock);
+        long value, max;
+        bool ok = ddc_get_vcp(monitor->fd, DDC_VCP_BRIGHTNESS, &value, &max);
+        ddc_sleep(DDC_COMMAND_INTERVAL_NS);
+        pthread_mutex_lock(&monitor->lock);
+
+        // Value that was set meanwhile is newer than the one read
+        if (ok && monitor->target < 0) {
+            monitor->value = value;
+        }
+        deadline_after(&refresh, DDC_REFRESH_NS);
+    }
+    pthread_mutex_unlock(&monitor->lock);
+    return NULL;
+}
+
+
+/******************************************************************************
+ * Monitor
+ */
+
+// Doesn't wait for the monitor, the worker probes it
+struct DdcMonitor* ddc_open(const char *path, int probed_fd) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (ioctl(fd, I2C_SLAVE, DDC_ADDRESS) != 0) {
+        close(fd);
+        return NULL;
+    }
+
+    struct DdcMonitor *monitor = calloc(1, sizeof(struct DdcMonitor));
+    monitor->fd = fd;
+    monitor->probed_fd = probed_fd;
+    monitor->target = -1;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&monitor->lock, NULL);
+    pthread_cond_init(&monitor->wake, &attr);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&monitor->thread, NULL, ddc_thread, monitor) != 0) {
+        pthread_cond_destroy(&monitor->wake);
+        pthread_mutex_destroy(&monitor->lock);
+        close(fd);
+        free(monitor);
+        return NULL;
+    }
+
+    return monitor;
+}
+
+// Value that is still queued is written before the worker exits
+void ddc_close(struct DdcMonitor *monitor) {
+    pthread_mutex_lock(&monitor->lock);
+    monitor->quit = true;
+    pthread_cond_signal(&monitor->wake);
+    pthread_mutex_unlock(&monitor->lock);
+    pthread_join(monitor->thread, NULL);
+
+    pthread_cond_destroy(&monitor->wake);
+    pthread_mutex_destroy(&monitor->lock);
+    close(monitor->fd);
+    free(monitor);
+}
+
+long ddc_max(struct DdcMonitor *monitor) {
+    pthread_mutex_lock(&monitor->lock);
+    long max = monitor->max;
+    pthread_mutex_unlock(&monitor->lock);
+    return max;
+}
+
+long ddc_value(struct DdcMonitor *monitor) {
+    pthread_mutex_lock(&monitor->lock);
+    long value = monitor->value;
+    pthread_mutex_unlock(&monitor->lock);
+    return value;
+}
+
+void ddc_set(struct DdcMonitor *monitor, long value) {
+    pthread_mutex_lock(&monitor->lock);
+    monitor->value = value;
+    monitor->target = value;
+    pthread_cond_signal(&monitor->wake);
+    pthread_mutex_unlock(&monitor->lock);
+}
@@ -0,0 +1,23 @@
+#ifndef WLUMA_DDC_H
+#define WLUMA_DDC_H
+
+#include <stdbool.h>
+
+// Brightness of external monitors over DDC/CI, commands go out on a worker thread per monitor
+
+struct DdcMonitor;
+
+// Opens an i2c bus such as /dev/i2c-5, the worker reads brightness first and writes to the eventfd probed_fd once done
+struct DdcMonitor* ddc_open(const char *path, int probed_fd);
+void ddc_close(struct DdcMonitor *monitor);
+
+// 0 while the monitor is probed, and when no monitor answered on the bus
+long ddc_max(struct DdcMonitor *monitor);
+
+// Last known brightness, what was set last until the monitor reports something else, doesn't wait for the monitor
+long ddc_value(struct DdcMonitor *monitor);
+
+// Queued for the worker, replaces a value that wasn't written yet
+void ddc_set(struct DdcMonitor *monitor, long value);
+
+#endif
@@ -0,0 +1,233 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stddef.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LUMA_X86
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+#include "luma.h"
+
+#define CPU_GRID_SIZE   128 // most blocks sampled per row and rows sampled per frame
+#define CPU_BLOCK_WIDTH 8   // neighbouring pixels summed for each sample, 32 bytes
+
+// Sums bytes 0 to 2 of the pixels of blocks that are step bytes apart
+typedef void (*block_sums_t)(const unsigned char *row, uint32_t count, size_t step, uint32_t (*sums)[3]);
+
+
+/******************************************************************************
+ * Region and statistics
+ */
+
+void luma_region(const struct LumaSettings *settings, uint32_t width, uint32_t height, uint32_t region[4]) {
+    if (settings->region_mode != REGION_RECT) {
+        region[0] = 0;
+        region[1] = 0;
+        region[2] = width;
+        region[3] = height;
+        return;
+    }
+
+    region[0] = fmin(settings->region[0] * width, width - 1);
+    region[1] = fmin(settings->region[1] * height, height - 1);
+    region[2] = fmax(fmin(settings->region[2] * width, width - region[0]), 1);
+    region[3] = fmax(fmin(settings->region[3] * height, height - region[1]), 1);
+}
+
+double luma_region_weight(const struct LumaSettings *settings, double x, double y) {
+    if (settings->region_mode != REGION_CENTER_WEIGHTED) {
+        return 1.0;
+    }
+    x = x * 2.0 - 1.0;
+    y = y * 2.0 - 1.0;
+    return 1.0 - 0.375 * (x * x + y * y);
+}
+
+int luma_histogram_pct(const struct LumaSettings *settings, const uint32_t histogram[LUMA_HISTOGRAM_BINS]) {
+    uint64_t total = 0;
+    int mode = 0;
+    for (int i = 0; i < LUMA_HISTOGRAM_BINS; i++) {
+        total += histogram[i];
+        if (histogram[i] > histogram[mode]) {
+            mode = i;
+        }
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    if (settings->statistic == LUMA_MODE) {
+        return (mode + 0.5) * 100.0 / LUMA_HISTOGRAM_BINS;
+    }
+
+    // Interpolate within the bin that crosses the percentile
+    double target = settings->percentile * total;
+    uint64_t cumulative = 0;
+    for (int i = 0; i < LUMA_HISTOGRAM_BINS; i++) {
+        if (histogram[i] > 0 && cumulative + histogram[i] >= target) {
+            return (i + (target - cumulative) / histogram[i]) * 100.0 / LUMA_HISTOGRAM_BINS;
+        }
+        cumulative += histogram[i];
+    }
+    return 100;
+}
+
+
+/******************************************************************************
+ * CPU kernels
+ */
+
+static void block_sums_scalar(const unsigned char *row, uint32_t count, size_t step, uint32_t (*sums)[3]) {
+    for (uint32_t i = 0; i < count; i++) {
+        const unsigned char *block = row + i * step;
+        uint32_t sum0 = 0, sum1 = 0, sum2 = 0;
+        for (int p = 0; p < CPU_BLOCK_WIDTH; p++) {
+            sum0 += block[4 * p + 0];
+            sum1 += block[4 * p + 1];
+            sum2 += block[4 * p + 2];
+        }
+        sums[i][0] = sum0;
+        sums[i][1] = sum1;
+        sums[i][2] = sum2;
+    }
+}
+
+#ifdef LUMA_X86
+// Once other channels are masked out, sum of absolute differences against zero adds up one channel per 64-bit lane
+__attribute__((target("sse2")))
+static void block_sums_sse2(const unsigned char *row, uint32_t count, size_t step, uint32_t (*sums)[3]) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i masks[3] = { _mm_set1_epi32(0x0000ff), _mm_set1_epi32(0x00ff00), _mm_set1_epi32(0xff0000) };
+
+    for (uint32_t i = 0; i < count; i++) {
+        const unsigned char *block = row + i * step;
+        __m128i low = _mm_loadu_si128((const __m128i *)block);
+        __m128i high = _mm_loadu_si128((const __m128i *)(block + 16));
+        for (int c = 0; c < 3; c++) {
+            __m128i sad = _mm_add_epi64(_mm_sad_epu8(_mm_and_si128(low, masks[c]), zero),
+                                        _mm_sad_epu8(_mm_and_si128(high, masks[c]), zero));
+            sums[i][c] = _mm_cvtsi128_si32(sad) + _mm_cvtsi128_si32(_mm_srli_si128(sad, 8));
+        }
+    }
+}
+
+__attribute__((target("avx2")))
+static void block_sums_avx2(const unsigned char *row, uint32_t count, size_t step, uint32_t (*sums)[3]) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i masks[3] = { _mm256_set1_epi32(0x0000ff), _mm256_set1_epi32(0x00ff00), _mm256_set1_epi32(0xff0000) };
+
+    for (uint32_t i = 0; i < count; i++) {
+        __m256i block = _mm256_loadu_si256((const __m256i *)(row + i * step));
+        for (int c = 0; c < 3; c++) {
+            __m256i sad = _mm256_sad_epu8(_mm256_and_si256(block, masks[c]), zero);
+            __m128i half = _mm_add_epi64(_mm256_castsi256_si128(sad), _mm256_extracti128_si256(sad, 1));
+            sums[i][c] = _mm_cvtsi128_si32(half) + _mm_cvtsi128_si32(_mm_srli_si128(half, 8));
+        }
+    }
+}
+#endif
+
+#ifdef __aarch64__
+// Structured load splits the block into channels
+static void block_sums_neon(const unsigned char *row, uint32_t count, size_t step, uint32_t (*sums)[3]) {
+    for (uint32_t i = 0; i < count; i++) {
+        uint8x8x4_t block = vld4_u8(row + i * step);
+        sums[i][0] = vaddlv_u8(block.val[0]);
+        sums[i][1] = vaddlv_u8(block.val[1]);
+        sums[i][2] = vaddlv_u8(block.val[2]);
+    }
+}
+#endif
+
+static block_sums_t pick_block_sums(void) {
+#ifdef LUMA_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return block_sums_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return block_sums_sse2;
+    }
+#elif defined(__aarch64__)
+    return block_sums_neon;
+#endif
+    return block_sums_scalar;
+}
+
+int luma_pct_cpu(const struct LumaSettings *settings, struct LumaCpu *state, const unsigned char *pixels,
+        uint32_t width, uint32_t height, uint32_t stride, bool blue_first, double *difference) {
+    static block_sums_t block_sums = NULL;
+    if (block_sums == NULL) {
+        block_sums = pick_block_sums();
+    }
+
+    uint32_t region[4];
+    luma_region(settings, width, height, region);
+
+    // Blocks are spread evenly over the region, each one averages a few neighbouring pixels
+    uint32_t cols = fmax(fmin(region[2] / CPU_BLOCK_WIDTH, CPU_GRID_SIZE), 1);
+    uint32_t rows = fmin(region[3], CPU_GRID_SIZE);
+    uint32_t step_x = region[2] / cols;
+    uint32_t step_y = region[3] / rows;
+    uint32_t start_x = region[0] + (step_x > CPU_BLOCK_WIDTH ? (step_x - CPU_BLOCK_WIDTH) / 2 : 0);
+    if (start_x + CPU_BLOCK_WIDTH > width) {
+        start_x = width > CPU_BLOCK_WIDTH ? width - CPU_BLOCK_WIDTH : 0;
+    }
+    block_sums_t sums_of = width >= CPU_BLOCK_WIDTH ? block_sums : NULL;
+
+    uint32_t sums[CPU_GRID_SIZE][3];
+    uint32_t histogram[LUMA_HISTOGRAM_BINS] = { 0 };
+    double thumbnail_sum[THUMBNAIL_SIZE * THUMBNAIL_SIZE] = { 0 };
+    uint32_t thumbnail_weight[THUMBNAIL_SIZE * THUMBNAIL_SIZE] = { 0 };
+    double rgb_sum[3] = { 0, 0, 0 }, weight_sum = 0;
+    int red_idx = blue_first ? 2 : 0, blue_idx = blue_first ? 0 : 2;
+
+    // Frames narrower than a block have nothing to sample
+    for (uint32_t y = 0; y < rows && sums_of; y++) {
+        const unsigned char *row = pixels + (size_t)(region[1] + y * step_y + step_y / 2) * stride + (size_t)start_x * 4;
+        sums_of(row, cols, (size_t)step_x * 4, sums);
+
+        for (uint32_t x = 0; x < cols; x++) {
+            double r = sums[x][red_idx] / (255.0 * CPU_BLOCK_WIDTH);
+            double g = sums[x][1] / (255.0 * CPU_BLOCK_WIDTH);
+            double b = sums[x][blue_idx] / (255.0 * CPU_BLOCK_WIDTH);
+
+            double weight = luma_region_weight(settings, (x + 0.5) / cols, (y + 0.5) / rows);
+            rgb_sum[0] += r * weight;
+            rgb_sum[1] += g * weight;
+            rgb_sum[2] += b * weight;
+            weight_sum += weight;
+
+            int cell = (y * THUMBNAIL_SIZE / rows) * THUMBNAIL_SIZE + x * THUMBNAIL_SIZE / cols;
+            thumbnail_sum[cell] += 0.241 * r + 0.691 * g + 0.068 * b;
+            thumbnail_weight[cell]++;
+
+            double luma = sqrt(0.241 * r * r + 0.691 * g * g + 0.068 * b * b);
+            histogram[(int)fmin(luma * LUMA_HISTOGRAM_BINS, LUMA_HISTOGRAM_BINS - 1)] += round(weight * 255.0);
+        }
+    }
+
+    // Same static content detection as the shader, cells without samples keep their value
+    double max_difference = 0;
+    for (int i = 0; i < THUMBNAIL_SIZE * THUMBNAIL_SIZE; i++) {
+        float current = thumbnail_weight[i] > 0 ? thumbnail_sum[i] / thumbnail_weight[i] : state->previous[i];
+        max_difference = fmax(max_difference, fabs(current - state->previous[i]));
+        state->previous[i] = current;
+    }
+    *difference = state->valid ? max_difference * 100.0 : 100.0;
+    state->valid = true;
+
+    if (settings->statistic != LUMA_MEAN) {
+        return luma_histogram_pct(settings, histogram);
+    }
+
+    double r = weight_sum > 0 ? rgb_sum[0] / weight_sum : 0;
+    double g = weight_sum > 0 ? rgb_sum[1] / weight_sum : 0;
+    double b = weight_sum > 0 ? rgb_sum[2] / weight_sum : 0;
+    return sqrt(0.241 * r * r + 0.691 * g * g + 0.068 * b * b) * 100.0;
+}
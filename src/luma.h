@@ -0,0 +1,55 @@
+#ifndef WLUMA_LUMA_H
+#define WLUMA_LUMA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Reduction of frames to luma shared by the GPU and CPU paths
+
+#define THUMBNAIL_SIZE                16
+#define LUMA_HISTOGRAM_BINS           64 // must match HISTOGRAM_BINS in shader/luma.comp
+
+enum RegionMode {
+    REGION_FULL,
+    REGION_CENTER_WEIGHTED,
+    REGION_RECT,
+};
+
+enum LumaStatistic {
+    LUMA_MEAN,
+    LUMA_PERCENTILE,
+    LUMA_MODE,
+};
+
+// How frames are reduced to luma, see README.md
+struct LumaSettings {
+    // Part of the frame that is analyzed, rectangle is x, y, width, height as fractions of the frame
+    enum RegionMode region_mode;
+    double region[4];
+
+    // Percentile is a fraction
+    enum LumaStatistic statistic;
+    double percentile;
+};
+
+// Thumbnail of the previous frame of an output analyzed on the CPU
+struct LumaCpu {
+    float previous[THUMBNAIL_SIZE * THUMBNAIL_SIZE];
+    bool valid;
+};
+
+// Region in pixels as x, y, width, height, never empty
+void luma_region(const struct LumaSettings *settings, uint32_t width, uint32_t height, uint32_t region[4]);
+
+// Same as in shader/luma.comp, x and y are relative to the region
+double luma_region_weight(const struct LumaSettings *settings, double x, double y);
+
+// Percentile or mode of the histogram, weights are scaled by 255
+int luma_histogram_pct(const struct LumaSettings *settings, const uint32_t histogram[LUMA_HISTOGRAM_BINS]);
+
+// Samples a grid of the 4 byte pixels, blue_first tells whether byte 0 of a pixel is blue or red.
+// Difference is the largest change since the previous frame of the state, in percent
+int luma_pct_cpu(const struct LumaSettings *settings, struct LumaCpu *state, const unsigned char *pixels,
+    uint32_t width, uint32_t height, uint32_t stride, bool blue_first, double *difference);
+
+#endif
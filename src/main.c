@@ -1,28 +1,103 @@
 #define _POSIX_C_SOURCE 200809L
 
 #include <dirent.h>
+#include <drm_fourcc.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <float.h>
+#include <math.h>
 #include <signal.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <linux/netlink.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <time.h>
-#include <vulkan/vulkan.h>
 #include <wayland-client.h>
 
+#ifdef HAVE_LOGIND
+#include <systemd/sd-bus.h>
+#endif
+
+#ifdef HAVE_IMAGE_COPY
+#include <gbm.h>
+#include "ext-image-capture-source-v1-client-protocol.h"
+#include "ext-image-copy-capture-v1-client-protocol.h"
+#endif
+
+#include "ext-idle-notify-v1-client-protocol.h"
+#include "linux-dmabuf-unstable-v1-client-protocol.h"
 #include "wlr-export-dmabuf-unstable-v1-client-protocol.h"
+#include "wlr-output-power-management-unstable-v1-client-protocol.h"
+#include "wlr-screencopy-unstable-v1-client-protocol.h"
+#include "ddc.h"
+#ifdef WLUMA_ALLOC_STATS
+#include "alloc.h"
+#endif
+#include "vulkan.h"
 
 #define FRAME_REQUEST_DELAY_NS        (100 * 1000000L)
+#define FRAME_MAX_DELAY_MS            "2000"
+#define BATTERY_FRAME_DELAY_MS        "500"
+#define BATTERY_MAX_FRAME_DELAY_MS    "5000"
+#define IDLE_TIMEOUT_MS               "60000"
+#define POWER_SUPPLY_BASE_PATH        "/sys/class/power_supply"
+#define DRM_CONNECTOR_BASE_PATH       "/sys/class/drm"
+#define DRI_PATH                      "/dev/dri"
+#define IMAGE_COPY_BUFFERS            2 // per output, the compositor fills one while the GPU still reads the other
+#define EXPORT_FRAMES                 (VULKAN_SLOTS + 1) // per output, one is received while slots hold the others
+#define ALLOC_WARMUP_FRAMES           100 // frames after which heap allocations are expected to stop
+#define FRAME_CHANGE_THRESHOLD        1.0 // largest thumbnail cell change in percent still seen as static
 #define VULKAN_FENCE_MAX_WAIT_NS      (100 * 1000000L)
 #define BACKLIGHT_TRANSITION_DELAY_NS (200 * 1000000L)
+#define BACKLIGHT_TRANSITION_STEP_NS  (4 * 1000000L) // shortest time between two writes
 #define PENDING_COUNTDOWN_RESET       15
-#define AVG_LUX_WINDOW_SIZE           10
+#define LUX_FILTER_WINDOW             10 // samples of box and median filters, and before any filter is trusted
+#define LUX_FILTER_TIME_CONSTANT_MS   "1000"
+#define LUX_FILTER_DEADBAND           "0" // percent filtered lux has to move by before it propagates
+#define LUX_KALMAN_NOISE              0.1 // sensor noise relative to lux
+#define LUX_KALMAN_OUTLIERS           3   // samples in a row outside the gate that are a real change, not a spike
 #define BUF_SIZE                      1024
-#define LAST_MIP_LEVEL                4
+#define VULKAN_FENCE_POLL_MS          1
+#define MAX_EVENTS                    16
+#define LIGHT_SENSOR_BASE_PATH        "/sys/bus/iio/devices"
+#define LIGHT_SENSOR_BUFFER_LENGTH    "16"
+#define LIGHT_SENSOR_MAX_CHANNELS     32
+#define DATA_GRID_SIZE                10
+#define DATA_GRID_CELLS               (DATA_GRID_SIZE * DATA_GRID_SIZE)
+#define PREDICTION_LUX_BUCKETS        101
+#define PREDICTION_LUMA_BUCKETS       51
+#define DATA_FILE_MAGIC               "WLDB"
+#define DATA_FILE_VERSION             2
+#define DATA_RECORD_ADD               1
+#define DATA_RECORD_REMOVE            2
+#define DATA_COMPACT_MIN_RECORDS      256
+#define DATA_MAX_POINTS               "1000"
+#define DATA_MAX_AGE_DAYS             "365" // points not reinforced for this long are evicted, 0 keeps them forever
+#define DATA_HALF_LIFE_DAYS           90  // weight of a point halves when it isn't reinforced for this long
+#define DATA_MERGE_RADIUS             2   // in normalized lux x luma, like distances of predictions
+#define DATA_MERGE_BACKLIGHT          5   // difference of backlight that still counts as the same preference
+#define DATA_AGE_SCAN                 64  // points checked for their age after each learning event
+#define TRACE_FILE_MAGIC              "WLTR"
+#define TRACE_FILE_VERSION            2
+#define TRACE_USER_ADJUSTED           1 // backlight was changed by the user rather than by wluma
+#define STATS_BUCKETS                 24 // powers of two of microseconds, last one holds everything slower
+#define IPC_SOCKET_NAME               "wluma.sock"
+#define IPC_MAX_CLIENTS               16
+#define IPC_LINE_MAX                  256
+#define IPC_BACKLOG_MAX               (64 * 1024) // unsent output of a client that stops reading, it is dropped beyond this
 
 static char buf[BUF_SIZE];
 
@@ -31,44 +106,391 @@ struct Vector {
 };
 
 struct DataPoint {
-    struct DataPoint *next;
-    struct DataPoint *prev;
     long lux;
     int luma;
     int backlight;
 };
 
-struct Vulkan {
-    VkInstance instance;
-    VkDevice device;
-    VkQueue queue;
-    VkCommandPool command_pool;
-    VkCommandBuffer command_buffer;
-    VkBuffer buffer;
-    VkDeviceMemory buffer_memory;
-    VkFence fence;
+// Learned points as separate arrays, indexed by a uniform grid over normalized lux x luma
+struct DataStore {
+    size_t count;
+    size_t capacity;
+    long *lux;
+    int *luma;
+    int *backlight;
+    long lux_max_seen;
+
+    // Points merged into each one and when it was last reinforced, in seconds
+    uint32_t *weight;
+    int64_t *learned;
+    size_t age_cursor;
+
+    // Points of cell c are cell_points[cell_start[c]..cell_start[c + 1]]
+    uint32_t cell_start[DATA_GRID_CELLS + 1];
+    uint32_t *cell_points;
+
+    // Predicted backlight per luma x normalized lux bucket, negative until computed
+    float *prediction;
+};
+
+// Records of the data file are replayed in order on load
+struct DataRecord {
+    int64_t lux;
+    int32_t luma;
+    int16_t backlight;
+    uint8_t op;
+    uint8_t reserved;
+    uint32_t weight;
+    uint32_t learned;
+};
+
+// Records of version 1 data files, migrated on load
+struct DataRecordV1 {
+    int64_t lux;
+    int32_t luma;
+    int16_t backlight;
+    uint8_t op;
+    uint8_t reserved;
+};
+
+struct DataFileHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t record_size;
+    uint32_t reserved;
+};
+
+// Samples of the frame path written by --record, trace files share the header with data files
+struct TraceRecord {
+    uint64_t time_ns;
+    int32_t lux;
+    float difference;
+    uint8_t luma;
+    uint8_t backlight;
+    uint8_t flags;
+    uint8_t reserved;
+    uint32_t output; // registry name of the output
+};
+
+struct DataJournal {
+    struct DataRecord *records;
+    size_t count;
+    size_t capacity;
+};
+
+struct Context;
+struct EventSource;
+
+typedef void (*event_handler_t)(struct Context *ctx, struct EventSource *source, uint32_t events);
+
+struct EventSource {
+    int fd;
+    event_handler_t handler;
+    void *data;
+};
+
+struct WaylandOutput;
+
+// Samples of an IIO device in buffered mode, only the illuminance channel is decoded
+struct LightSensorBuffer {
+    char *path;
+    struct EventSource source;
+    bool enabled_channel;
+    bool enabled_buffer;
+
+    // Layout of the channel within a sample
+    uint32_t sample_size;
+    uint32_t offset;
+    uint32_t bytes;
+    uint32_t bits;
+    uint32_t shift;
+    bool big_endian;
+    bool is_signed;
+};
+
+// Rewrite of the data file without removed points, done on a separate thread
+struct DataCompaction {
+    pthread_t thread;
+    bool running;
+    bool ok;
+    int fd;
+    struct DataJournal snapshot;
+    struct DataJournal backlog;
+    struct EventSource done;
+};
+
+enum LuxFilterKind {
+    LUX_FILTER_BOX,
+    LUX_FILTER_EMA,
+    LUX_FILTER_MEDIAN,
+    LUX_FILTER_KALMAN,
+};
+
+// How ambient light is smoothed before it reaches prediction, see README.md
+struct LuxFilterSettings {
+    enum LuxFilterKind kind;
+    double time_constant_ns;
+    double deadband;
+};
+
+// Bounds of learned data, ages are in seconds and 0 disables aging
+struct DataSettings {
+    size_t max_points;
+    int64_t max_age;
 };
 
-struct Frame {
-    struct zwlr_export_dmabuf_frame_v1* frame;
+// Updated in constant time per sample, whichever filter is used
+struct LuxFilter {
+    // Last samples, their sum for the box filter and a sorted copy for the median
+    long window[LUX_FILTER_WINDOW];
+    long sorted[LUX_FILTER_WINDOW];
+    int next;
+    int count;
+    long sum;
+
+    // EMA and Kalman state
+    double estimate;
+    double variance;
+    int outliers;
+    uint64_t updated;
+
+    // Handed on to prediction, only follows the filter once it moves beyond the deadband
+    long value;
+    bool initialized;
+};
+
+enum Easing {
+    EASING_LINEAR,
+    EASING_EASE_OUT,
+    EASING_EASE_IN_OUT,
+};
+
+struct Backlight;
+
+// Ways to change brightness, logind doesn't need write access to sysfs
+struct BacklightOps {
+    long (*read)(struct Backlight *bl);
+    bool (*write)(struct Backlight *bl, long raw);
+};
+
+// Stages of the frame path that are timed
+enum Stat {
+    STAT_CAPTURE,
+    STAT_IMPORT,
+    STAT_GPU,
+    STAT_READBACK,
+    STAT_READ_LUX,
+    STAT_READ_BACKLIGHT,
+    STAT_PREDICT,
+    STAT_BACKLIGHT_WRITE,
+    STAT_COUNT,
+};
+
+struct StatTimer {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STATS_BUCKETS];
+};
+
+// Always collected, a sample costs two reads of the monotonic clock and is only formatted on SIGUSR1
+struct Stats {
+    struct timespec started;
+    struct StatTimer timers[STAT_COUNT];
+
+    // Startup, nanoseconds on the monotonic clock, 0 until it happens
+    uint64_t launched;
+    uint64_t first_frame;
+    uint64_t first_adjustment;
+
+    uint64_t frames_captured;
+    uint64_t frames_unchanged;
+    uint64_t frames_dropped;
+    uint64_t frames_cancelled;
+
+    // Heap allocations once warmed up, counted when built with alloc_stats
+    uint64_t warm_allocs;
+};
+
+// Brightness of a single display, learned independently from others
+struct Backlight {
+    struct WaylandOutput *output;
+    char *device;
+    const struct BacklightOps *ops;
+    int raw_fd;
+    long max;
+
+    // External monitor controlled over DDC/CI, NULL for sysfs devices
+    struct DdcMonitor *ddc;
+    int last;
+
+    // Raw value last written, or the one found when the backlight was opened
+    long written;
+
+    // Kernel notifies changes on actual_brightness, the value is only read again then instead of with every frame
+    struct EventSource change_source;
+    long raw;
+
+    // Transition in progress, stepped by a timer towards the target in raw units
+    bool transition_active;
+    long transition_from;
+    long transition_target;
+    long transition_interval;
+    struct timespec transition_started;
+    struct EventSource transition_timer;
+
+    // Data points to determine the best backlight value
+    int data_fd;
+    char *data_path;
+    size_t data_records;
+    struct DataStore data;
+    struct DataJournal journal;
+    struct DataCompaction compaction;
+
+    // Pending change data point
+    struct DataPoint pendingDataPoint;
+    int pendingCountdown;
+
+    // Pinned through the control socket, wluma neither learns nor predicts meanwhile
+    bool pinned;
+
+    // Raw value of the simulated device during replay
+    long replay_raw;
+};
+
+// Shared memory buffer frames are copied into, kept as long as the frames keep their shape
+struct ShmBuffer {
+    struct wl_buffer *buffer;
+    unsigned char *data;
+    size_t size;
     uint32_t width;
     uint32_t height;
-    uint32_t num_objects;
+    uint32_t stride;
+    uint32_t format;
+};
+
+// Buffer image copy capture fills, reused for as long as the session keeps its constraints
+struct ImageCopyBuffer {
+    // Frame has no capture object, frame_free hands it back to the pool
+    struct Frame frame;
+    struct gbm_bo *bo;
+    struct wl_buffer *buffer;
+
+    // Filled by the compositor or read by the GPU, destroyed once released when constraints changed meanwhile
+    bool busy;
+    bool stale;
+};
+
+enum PowerSource {
+    POWER_AC,
+    POWER_BATTERY,
+};
+
+// Delays between frames, capture slows down from the shortest to the longest while frames don't change
+struct CaptureProfile {
+    long min_delay;
+    long max_delay;
+};
 
-    uint32_t sizes[4];
-    int32_t  fds[4];
+// What subscribers of the control socket see of an output
+struct IpcState {
+    bool valid;
+    int luma;
+    long lux;
+    int backlight;
+    bool pinned;
 };
 
-struct VulkanFrame {
-    uint32_t mip_levels;
-    VkImage image;
-    VkDeviceMemory image_memory;
+// Client of the control socket, freed once the current events are dispatched
+struct IpcClient {
+    struct EventSource source;
+    struct wl_list link;
+    bool subscribed;
+    bool closed;
+
+    char in[IPC_LINE_MAX];
+    size_t in_len;
+    char *out;
+    size_t out_len;
+    size_t out_capacity;
 };
 
 struct WaylandOutput {
     struct wl_output *output;
     struct wl_list link;
     uint32_t id;
+    uint32_t version;
+    char *name;
+    struct Context *ctx;
+
+    // Output is configured once its initial properties are received
+    bool configured;
+    bool active;
+    bool removed;
+
+    // Main frame callback
+    struct zwlr_export_dmabuf_frame_v1 *frame_callback;
+    struct EventSource capture_timer;
+
+    // Grows while frames don't change, reset on the first one that does
+    long capture_delay;
+
+    // DMA-BUF frame being received, one of the export frames that are free while they have no capture object
+    struct Frame *frame;
+    struct Frame export_frames[EXPORT_FRAMES];
+
+    // Image copy capture, compositor holds the frame until the output changes, export-dmabuf takes over once stopped
+    struct ext_image_capture_source_v1 *image_source;
+    struct ext_image_copy_capture_session_v1 *image_session;
+    struct ext_image_copy_capture_frame_v1 *image_frame;
+    struct ImageCopyBuffer *image_buffer;
+    struct ImageCopyBuffer *image_buffers[IMAGE_COPY_BUFFERS];
+    bool image_wanted;
+    bool image_stopped;
+
+    // Constraints offered by the session, buffers are allocated from them once they are done
+    uint32_t image_width;
+    uint32_t image_height;
+    uint32_t image_format;
+    uint64_t *image_modifiers;
+    size_t image_modifier_count;
+
+    // Bounding box of what changed and when it was presented, sent along with the frame
+    int32_t image_damage[4];
+    bool image_damaged;
+    uint32_t image_presented[3];
+
+    // Luma of the last analyzed frame, repeated while nothing changes on screen
+    int luma;
+    bool luma_valid;
+
+    // Frame copy of the CPU path, analyzed once the compositor filled the buffer
+    struct zwlr_screencopy_frame_v1 *copy_frame;
+    struct ShmBuffer shm;
+    bool shm_usable;
+    bool shm_unsupported; // warned about the format already
+    struct LumaCpu luma_cpu;
+
+    // Import cache and in-flight slots of this output
+    struct VulkanOutput vulkan;
+
+    // Ambient light seen along with the frames of this output
+    struct LuxFilter lux_filter;
+
+    // Power mode reported by the compositor, nothing is captured while the output is off
+    struct zwlr_output_power_v1 *power;
+    bool power_off;
+
+    // NULL while no backlight is attached to this output
+    struct Backlight *backlight;
+
+    // Monitor that is still being probed, its backlight is attached once it answers
+    struct DdcMonitor *ddc_probe;
+    struct EventSource ddc_probed;
+    char *ddc_device;
+
+    // Last state sent to subscribers of the control socket
+    struct IpcState ipc_state;
 };
 
 struct Context {
@@ -76,42 +498,105 @@ struct Context {
     struct wl_list *outputs;
     struct zwlr_export_dmabuf_manager_v1 *dmabuf_manager;
 
-    // Target
-    struct WaylandOutput *target_output;
+    // DRM device of the compositor, frames are imported into the Vulkan device that owns it
+    struct zwp_linux_dmabuf_v1 *linux_dmabuf;
+    dev_t drm_device;
+    bool drm_device_known;
 
-    // Main frame callback
-    struct zwlr_export_dmabuf_frame_v1 *frame_callback;
+    // Removed outputs are freed once current events are dispatched
+    struct wl_list removed_outputs;
+    bool running;
 
-    // Vulkan context
+    // Vulkan context, sync fds of its submissions are watched by the event loop
     struct Vulkan *vulkan;
+    struct EventSource fence_sources[VULKAN_SUBMITS];
 
-    // DMA-BUF frame
-    struct Frame *frame;
+    // Drivers are loaded on a helper thread while the rest of init runs
+    pthread_t vulkan_thread;
+    bool vulkan_thread_running;
+    char *pipeline_cache_path;
+
+    // Damage driven capture into buffers allocated on the render node of the DRM device, preferred over export-dmabuf
+    struct ext_output_image_capture_source_manager_v1 *image_source_manager;
+    struct ext_image_copy_capture_manager_v1 *image_copy_manager;
+    struct gbm_device *gbm;
+    int gbm_fd;
 
-    // Vulkan structs for processing frames, might be reused
-    struct VulkanFrame *vulkan_frame;
+    // Frames are copied into shared memory and analyzed on the CPU while there is no Vulkan context
+    struct zwlr_screencopy_manager_v1 *screencopy_manager;
+    struct wl_shm *shm;
+    struct LumaSettings settings;
 
     // Ambient light sensor raw data
     int light_sensor_raw_fd;
     double light_sensor_scale;
     double light_sensor_offset;
-    long lux_max_seen;
-    long lux_window[AVG_LUX_WINDOW_SIZE];
-    int lux_window_next_idx;
-    bool lux_avg_initialized;
-
-    // Backlight control
-    int backlight_raw_fd;
-    long backlight_max;
-    int backlight_last;
 
-    // Data points to determine the best backlight value
-    int data_fd;
-    struct DataPoint *data;
-
-    // Pending change data point
-    struct DataPoint pendingDataPoint;
-    int pendingCountdown;
+    // Sensor pushing samples through its IIO buffer, NULL while polling sysfs instead
+    char *light_sensor_device;
+    struct LightSensorBuffer *light_sensor_buffer;
+    double light_sensor_raw;
+
+    // Backlight device used by the internal panel and where data files live
+    char *backlight_raw_base_path;
+    char *backlight_device;
+    char *data_dir;
+
+    // Capture slows down from the first delay up to the second one while frames don't change, see capture_profiles
+    long frame_min_delay;
+    long frame_max_delay;
+
+    // Capture stopped through the control socket
+    bool paused;
+
+    // Capture is suspended while the seat is idle, profile follows the power source
+    struct ext_idle_notifier_v1 *idle_notifier;
+    struct ext_idle_notification_v1 *idle_notification;
+    struct wl_seat *seat;
+    long idle_timeout;
+    bool idle;
+    struct zwlr_output_power_manager_v1 *output_power_manager;
+    struct CaptureProfile capture_profiles[2];
+    enum PowerSource power;
+    struct EventSource uevent_source;
+
+    // Shape of backlight transitions
+    enum Easing transition_easing;
+
+    // Smoothing of ambient light, state is kept per output
+    struct LuxFilterSettings lux_filter;
+
+    // Size and age of learned data
+    struct DataSettings data_settings;
+
+    // Where the time of the frame path goes, dumped on SIGUSR1
+    struct Stats stats;
+
+    // Trace written by --record, -1 when not recording
+    int trace_fd;
+    uint64_t trace_started;
+
+    // Replay runs on a virtual clock that follows the trace
+    bool virtual_clock;
+    struct timespec virtual_now;
+
+#ifdef HAVE_LOGIND
+    // System bus for logind, connected once a backlight needs it
+    sd_bus *bus;
+    struct EventSource bus_source;
+#endif
+
+    // Event loop
+    int epoll_fd;
+    struct EventSource wayland_source;
+    struct EventSource signal_source;
+
+    // Control socket under $XDG_RUNTIME_DIR, NULL path when there is none
+    char *ipc_path;
+    struct EventSource ipc_source;
+    struct wl_list ipc_clients;
+    int ipc_client_count;
+    int ipc_subscribers;
 
     // Errors
     bool quit;
@@ -123,19 +608,21 @@ struct Context {
  * Utilities
  */
 
+// Runs for every frame, sysfs values are short and the shared buffer is left alone
 static double pread_double(int fd) {
-    int count = pread(fd, buf, BUF_SIZE, 0);
+    char str[64];
+    int count = pread(fd, str, sizeof(str) - 1, 0);
     if (count < 1) {
         return -1;
     }
-    buf[count] = 0;
-    return strtod(buf, NULL);
+    str[count] = 0;
+    return strtod(str, NULL);
 }
 
-static void pwrite_long(int fd, long val) {
-    int len = sprintf(buf, "%ld", val);
-    ftruncate(fd, 0);
-    pwrite(fd, buf, len, 0);
+static bool pwrite_long(int fd, long val) {
+    char str[32];
+    int len = sprintf(str, "%ld", val);
+    return pwrite(fd, str, len, 0) == len;
 }
 
 static char* get_env(char *name, char *def) {
@@ -143,12 +630,215 @@ static char* get_env(char *name, char *def) {
     return val ? val : def;
 }
 
-static long calc_avg_lux(struct Context *ctx) {
-    long sum = 0;
-    for (int i=0; i<AVG_LUX_WINDOW_SIZE; i++) {
-        sum += ctx->lux_window[i];
+
+/******************************************************************************
+ * Statistics
+ */
+
+static const char *stat_names[STAT_COUNT] = {
+    [STAT_CAPTURE]         = "capture",
+    [STAT_IMPORT]          = "import",
+    [STAT_GPU]             = "gpu",
+    [STAT_READBACK]        = "readback",
+    [STAT_READ_LUX]        = "read lux",
+    [STAT_READ_BACKLIGHT]  = "read backlight",
+    [STAT_PREDICT]         = "predict",
+    [STAT_BACKLIGHT_WRITE] = "backlight write",
+};
+
+static uint64_t timespec_ns(struct timespec *ts) {
+    return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static uint64_t stats_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_ns(&now);
+}
+
+static void stats_add(struct Stats *stats, enum Stat stat, uint64_t ns) {
+    struct StatTimer *timer = &stats->timers[stat];
+    uint64_t us = ns / 1000;
+    int bucket = us == 0 ? 0 : 64 - __builtin_clzll(us);
+    if (bucket > STATS_BUCKETS - 1) {
+        bucket = STATS_BUCKETS - 1;
+    }
+
+    timer->count++;
+    timer->total_ns += ns;
+    if (ns > timer->max_ns) {
+        timer->max_ns = ns;
+    }
+    timer->buckets[bucket]++;
+}
+
+// Time elapsed since start, as returned by stats_now
+static void stats_since(struct Stats *stats, enum Stat stat, uint64_t start) {
+    stats_add(stats, stat, stats_now() - start);
+}
+
+// Upper bound of the bucket holding the percentile, in microseconds
+static uint64_t stats_percentile_us(struct StatTimer *timer, double pct) {
+    uint64_t rank = ceil(timer->count * pct);
+    uint64_t seen = 0;
+    for (int i = 0; i < STATS_BUCKETS - 1; i++) {
+        seen += timer->buckets[i];
+        if (seen >= rank) {
+            return 1ULL << i;
+        }
+    }
+    return timer->max_ns / 1000;
+}
+
+static void stats_dump(struct Stats *stats) {
+    double uptime = (stats_now() - timespec_ns(&stats->started)) / 1e9;
+    fprintf(stderr, "Stats after %.0fs: %llu frames captured, %llu unchanged, %llu dropped, %llu cancelled\n", uptime,
+        (unsigned long long)stats->frames_captured, (unsigned long long)stats->frames_unchanged,
+        (unsigned long long)stats->frames_dropped, (unsigned long long)stats->frames_cancelled);
+    if (stats->first_frame) {
+        fprintf(stderr, "Startup: first frame after %.1fms", (stats->first_frame - stats->launched) / 1e6);
+        if (stats->first_adjustment) {
+            fprintf(stderr, ", first adjustment after %.1fms", (stats->first_adjustment - stats->launched) / 1e6);
+        }
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "%-16s %10s %10s %10s %10s %10s\n", "stage", "count", "mean us", "p50 us", "p99 us", "max us");
+
+    for (int i = 0; i < STAT_COUNT; i++) {
+        struct StatTimer *timer = &stats->timers[i];
+        if (timer->count == 0) {
+            continue;
+        }
+
+        fprintf(stderr, "%-16s %10llu %10.1f %10llu %10llu %10.1f\n", stat_names[i], (unsigned long long)timer->count,
+            timer->total_ns / 1000.0 / timer->count,
+            (unsigned long long)stats_percentile_us(timer, 0.5), (unsigned long long)stats_percentile_us(timer, 0.99),
+            timer->max_ns / 1000.0);
+    }
+
+#ifdef WLUMA_ALLOC_STATS
+    uint64_t allocs = alloc_count();
+    fprintf(stderr, "Heap allocations: %llu in total", (unsigned long long)allocs);
+    if (stats->frames_captured > ALLOC_WARMUP_FRAMES) {
+        fprintf(stderr, ", %llu during the last %llu frames", (unsigned long long)(allocs - stats->warm_allocs),
+            (unsigned long long)(stats->frames_captured - ALLOC_WARMUP_FRAMES));
+    }
+    fprintf(stderr, "\n");
+#endif
+}
+
+
+/******************************************************************************
+ * Ambient light filters
+ */
+
+static struct LuxFilterSettings read_lux_filter(void) {
+    struct LuxFilterSettings settings = {
+        .kind             = LUX_FILTER_BOX,
+        .time_constant_ns = fmax(strtod(get_env("WLUMA_LUX_TIME_CONSTANT_MS", LUX_FILTER_TIME_CONSTANT_MS), NULL), 1) * 1e6,
+        .deadband         = fmax(strtod(get_env("WLUMA_LUX_DEADBAND", LUX_FILTER_DEADBAND), NULL), 0) / 100.0,
+    };
+
+    char *kind = get_env("WLUMA_LUX_FILTER", "box");
+    if (!strcmp(kind, "ema")) {
+        settings.kind = LUX_FILTER_EMA;
+    } else if (!strcmp(kind, "median")) {
+        settings.kind = LUX_FILTER_MEDIAN;
+    } else if (!strcmp(kind, "kalman")) {
+        settings.kind = LUX_FILTER_KALMAN;
+    } else if (strcmp(kind, "box")) {
+        fprintf(stderr, "WARN: Unknown lux filter: %s, using box!\n", kind);
+    }
+    return settings;
+}
+
+// Window is tiny, keeping it sorted costs less than selecting the median every time
+static void lux_window_push(struct LuxFilter *filter, long lux) {
+    bool full = filter->count == LUX_FILTER_WINDOW;
+    long oldest = filter->window[filter->next];
+    filter->window[filter->next] = lux;
+    filter->next = (filter->next + 1) % LUX_FILTER_WINDOW;
+    filter->sum += lux - (full ? oldest : 0);
+
+    int n = filter->count;
+    if (full) {
+        int i = 0;
+        while (filter->sorted[i] != oldest) {
+            i++;
+        }
+        memmove(&filter->sorted[i], &filter->sorted[i + 1], (n - i - 1) * sizeof(long));
+        n--;
+    }
+
+    int i = n;
+    for (; i > 0 && filter->sorted[i - 1] > lux; i--) {
+        filter->sorted[i] = filter->sorted[i - 1];
+    }
+    filter->sorted[i] = lux;
+    filter->count = n + 1;
+}
+
+// Spikes outside the gate are ignored, unless they keep coming and turn out to be a real change
+static void lux_kalman_update(struct LuxFilter *filter, const struct LuxFilterSettings *settings, long lux, double elapsed) {
+    double scale = fmax(filter->estimate, 1);
+    double measurement_variance = pow(scale * LUX_KALMAN_NOISE, 2);
+    filter->variance += pow(scale * 0.5, 2) * elapsed / settings->time_constant_ns;
+
+    double innovation = lux - filter->estimate;
+    if (innovation * innovation > 9 * (filter->variance + measurement_variance)) {
+        if (++filter->outliers < LUX_KALMAN_OUTLIERS) {
+            return;
+        }
+        filter->estimate = lux;
+        filter->variance = measurement_variance;
+        filter->outliers = 0;
+        return;
+    }
+
+    double gain = filter->variance / (filter->variance + measurement_variance);
+    filter->estimate += gain * innovation;
+    filter->variance *= 1 - gain;
+    filter->outliers = 0;
+}
+
+// Returns whether the value handed on to prediction has moved
+static bool lux_filter_push(struct LuxFilter *filter, const struct LuxFilterSettings *settings, long lux, uint64_t now) {
+    bool first = filter->count == 0;
+    double elapsed = first || now < filter->updated ? 0 : now - filter->updated;
+    filter->updated = now;
+    lux_window_push(filter, lux);
+
+    if (first) {
+        filter->estimate = lux;
+        filter->variance = pow(fmax(lux, 1) * LUX_KALMAN_NOISE, 2);
+    }
+
+    switch (settings->kind) {
+    case LUX_FILTER_BOX:
+        filter->estimate = (double)filter->sum / filter->count;
+        break;
+    case LUX_FILTER_MEDIAN:
+        filter->estimate = filter->count % 2
+            ? filter->sorted[filter->count / 2]
+            : (filter->sorted[filter->count / 2 - 1] + filter->sorted[filter->count / 2]) / 2.0;
+        break;
+    case LUX_FILTER_EMA:
+        filter->estimate += (1 - exp(-elapsed / settings->time_constant_ns)) * (lux - filter->estimate);
+        break;
+    case LUX_FILTER_KALMAN:
+        lux_kalman_update(filter, settings, lux, elapsed);
+        break;
+    }
+    filter->initialized = filter->initialized || filter->count == LUX_FILTER_WINDOW;
+
+    long filtered = lround(filter->estimate);
+    // Every change propagates without a deadband
+    double threshold = settings->deadband > 0 ? fmax(1, filter->value * settings->deadband) : 0;
+    if (first || labs(filtered - filter->value) > threshold) {
+        filter->value = filtered;
+        return true;
     }
-    return sum / AVG_LUX_WINDOW_SIZE;
+    return false;
 }
 
 
@@ -226,691 +916,3718 @@ static struct Vector vector_scale(struct Vector *a, double scale) {
  * Data points
  */
 
-static struct DataPoint* data_add(struct Context *ctx, long lux, int luma, int backlight) {
-    struct DataPoint *point = malloc(sizeof(struct DataPoint));
-    point->lux = lux;
-    point->luma = luma;
-    point->backlight = backlight;
+static struct DataSettings read_data_settings(void) {
+    struct DataSettings settings = {
+        .max_points = fmax(strtol(get_env("WLUMA_DATA_MAX_POINTS", DATA_MAX_POINTS), NULL, 10), 0),
+        .max_age    = fmax(strtod(get_env("WLUMA_DATA_MAX_AGE_DAYS", DATA_MAX_AGE_DAYS), NULL), 0) * 86400,
+    };
+    return settings;
+}
 
-    if (ctx->data) {
-        struct DataPoint *next = ctx->data->next;
-        ctx->data->next = point;
-        point->next = next;
-        point->prev = ctx->data;
-        if (next) {
-            next->prev = point;
-        }
-    } else {
-        ctx->data = point;
-        point->next = NULL;
-        point->prev = NULL;
+// Grid cell of a data point, lux is normalized to 0..100 like luma
+static int data_cell(struct DataStore *store, long lux, int luma) {
+    int x = fmin(fmax(lux * 100.0 / store->lux_max_seen, 0), 100) * DATA_GRID_SIZE / 101;
+    int y = fmin(fmax(luma, 0), 100) * DATA_GRID_SIZE / 101;
+    return y * DATA_GRID_SIZE + x;
+}
+
+static void data_add(struct DataStore *store, long lux, int luma, int backlight, uint32_t weight, int64_t learned) {
+    if (store->count == store->capacity) {
+        store->capacity = store->capacity ? store->capacity * 2 : 64;
+        store->lux = realloc(store->lux, store->capacity * sizeof(long));
+        store->luma = realloc(store->luma, store->capacity * sizeof(int));
+        store->backlight = realloc(store->backlight, store->capacity * sizeof(int));
+        store->weight = realloc(store->weight, store->capacity * sizeof(uint32_t));
+        store->learned = realloc(store->learned, store->capacity * sizeof(int64_t));
+        store->cell_points = realloc(store->cell_points, store->capacity * sizeof(uint32_t));
     }
 
-    return point;
+    store->lux[store->count] = lux;
+    store->luma[store->count] = luma;
+    store->backlight[store->count] = backlight;
+    store->weight[store->count] = weight;
+    store->learned[store->count] = learned;
+    store->count++;
+}
+
+// Order of points doesn't matter, last point takes the place of the removed one
+static void data_remove(struct DataStore *store, size_t idx) {
+    store->count--;
+    store->lux[idx] = store->lux[store->count];
+    store->luma[idx] = store->luma[store->count];
+    store->backlight[idx] = store->backlight[store->count];
+    store->weight[idx] = store->weight[store->count];
+    store->learned[idx] = store->learned[store->count];
 }
 
-static struct DataPoint* data_remove(struct Context *ctx, struct DataPoint *point) {
-    if (ctx->data == point) {
-        ctx->data = ctx->data->next;
+static void data_free(struct DataStore *store) {
+    free(store->lux);
+    free(store->luma);
+    free(store->backlight);
+    free(store->weight);
+    free(store->learned);
+    free(store->cell_points);
+    free(store->prediction);
+    memset(store, 0, sizeof(struct DataStore));
+}
+
+// Rebuild grid index and drop cached predictions, must be called after the points or lux_max_seen change
+static void data_index(struct DataStore *store) {
+    memset(store->cell_start, 0, sizeof(store->cell_start));
+    if (store->lux_max_seen < 1) {
+        store->lux_max_seen = 1;
     }
 
-    struct DataPoint *next = point->next;
-    struct DataPoint *prev = point->prev;
-    if (next) {
-        next->prev = prev;
+    for (size_t i = 0; i < store->count; i++) {
+        store->cell_start[data_cell(store, store->lux[i], store->luma[i]) + 1]++;
     }
-    if (prev) {
-        prev->next = next;
+    for (int c = 0; c < DATA_GRID_CELLS; c++) {
+        store->cell_start[c + 1] += store->cell_start[c];
     }
 
-    free(point);
-    return next;
-}
-
-static void data_save(struct Context *ctx) {
-    ftruncate(ctx->data_fd, 0);
-    lseek(ctx->data_fd, 0, SEEK_SET);
+    uint32_t fill[DATA_GRID_CELLS];
+    memcpy(fill, store->cell_start, sizeof(fill));
+    for (size_t i = 0; i < store->count; i++) {
+        store->cell_points[fill[data_cell(store, store->lux[i], store->luma[i])]++] = i;
+    }
 
-    struct DataPoint *elem = ctx->data;
-    while (elem) {
-        int len = sprintf(buf, "%ld %d %d\n", elem->lux, elem->luma, elem->backlight);
-        write(ctx->data_fd, buf, len);
-        elem = elem->next;
+    // Model has changed, predictions are recomputed on demand
+    if (store->prediction == NULL) {
+        store->prediction = malloc(PREDICTION_LUMA_BUCKETS * PREDICTION_LUX_BUCKETS * sizeof(float));
+    }
+    for (int i = 0; i < PREDICTION_LUMA_BUCKETS * PREDICTION_LUX_BUCKETS; i++) {
+        store->prediction[i] = -1;
     }
 }
 
-static bool data_load(struct Context *ctx) {
-    FILE *f = fdopen(dup(ctx->data_fd), "r");
-    if (f == NULL) {
-        return false;
-    }
+// Finds up to 3 nearest points, visiting grid rings around the query until no closer point can exist
+static int data_nearest(struct DataStore *store, long lux, int luma, struct DataPoint nearest[3]) {
+    double nearest_dist[3] = { 0 };
+    int found = 0;
 
-    while (fgets(buf, BUF_SIZE, f)) {
-        long val[3];
-        char *word = NULL;
-        for (int i=0; i<3; i++) {
-            word = strtok(word == NULL ? buf : NULL, " ");
-            if (word == NULL) {
-                return false;
+    long lux_capped = fmin(lux, store->lux_max_seen);
+    int cell = data_cell(store, lux_capped, luma);
+    int cx = cell % DATA_GRID_SIZE, cy = cell / DATA_GRID_SIZE;
+
+    for (int ring = 0; ring < DATA_GRID_SIZE; ring++) {
+        for (int y = cy - ring; y <= cy + ring; y++) {
+            for (int x = cx - ring; x <= cx + ring; x++) {
+                bool on_ring = abs(x - cx) == ring || abs(y - cy) == ring;
+                if (!on_ring || x < 0 || y < 0 || x >= DATA_GRID_SIZE || y >= DATA_GRID_SIZE) {
+                    continue;
+                }
+
+                int c = y * DATA_GRID_SIZE + x;
+                for (uint32_t p = store->cell_start[c]; p < store->cell_start[c + 1]; p++) {
+                    uint32_t i = store->cell_points[p];
+                    double dist = sqrt(pow((lux_capped - store->lux[i]) * 100 / store->lux_max_seen, 2) + pow(luma - store->luma[i], 2));
+
+                    int pos = found;
+                    while (pos > 0 && dist < nearest_dist[pos - 1]) {
+                        pos--;
+                    }
+                    if (pos == 3) {
+                        continue;
+                    }
+
+                    for (int k = (found < 3 ? found : 2); k > pos; k--) {
+                        nearest[k] = nearest[k - 1];
+                        nearest_dist[k] = nearest_dist[k - 1];
+                    }
+                    nearest[pos] = (struct DataPoint) { .lux = store->lux[i], .luma = store->luma[i], .backlight = store->backlight[i] };
+                    nearest_dist[pos] = dist;
+                    found = found < 3 ? found + 1 : 3;
+                }
             }
-            val[i] = strtol(word, NULL, 10);
         }
-        data_add(ctx, val[0], val[1], val[2]);
-        ctx->lux_max_seen = fmax(fmax(ctx->lux_max_seen, val[0]), 1);
+
+        // Points beyond this ring are at least a cell away, minus integer truncation of lux distance
+        double cell_size = 101.0 / DATA_GRID_SIZE;
+        if (found == 3 && nearest_dist[2] <= ring * cell_size - 1) {
+            break;
+        }
     }
 
-    fclose(f);
-    return true;
+    return found;
 }
 
+static void journal_push(struct DataJournal *journal, uint8_t op, long lux, int luma, int backlight, uint32_t weight, int64_t learned) {
+    if (journal->count == journal->capacity) {
+        journal->capacity = journal->capacity ? journal->capacity * 2 : 16;
+        journal->records = realloc(journal->records, journal->capacity * sizeof(struct DataRecord));
+    }
 
-/******************************************************************************
- * Devices
- */
+    journal->records[journal->count++] = (struct DataRecord) {
+        .lux       = lux,
+        .luma      = luma,
+        .backlight = backlight,
+        .op        = op,
+        .weight    = weight,
+        .learned   = learned,
+    };
+}
 
-static long read_lux(struct Context *ctx) {
-    return round((pread_double(ctx->light_sensor_raw_fd) + ctx->light_sensor_offset) * ctx->light_sensor_scale);
+static void journal_free(struct DataJournal *journal) {
+    free(journal->records);
+    memset(journal, 0, sizeof(struct DataJournal));
 }
 
-static int read_backlight_pct(struct Context *ctx) {
-    return round(pread_double(ctx->backlight_raw_fd) * 100 / ctx->backlight_max);
+static void data_snapshot(struct DataStore *store, struct DataJournal *journal) {
+    for (size_t i = 0; i < store->count; i++) {
+        journal_push(journal, DATA_RECORD_ADD, store->lux[i], store->luma[i], store->backlight[i], store->weight[i], store->learned[i]);
+    }
 }
 
+// Seconds of real time, learned times of replayed points follow the virtual clock
+static int64_t data_now(struct Context *ctx) {
+    return ctx->virtual_clock ? ctx->virtual_now.tv_sec : time(NULL);
+}
 
-/******************************************************************************
- * Vulkan
- */
+// Weight of a point decays while it isn't reinforced
+static double data_score(struct DataStore *store, size_t idx, int64_t now) {
+    double age_days = fmax(now - store->learned[idx], 0) / 86400.0;
+    return store->weight[idx] * pow(0.5, age_days / DATA_HALF_LIFE_DAYS);
+}
+
+static void data_evict(struct Backlight *bl, size_t idx) {
+    struct DataStore *store = &bl->data;
+    journal_push(&bl->journal, DATA_RECORD_REMOVE, store->lux[idx], store->luma[idx], store->backlight[idx], store->weight[idx], store->learned[idx]);
+    data_remove(store, idx);
+}
 
-static void init_frame_vulkan(struct Context *ctx) {
-    if (ctx->vulkan_frame) {
-        // TODO support resized frames
+// Evicts points that weren't reinforced for too long, checking up to limit points from where the previous call stopped
+static void data_age(struct Backlight *bl, const struct DataSettings *settings, int64_t now, size_t limit) {
+    struct DataStore *store = &bl->data;
+    if (settings->max_age == 0) {
         return;
     }
 
-    ctx->vulkan_frame = malloc(sizeof(struct VulkanFrame));
-
-    ctx->vulkan_frame->mip_levels = floor(log2(fmax(ctx->frame->width, ctx->frame->height)));
-
-    VkImageCreateInfo imageInfo = {
-        .sType         = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-        .imageType     = VK_IMAGE_TYPE_2D,
-        .format        = VK_FORMAT_B8G8R8A8_UNORM,
-        .extent.width  = ctx->frame->width / 2,
-        .extent.height = ctx->frame->height / 2,
-        .extent.depth  = 1,
-        .mipLevels     = ctx->vulkan_frame->mip_levels,
-        .arrayLayers   = 1,
-        .tiling        = VK_IMAGE_TILING_OPTIMAL,
-        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
-        .usage         = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
-        .sharingMode   = VK_SHARING_MODE_EXCLUSIVE,
-        .samples       = VK_SAMPLE_COUNT_1_BIT,
-    };
-
-    if (vkCreateImage(ctx->vulkan->device, &imageInfo, NULL, &ctx->vulkan_frame->image) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to create Vulkan image!\n");
-        goto fail;
+    for (size_t checked = 0; checked < limit && store->count > 0; checked++) {
+        size_t i = store->age_cursor % store->count;
+        if (now - store->learned[i] > settings->max_age) {
+            // Last point takes its place and is checked next
+            data_evict(bl, i);
+            store->age_cursor = i;
+        } else {
+            store->age_cursor = i + 1;
+        }
     }
+}
 
-    VkMemoryRequirements imageMemoryRequirements;
-    vkGetImageMemoryRequirements(ctx->vulkan->device, ctx->vulkan_frame->image, &imageMemoryRequirements);
+struct DataRank {
+    double score;
+    size_t idx;
+};
 
-    VkMemoryAllocateInfo imageMemoryAllocateInfo = {
-        .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        .allocationSize  = imageMemoryRequirements.size,
-        .memoryTypeIndex = 0,
-    };
+static int data_rank_compare(const void *a, const void *b) {
+    const struct DataRank *x = a, *y = b;
+    if (x->score != y->score) {
+        return x->score < y->score ? -1 : 1;
+    }
+    return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
 
-    if (vkAllocateMemory(ctx->vulkan->device, &imageMemoryAllocateInfo, NULL, &ctx->vulkan_frame->image_memory) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to allocate memory for Vulkan image!\n");
-        goto fail;
+// Evicts points with the lowest score until at most limit are left, every point is scored once
+static void data_trim(struct Backlight *bl, size_t limit, int64_t now) {
+    struct DataStore *store = &bl->data;
+    if (store->count <= limit) {
+        return;
     }
 
-    if (vkBindImageMemory(ctx->vulkan->device, ctx->vulkan_frame->image, ctx->vulkan_frame->image_memory, 0) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to bind allocated memory for Vulkan image!\n");
-        goto fail;
+    struct DataRank *ranks = malloc(store->count * sizeof(struct DataRank));
+    bool *evicted = calloc(store->count, sizeof(bool));
+    for (size_t i = 0; i < store->count; i++) {
+        ranks[i].score = data_score(store, i, now);
+        ranks[i].idx = i;
+    }
+    qsort(ranks, store->count, sizeof(struct DataRank), data_rank_compare);
+    for (size_t i = 0; i < store->count - limit; i++) {
+        evicted[ranks[i].idx] = true;
     }
 
-    return;
+    // Kept points move down in their order
+    size_t kept = 0;
+    for (size_t i = 0; i < store->count; i++) {
+        if (evicted[i]) {
+            journal_push(&bl->journal, DATA_RECORD_REMOVE, store->lux[i], store->luma[i], store->backlight[i], store->weight[i], store->learned[i]);
+            continue;
+        }
+        store->lux[kept] = store->lux[i];
+        store->luma[kept] = store->luma[i];
+        store->backlight[kept] = store->backlight[i];
+        store->weight[kept] = store->weight[i];
+        store->learned[kept] = store->learned[i];
+        kept++;
+    }
+    store->count = kept;
 
-fail:
-    free(ctx->vulkan_frame);
-    ctx->vulkan_frame = NULL;
+    free(ranks);
+    free(evicted);
 }
 
-static int compute_frame_luma_pct(struct Context *ctx) {
-    int result = -1;
+// Points close to the new one are taken out, those that agree with it are merged into it by their score
+static uint32_t data_merge(struct Backlight *bl, const struct DataPoint *point, int64_t now, struct DataPoint *merged) {
+    struct DataStore *store = &bl->data;
+    double lux_max = fmax(fmax(store->lux_max_seen, point->lux), 1);
+    double weight_sum = 1, lux_sum = point->lux, luma_sum = point->luma;
 
-    if (ctx->vulkan_frame == NULL) {
-        fprintf(stderr, "ERROR: Vulkan objects were not prepared, skipping frame!\n");
-        goto exit;
+    for (size_t i = 0; i < store->count;) {
+        double dist = hypot((store->lux[i] - point->lux) * 100.0 / lux_max, store->luma[i] - point->luma);
+        if (dist > DATA_MERGE_RADIUS) {
+            i++;
+            continue;
+        }
+
+        // Newer preference wins over one that doesn't agree
+        if (abs(store->backlight[i] - point->backlight) <= DATA_MERGE_BACKLIGHT) {
+            double score = data_score(store, i, now);
+            weight_sum += score;
+            lux_sum += score * store->lux[i];
+            luma_sum += score * store->luma[i];
+        }
+        data_evict(bl, i);
     }
 
-    VkExternalMemoryImageCreateInfo frameImageMemoryInfo = {
-        .sType       = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
-        .handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
-    };
+    merged->lux = round(lux_sum / weight_sum);
+    merged->luma = round(luma_sum / weight_sum);
+    merged->backlight = point->backlight;
+    return fmax(fmin(round(weight_sum), UINT32_MAX), 1);
+}
 
-    VkImageCreateInfo frameImageInfo = {
-        .sType         = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
-        .pNext         = &frameImageMemoryInfo,
-        .imageType     = VK_IMAGE_TYPE_2D,
-        .format        = VK_FORMAT_R8G8B8A8_UNORM,
-        .extent.width  = ctx->frame->width,
-        .extent.height = ctx->frame->height,
-        .extent.depth  = 1,
-        .mipLevels     = 1,
-        .arrayLayers   = 1,
-        .flags         = VK_IMAGE_CREATE_ALIAS_BIT,
-        .tiling        = VK_IMAGE_TILING_OPTIMAL,
-        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED, // specs say so
-        .usage         = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
-        .sharingMode   = VK_SHARING_MODE_EXCLUSIVE,
-        .samples       = VK_SAMPLE_COUNT_1_BIT,
-    };
+// -1 while nothing is learned
+static double data_predict(struct DataStore *store, long lux, int luma) {
+    struct DataPoint points[3];
+    int found = data_nearest(store, lux, luma, points);
+    if (found == 0) {
+        return -1;
+    }
 
-    VkImage frameImage;
-    if (vkCreateImage(ctx->vulkan->device, &frameImageInfo, NULL, &frameImage) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to create Vulkan frame image!\n");
-        goto exit;
+    struct DataPoint *nearest = &points[0];
+    struct DataPoint *nearest2 = found > 1 ? &points[1] : NULL;
+    struct DataPoint *nearest3 = found > 2 ? &points[2] : NULL;
+
+    double target_backlight = nearest->backlight;
+    if (nearest2 != NULL && nearest3 != NULL) {
+        struct Vector plane_vec1 = vector_create(nearest, nearest2);
+        struct Vector plane_vec2 = vector_create(nearest, nearest3);
+        struct Vector plane_normal = vector_cross_product(&plane_vec1, &plane_vec2);
+        vector_normalize(&plane_normal);
+
+        struct DataPoint line_point1 = { .lux = lux, .luma = luma, .backlight = 0 };
+        struct DataPoint line_point2 = { .lux = lux, .luma = luma, .backlight = 100 };
+        struct Vector line_direction = vector_create(&line_point1, &line_point2);
+        vector_normalize(&line_direction);
+
+        double plane_line_dot = vector_dot_product(&plane_normal, &line_direction);
+        if (fabs(plane_line_dot) > DBL_EPSILON) {
+            struct Vector plane_point = point_create(nearest);
+            struct Vector line_point = point_create(&line_point1);
+
+            struct Vector line_plane_diff = vector_subtract(&line_point, &plane_point);
+            double scale = vector_dot_product(&plane_normal, &line_plane_diff) / plane_line_dot;
+            struct Vector line_direction_scaled = vector_scale(&line_direction, scale);
+            struct Vector intersection = vector_subtract(&line_point, &line_direction_scaled);
+            target_backlight = fmax(1, fmin(100, intersection.z));
+        }
     }
 
-    VkImportMemoryFdInfoKHR idesc = {
-        .sType      = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR,
-        .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
-        .fd         = dup(ctx->frame->fds[0]),
-    };
-    VkMemoryAllocateInfo alloc_info = {
-        .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        .pNext           = &idesc,
-        .allocationSize = ctx->frame->sizes[0],
-        .memoryTypeIndex = 0,
-    };
+    return target_backlight;
+}
 
-    VkDeviceMemory frameImageMemory;
-    if (vkAllocateMemory(ctx->vulkan->device, &alloc_info, NULL, &frameImageMemory) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to allocate memory for Vulkan frame image!\n");
-        goto exit;
+static float data_cached(struct DataStore *store, int x, int y) {
+    float *cell = &store->prediction[y * PREDICTION_LUX_BUCKETS + x];
+    if (*cell < 0) {
+        *cell = data_predict(store, round((double)x * store->lux_max_seen / (PREDICTION_LUX_BUCKETS - 1)),
+                round(y * 100.0 / (PREDICTION_LUMA_BUCKETS - 1)));
     }
+    return *cell;
+}
 
-    if (vkBindImageMemory(ctx->vulkan->device, frameImage, frameImageMemory, 0) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to bind allocated memory for Vulkan frame image!\n");
-        goto exit;
+// Predictions are cached per luma and normalized lux bucket, interpolated between the four buckets around the query,
+// -1 while nothing is learned
+static int data_lookup(struct DataStore *store, long lux, int luma) {
+    double x = fmin(fmax(lux, 0), store->lux_max_seen) * (PREDICTION_LUX_BUCKETS - 1) / store->lux_max_seen;
+    double y = fmin(fmax(luma, 0), 100) * (PREDICTION_LUMA_BUCKETS - 1) / 100.0;
+    int x0 = floor(x), y0 = floor(y);
+    int x1 = fmin(x0 + 1, PREDICTION_LUX_BUCKETS - 1);
+    int y1 = fmin(y0 + 1, PREDICTION_LUMA_BUCKETS - 1);
+
+    float p00 = data_cached(store, x0, y0), p10 = data_cached(store, x1, y0);
+    float p01 = data_cached(store, x0, y1), p11 = data_cached(store, x1, y1);
+    if (p00 < 0 || p10 < 0 || p01 < 0 || p11 < 0) {
+        return -1;
     }
 
-    VkCommandBufferBeginInfo commandBufferBeginInfo = {
-        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-    };
+    double low = p00 + (p10 - p00) * (x - x0);
+    double high = p01 + (p11 - p01) * (x - x0);
+    return round(low + (high - low) * (y - y0));
+}
 
-    if (vkBeginCommandBuffer(ctx->vulkan->command_buffer, &commandBufferBeginInfo) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to begin Vulkan command buffer!\n");
-        goto exit;
+static bool write_all(int fd, const void *data, size_t len) {
+    const char *ptr = data;
+    while (len > 0) {
+        ssize_t count = write(fd, ptr, len);
+        if (count == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += count;
+        len -= count;
     }
+    return true;
+}
 
-    VkImageMemoryBarrier frameImageBarrier = {
-        .sType                           = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .oldLayout                       = VK_IMAGE_LAYOUT_UNDEFINED,
-        .newLayout                       = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-        .srcQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED,
-        .image                           = frameImage,
-        .subresourceRange.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
-        .subresourceRange.baseArrayLayer = 0,
-        .subresourceRange.baseMipLevel   = 0,
-        .subresourceRange.layerCount     = 1,
-        .subresourceRange.levelCount     = 1,
-        .srcAccessMask                   = 0,
-        .dstAccessMask                   = VK_ACCESS_TRANSFER_READ_BIT,
+static bool data_write_file(int fd, struct DataJournal *journal) {
+    struct DataFileHeader header = {
+        .magic       = DATA_FILE_MAGIC,
+        .version     = DATA_FILE_VERSION,
+        .record_size = sizeof(struct DataRecord),
     };
 
-    vkCmdPipelineBarrier(ctx->vulkan->command_buffer,
-        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
-        0, NULL,
-        0, NULL,
-        1, &frameImageBarrier);
-
-    VkImageMemoryBarrier imageBarrier = {
-        .sType                           = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
-        .oldLayout                       = VK_IMAGE_LAYOUT_UNDEFINED,
-        .newLayout                       = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        .srcQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED,
-        .dstQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED,
-        .image                           = ctx->vulkan_frame->image,
-        .subresourceRange.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
-        .subresourceRange.baseArrayLayer = 0,
-        .subresourceRange.baseMipLevel   = 0,
-        .subresourceRange.layerCount     = 1,
-        .subresourceRange.levelCount     = ctx->vulkan_frame->mip_levels,
-        .srcAccessMask                   = 0,
-        .dstAccessMask                   = VK_ACCESS_TRANSFER_WRITE_BIT,
-    };
+    return write_all(fd, &header, sizeof(header))
+        && write_all(fd, journal->records, journal->count * sizeof(struct DataRecord));
+}
 
-    vkCmdPipelineBarrier(ctx->vulkan->command_buffer,
-        VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
-        0, NULL,
-        0, NULL,
-        1, &imageBarrier);
-
-    VkImageBlit blit = {
-        .srcOffsets[0]                 = { 0, 0, 0 },
-        .srcOffsets[1]                 = { ctx->frame->width, ctx->frame->height, 1 },
-        .srcSubresource.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
-        .srcSubresource.mipLevel       = 0,
-        .srcSubresource.baseArrayLayer = 0,
-        .srcSubresource.layerCount     = 1,
-        .dstOffsets[0]                 = { 0, 0, 0 },
-        .dstOffsets[1]                 = { ctx->frame->width / 2, ctx->frame->height / 2, 1 },
-        .dstSubresource.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
-        .dstSubresource.mipLevel       = 0,
-        .dstSubresource.baseArrayLayer = 0,
-        .dstSubresource.layerCount     = 1,
-    };
+// Renamed data file only survives a crash once the directory holding it is synced
+static bool data_sync_dir(const char *path) {
+    char dir[BUF_SIZE];
+    const char *slash = strrchr(path, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path) : 1, slash ? path : ".");
 
-    vkCmdBlitImage(ctx->vulkan->command_buffer,
-        frameImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-        ctx->vulkan_frame->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-        1, &blit,
-        VK_FILTER_LINEAR);
-
-    imageBarrier.subresourceRange.levelCount = 1;
-    uint32_t mipWidth  = ctx->frame->width / 2;
-    uint32_t mipHeight = ctx->frame->height / 2;
-    uint32_t targetMipLevel = ctx->vulkan_frame->mip_levels - LAST_MIP_LEVEL;
-
-    for (uint32_t i = 1; i <= targetMipLevel; i++) {
-        imageBarrier.subresourceRange.baseMipLevel = i - 1;
-        imageBarrier.oldLayout                     = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-        imageBarrier.newLayout                     = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-        imageBarrier.srcAccessMask                 = VK_ACCESS_TRANSFER_WRITE_BIT;
-        imageBarrier.dstAccessMask                 = VK_ACCESS_TRANSFER_READ_BIT;
-
-        vkCmdPipelineBarrier(ctx->vulkan->command_buffer,
-            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
-            0, NULL,
-            0, NULL,
-            1, &imageBarrier);
-
-        blit.srcOffsets[1] = (VkOffset3D) { mipWidth, mipHeight, 1 };
-        blit.dstOffsets[1] = (VkOffset3D) { mipWidth > 1 ? mipWidth / 2 : 1, mipHeight > 1 ? mipHeight / 2 : 1, 1 };
-        blit.srcSubresource.mipLevel = i - 1;
-        blit.dstSubresource.mipLevel = i;
-
-        vkCmdBlitImage(ctx->vulkan->command_buffer,
-            ctx->vulkan_frame->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
-            ctx->vulkan_frame->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-            1, &blit,
-            VK_FILTER_LINEAR);
-
-        if (mipWidth > 1)  mipWidth /= 2;
-        if (mipHeight > 1) mipHeight /= 2;
-    }
-
-    imageBarrier.subresourceRange.baseMipLevel = targetMipLevel;
-    imageBarrier.oldLayout                     = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-    imageBarrier.newLayout                     = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-    imageBarrier.srcAccessMask                 = VK_ACCESS_TRANSFER_WRITE_BIT;
-    imageBarrier.dstAccessMask                 = VK_ACCESS_TRANSFER_READ_BIT;
-
-    vkCmdPipelineBarrier(ctx->vulkan->command_buffer,
-        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
-        0, NULL,
-        0, NULL,
-        1, &imageBarrier);
-
-    VkBufferImageCopy region = {
-        .bufferOffset                    = 0,
-        .bufferRowLength                 = 0,
-        .bufferImageHeight               = 0,
-        .imageSubresource.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
-        .imageSubresource.mipLevel       = targetMipLevel,
-        .imageSubresource.baseArrayLayer = 0,
-        .imageSubresource.layerCount     = 1,
-        .imageOffset                     = { 0, 0, 0 },
-        .imageExtent                     = { mipWidth, mipHeight, 1 },
-    };
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1) {
+        return false;
+    }
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
 
-    vkCmdCopyImageToBuffer(ctx->vulkan->command_buffer, ctx->vulkan_frame->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, ctx->vulkan->buffer, 1, &region);
+static void* data_compact_thread(void *arg) {
+    struct DataCompaction *compaction = arg;
 
-    if (vkEndCommandBuffer(ctx->vulkan->command_buffer) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to end Vulkan command buffer!\n");
-        goto exit;
-    }
+    compaction->ok = data_write_file(compaction->fd, &compaction->snapshot) && fdatasync(compaction->fd) == 0;
 
-    VkSubmitInfo submitInfo = {
-        .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
-        .commandBufferCount = 1,
-        .pCommandBuffers    = &ctx->vulkan->command_buffer,
-    };
+    uint64_t done = 1;
+    write(compaction->done.fd, &done, sizeof(done));
+    return NULL;
+}
 
-    if (vkQueueSubmit(ctx->vulkan->queue, 1, &submitInfo, ctx->vulkan->fence) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to submit Vulkan queue!\n");
-        goto exit;
-    }
+// Rewrites the data file without removed points, replaces the old one once complete
+static void data_compact(struct Backlight *bl) {
+    struct DataCompaction *compaction = &bl->compaction;
 
-    if (vkWaitForFences(ctx->vulkan->device, 1, &ctx->vulkan->fence, 1, VULKAN_FENCE_MAX_WAIT_NS) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to wait for Vulkan fence!\n");
-        goto exit;
+    sprintf(buf, "%s.tmp", bl->data_path);
+    compaction->fd = open(buf, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (compaction->fd == -1) {
+        fprintf(stderr, "WARN: Failed to compact data file!\n");
+        return;
+    }
+
+    data_snapshot(&bl->data, &compaction->snapshot);
+
+    if (pthread_create(&compaction->thread, NULL, data_compact_thread, compaction) != 0) {
+        fprintf(stderr, "WARN: Failed to compact data file!\n");
+        close(compaction->fd);
+        compaction->fd = -1;
+        unlink(buf);
+        journal_free(&compaction->snapshot);
+        return;
+    }
+
+    compaction->running = true;
+}
+
+static void data_compact_finish(struct Backlight *bl) {
+    struct DataCompaction *compaction = &bl->compaction;
+
+    pthread_join(compaction->thread, NULL);
+    compaction->running = false;
+
+    // Records saved while the thread was running go after the snapshot
+    sprintf(buf, "%s.tmp", bl->data_path);
+    if (compaction->ok
+            && write_all(compaction->fd, compaction->backlog.records, compaction->backlog.count * sizeof(struct DataRecord))
+            && fdatasync(compaction->fd) == 0
+            && rename(buf, bl->data_path) == 0) {
+        if (!data_sync_dir(bl->data_path)) {
+            fprintf(stderr, "WARN: Failed to sync data directory!\n");
+        }
+        close(bl->data_fd);
+        bl->data_fd = compaction->fd;
+        bl->data_records = compaction->snapshot.count + compaction->backlog.count;
+    } else {
+        fprintf(stderr, "WARN: Failed to compact data file!\n");
+        close(compaction->fd);
+        unlink(buf);
+    }
+
+    compaction->fd = -1;
+    journal_free(&compaction->snapshot);
+    journal_free(&compaction->backlog);
+}
+
+// Replaces the data file right away, used when its format changes
+static bool data_rewrite(struct Backlight *bl) {
+    sprintf(buf, "%s.tmp", bl->data_path);
+    int fd = open(buf, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (fd == -1) {
+        return false;
+    }
+
+    struct DataJournal snapshot = { 0 };
+    data_snapshot(&bl->data, &snapshot);
+    bool ok = data_write_file(fd, &snapshot) && fdatasync(fd) == 0 && rename(buf, bl->data_path) == 0;
+    if (ok && !data_sync_dir(bl->data_path)) {
+        fprintf(stderr, "WARN: Failed to sync data directory!\n");
+    }
+    if (ok) {
+        close(bl->data_fd);
+        bl->data_fd = fd;
+        bl->data_records = snapshot.count;
+    } else {
+        close(fd);
+        unlink(buf);
+    }
+
+    journal_free(&snapshot);
+    return ok;
+}
+
+static void data_compacted(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    struct Backlight *bl = source->data;
+
+    uint64_t done;
+    if (read(source->fd, &done, sizeof(done)) == sizeof(done) && bl->compaction.running) {
+        data_compact_finish(bl);
+    }
+}
+
+// Appends changes recorded in the journal to the data file
+static void data_save(struct Backlight *bl) {
+    struct DataJournal *journal = &bl->journal;
+    if (journal->count == 0) {
+        return;
+    }
+
+    // Replay keeps its data in memory only
+    if (bl->data_fd == -1) {
+        journal->count = 0;
+        return;
+    }
+
+    // Only learning events get here, syncing every batch is cheap
+    if (!write_all(bl->data_fd, journal->records, journal->count * sizeof(struct DataRecord)) || fdatasync(bl->data_fd) != 0) {
+        fprintf(stderr, "WARN: Failed to write data file!\n");
+    }
+    bl->data_records += journal->count;
+
+    if (bl->compaction.running) {
+        for (size_t i = 0; i < journal->count; i++) {
+            struct DataRecord *record = &journal->records[i];
+            journal_push(&bl->compaction.backlog, record->op, record->lux, record->luma, record->backlight, record->weight, record->learned);
+        }
+    }
+    journal->count = 0;
+
+    if (!bl->compaction.running && bl->data_records > 2 * bl->data.count + DATA_COMPACT_MIN_RECORDS) {
+        data_compact(bl);
+    }
+}
+
+static struct DataRecord data_record_at(const struct DataFileHeader *header, size_t idx, bool v1, int64_t now) {
+    if (v1) {
+        const struct DataRecordV1 *old = (const struct DataRecordV1 *)(header + 1) + idx;
+        return (struct DataRecord) { .lux = old->lux, .luma = old->luma, .backlight = old->backlight, .op = old->op, .weight = 1, .learned = now };
+    }
+    return ((const struct DataRecord *)(header + 1))[idx];
+}
+
+struct DataReplay {
+    int64_t lux;
+    int32_t luma;
+    int16_t backlight;
+    uint8_t op;
+    size_t idx;
+};
+
+static bool data_replay_same(const struct DataReplay *x, const struct DataReplay *y) {
+    return x->lux == y->lux && x->luma == y->luma && x->backlight == y->backlight;
+}
+
+// Records of the same point, in the order they were written
+static int data_replay_compare(const void *a, const void *b) {
+    const struct DataReplay *x = a, *y = b;
+    if (x->lux != y->lux) return x->lux < y->lux ? -1 : 1;
+    if (x->luma != y->luma) return x->luma < y->luma ? -1 : 1;
+    if (x->backlight != y->backlight) return x->backlight < y->backlight ? -1 : 1;
+    return x->idx < y->idx ? -1 : x->idx > y->idx;
+}
+
+// Removals cancel the latest earlier addition of the same point, found by sorting records by point instead of
+// searching the store for every removal
+static bool* data_replay_removed(const struct DataFileHeader *header, size_t count, bool v1, int64_t now) {
+    struct DataReplay *replay = malloc(count * sizeof(struct DataReplay));
+    bool *removed = calloc(count, sizeof(bool));
+    for (size_t i = 0; i < count; i++) {
+        struct DataRecord record = data_record_at(header, i, v1, now);
+        replay[i] = (struct DataReplay) { .lux = record.lux, .luma = record.luma, .backlight = record.backlight, .op = record.op, .idx = i };
+    }
+    qsort(replay, count, sizeof(struct DataReplay), data_replay_compare);
+
+    for (size_t i = 0; i < count; i++) {
+        removed[replay[i].idx] = replay[i].op != DATA_RECORD_ADD;
+        if (replay[i].op == DATA_RECORD_ADD) {
+            continue;
+        }
+        for (size_t j = i; j-- > 0 && data_replay_same(&replay[i], &replay[j]);) {
+            if (replay[j].op == DATA_RECORD_ADD && !removed[replay[j].idx]) {
+                removed[replay[j].idx] = true;
+                break;
+            }
+        }
+    }
+
+    free(replay);
+    return removed;
+}
+
+// Replays the data file, records of version 1 files count once and as learned now, then migrate tells to rewrite it
+static bool data_load(struct Backlight *bl, int64_t now, bool *migrate) {
+    struct stat st;
+    if (fstat(bl->data_fd, &st) == -1 || st.st_size < (off_t)sizeof(struct DataFileHeader)) {
+        return false;
+    }
+
+    struct DataFileHeader *header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, bl->data_fd, 0);
+    if (header == MAP_FAILED) {
+        return false;
+    }
+
+    bool magic = !memcmp(header->magic, DATA_FILE_MAGIC, sizeof(header->magic));
+    *migrate = magic && header->version == 1 && header->record_size == sizeof(struct DataRecordV1);
+    bool valid = *migrate || (magic && header->version == DATA_FILE_VERSION && header->record_size == sizeof(struct DataRecord));
+
+    size_t record_size = valid ? header->record_size : 1;
+    size_t count = valid ? (st.st_size - sizeof(struct DataFileHeader)) / record_size : 0;
+    struct DataStore *store = &bl->data;
+
+    // Points that are added and later removed are left out right away
+    bool *removed = data_replay_removed(header, count, *migrate, now);
+    for (size_t i = 0; i < count; i++) {
+        struct DataRecord record = data_record_at(header, i, *migrate, now);
+        if (record.op == DATA_RECORD_ADD) {
+            store->lux_max_seen = fmax(fmax(store->lux_max_seen, record.lux), 1);
+        }
+        if (!removed[i]) {
+            data_add(store, record.lux, record.luma, record.backlight, record.weight, record.learned);
+        }
+    }
+    free(removed);
+
+    munmap(header, st.st_size);
+
+    if (!valid) {
+        return false;
+    }
+
+    // Drop a record torn by a crash, appended records have to stay aligned
+    off_t size = sizeof(struct DataFileHeader) + count * record_size;
+    if (!*migrate && size != st.st_size) {
+        ftruncate(bl->data_fd, size);
+    }
+
+    bl->data_records = count;
+    data_index(store);
+    return true;
+}
+
+// Text format of older versions, only read once to create the binary data file
+static bool data_import(struct Backlight *bl, const char *path, int64_t now) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return false;
+    }
+
+    bool ok = true;
+    while (ok && fgets(buf, BUF_SIZE, f)) {
+        long val[3];
+        char *word = NULL;
+        for (int i=0; i<3 && ok; i++) {
+            word = strtok(word == NULL ? buf : NULL, " ");
+            ok = word != NULL;
+            val[i] = ok ? strtol(word, NULL, 10) : 0;
+        }
+        if (ok) {
+            data_add(&bl->data, val[0], val[1], val[2], 1, now);
+            bl->data.lux_max_seen = fmax(fmax(bl->data.lux_max_seen, val[0]), 1);
+        }
+    }
+
+    fclose(f);
+    data_index(&bl->data);
+    return ok;
+}
+
+
+/******************************************************************************
+ * Devices
+ */
+
+static long read_lux(struct Context *ctx) {
+    // Buffered sensor keeps the latest sample up to date from the event loop
+    double raw = ctx->light_sensor_buffer ? ctx->light_sensor_raw : pread_double(ctx->light_sensor_raw_fd);
+    return round((raw + ctx->light_sensor_offset) * ctx->light_sensor_scale);
+}
+
+static int backlight_pct(struct Backlight *bl, long raw) {
+    return round(raw * 100.0 / bl->max);
+}
+
+// Cached while changes are notified, devices that are not watched are read every time
+static long read_backlight_raw(struct Backlight *bl) {
+    return bl->change_source.fd > 0 ? bl->raw : bl->ops->read(bl);
+}
+
+static int read_backlight_pct(struct Backlight *bl) {
+    return backlight_pct(bl, read_backlight_raw(bl));
+}
+
+static long sysfs_backlight_read(struct Backlight *bl) {
+    return lround(pread_double(bl->raw_fd));
+}
+
+static bool sysfs_backlight_write(struct Backlight *bl, long raw) {
+    return pwrite_long(bl->raw_fd, raw);
+}
+
+static const struct BacklightOps sysfs_backlight_ops = {
+    .read  = sysfs_backlight_read,
+    .write = sysfs_backlight_write,
+};
+
+// Cached and queued, DDC/CI is far too slow to wait for on the event loop
+static long ddc_backlight_read(struct Backlight *bl) {
+    return ddc_value(bl->ddc);
+}
+
+static bool ddc_backlight_write(struct Backlight *bl, long raw) {
+    ddc_set(bl->ddc, raw);
+    return true;
+}
+
+static const struct BacklightOps ddc_backlight_ops = {
+    .read  = ddc_backlight_read,
+    .write = ddc_backlight_write,
+};
+
+#ifdef HAVE_LOGIND
+// Reply is not awaited, sysfs reflects the new value once logind is done
+static bool logind_backlight_write(struct Backlight *bl, long raw) {
+    return sd_bus_call_method_async(bl->output->ctx->bus, NULL,
+        "org.freedesktop.login1", "/org/freedesktop/login1/session/auto", "org.freedesktop.login1.Session",
+        "SetBrightness", NULL, NULL, "ssu", "backlight", bl->device, (uint32_t)raw) >= 0;
+}
+
+static const struct BacklightOps logind_backlight_ops = {
+    .read  = sysfs_backlight_read,
+    .write = logind_backlight_write,
+};
+#endif
+
+// Steps of a transition that map to the same raw value are written once
+static void backlight_write(struct Backlight *bl, long raw) {
+    if (raw == bl->written) {
+        return;
+    }
+
+    uint64_t start = stats_now();
+    struct Stats *stats = &bl->output->ctx->stats;
+    if (bl->ops->write(bl, raw)) {
+        bl->written = raw;
+        bl->raw = raw;
+        if (stats->launched && !stats->first_adjustment) {
+            stats->first_adjustment = stats_now();
+        }
+    }
+    stats_since(stats, STAT_BACKLIGHT_WRITE, start);
+}
+
+
+/******************************************************************************
+ * Event loop
+ */
+
+static int event_add(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    struct epoll_event event = {
+        .events   = events,
+        .data.ptr = source,
+    };
+    return epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, source->fd, &event);
+}
+
+static int event_modify(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    struct epoll_event event = {
+        .events   = events,
+        .data.ptr = source,
+    };
+    return epoll_ctl(ctx->epoll_fd, EPOLL_CTL_MOD, source->fd, &event);
+}
+
+static void event_remove(struct Context *ctx, struct EventSource *source) {
+    epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, source->fd, NULL);
+}
+
+static int timer_add(struct Context *ctx, struct EventSource *source, event_handler_t handler) {
+    source->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    source->handler = handler;
+    if (source->fd == -1) {
+        return -1;
+    }
+    return event_add(ctx, source, EPOLLIN);
+}
+
+// Fires after delay_ns and then every interval_ns, zero delay disarms the timer
+static void timer_arm(struct EventSource *source, long delay_ns, long interval_ns) {
+    struct itimerspec spec = {
+        .it_value    = { .tv_sec = delay_ns / 1000000000L,    .tv_nsec = delay_ns % 1000000000L },
+        .it_interval = { .tv_sec = interval_ns / 1000000000L, .tv_nsec = interval_ns % 1000000000L },
+    };
+    timerfd_settime(source->fd, 0, &spec, NULL);
+}
+
+static uint64_t timer_expirations(struct EventSource *source) {
+    uint64_t expirations = 0;
+    if (read(source->fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return 0;
+    }
+    return expirations;
+}
+
+
+/******************************************************************************
+ * Ambient light sensor
+ */
+
+static bool read_sysfs(const char *path, char *val, size_t size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+    int count = fmax(0, read(fd, val, size - 1));
+    close(fd);
+    val[count] = 0;
+    val[strcspn(val, "\n")] = 0;
+    return true;
+}
+
+static bool write_sysfs(const char *path, const char *val) {
+    int fd = open(path, O_WRONLY);
+    if (fd < 0) {
+        return false;
+    }
+    bool ok = write(fd, val, strlen(val)) == (ssize_t)strlen(val);
+    close(fd);
+    return ok;
+}
+
+// Samples hold every enabled channel ordered by index, each one aligned to its own size
+static bool light_sensor_layout(struct LightSensorBuffer *sensor) {
+    struct {
+        uint32_t index;
+        uint32_t bytes;
+        bool illuminance;
+    } channels[LIGHT_SENSOR_MAX_CHANNELS];
+    int count = 0;
+    bool found = false;
+
+    char path[BUF_SIZE], val[BUF_SIZE];
+    sprintf(path, "%s/scan_elements", sensor->path);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return false;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir)) && count < LIGHT_SENSOR_MAX_CHANNELS) {
+        size_t len = strlen(entry->d_name);
+        if (len < 4 || strcmp(entry->d_name + len - 3, "_en")) {
+            continue;
+        }
+
+        sprintf(path, "%s/scan_elements/%s", sensor->path, entry->d_name);
+        if (!read_sysfs(path, val, BUF_SIZE) || strcmp(val, "1")) {
+            continue;
+        }
+
+        char endianness, sign;
+        uint32_t bits, storage, shift;
+        sprintf(path, "%s/scan_elements/%.*s_type", sensor->path, (int)len - 3, entry->d_name);
+        if (!read_sysfs(path, val, BUF_SIZE) || sscanf(val, "%ce:%c%u/%u>>%u", &endianness, &sign, &bits, &storage, &shift) != 5) {
+            goto fail;
+        }
+        if (storage == 0 || storage > 64 || storage % 8 != 0 || bits == 0 || bits > storage) {
+            goto fail;
+        }
+
+        sprintf(path, "%s/scan_elements/%.*s_index", sensor->path, (int)len - 3, entry->d_name);
+        if (!read_sysfs(path, val, BUF_SIZE)) {
+            goto fail;
+        }
+
+        channels[count].index = strtol(val, NULL, 10);
+        channels[count].bytes = storage / 8;
+        channels[count].illuminance = !strcmp(entry->d_name, "in_illuminance_en");
+        if (channels[count].illuminance) {
+            found = true;
+            sensor->bytes = storage / 8;
+            sensor->bits = bits;
+            sensor->shift = shift;
+            sensor->big_endian = endianness == 'b';
+            sensor->is_signed = sign == 's';
+        }
+        count++;
+    }
+    closedir(dir);
+
+    if (!found) {
+        return false;
+    }
+
+    uint32_t offset = 0, alignment = 1;
+    for (int i = 0; i < count; i++) {
+        // Channels are few, pick the next one by index each time
+        int next = i;
+        for (int j = i + 1; j < count; j++) {
+            if (channels[j].index < channels[next].index) {
+                next = j;
+            }
+        }
+        uint32_t bytes = channels[next].bytes;
+        bool illuminance = channels[next].illuminance;
+        channels[next] = channels[i];
+
+        offset = (offset + bytes - 1) / bytes * bytes;
+        if (illuminance) {
+            sensor->offset = offset;
+        }
+        offset += bytes;
+        alignment = fmax(alignment, bytes);
+    }
+    sensor->sample_size = (offset + alignment - 1) / alignment * alignment;
+
+    return sensor->sample_size <= BUF_SIZE;
+
+fail:
+    closedir(dir);
+    return false;
+}
+
+// Devices without their own timing need a trigger, HID sensor hubs register one named after the device
+static void light_sensor_trigger(struct LightSensorBuffer *sensor, const char *base_path, const char *device) {
+    char path[BUF_SIZE], val[BUF_SIZE], suffix[BUF_SIZE];
+    sprintf(path, "%s/trigger/current_trigger", sensor->path);
+    if (!read_sysfs(path, val, BUF_SIZE) || val[0] != 0) {
+        return;
+    }
+
+    int number;
+    if (sscanf(device, "iio:device%d", &number) != 1) {
+        return;
+    }
+    size_t suffix_len = sprintf(suffix, "-dev%d", number);
+
+    DIR *dir = opendir(base_path);
+    if (dir == NULL) {
+        return;
+    }
+
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+        if (strncmp(entry->d_name, "trigger", 7)) {
+            continue;
+        }
+
+        char trigger_path[BUF_SIZE];
+        sprintf(trigger_path, "%s/%s/name", base_path, entry->d_name);
+        size_t len;
+        if (read_sysfs(trigger_path, val, BUF_SIZE) && (len = strlen(val)) > suffix_len && !strcmp(val + len - suffix_len, suffix)) {
+            write_sysfs(path, val);
+            break;
+        }
+    }
+    closedir(dir);
+}
+
+static double light_sensor_decode(struct LightSensorBuffer *sensor, const unsigned char *sample) {
+    uint64_t value = 0;
+    for (uint32_t i = 0; i < sensor->bytes; i++) {
+        value = (value << 8) | sample[sensor->offset + (sensor->big_endian ? i : sensor->bytes - 1 - i)];
+    }
+    value >>= sensor->shift;
+
+    if (sensor->bits < 64) {
+        uint64_t mask = (1ULL << sensor->bits) - 1;
+        value &= mask;
+        if (sensor->is_signed && (value >> (sensor->bits - 1))) {
+            value |= ~mask;
+        }
+    }
+
+    return sensor->is_signed ? (double)(int64_t)value : (double)value;
+}
+
+static void light_sensor_buffer_close(struct Context *ctx, struct LightSensorBuffer *sensor) {
+    char path[BUF_SIZE];
+
+    if (sensor->source.fd >= 0) {
+        event_remove(ctx, &sensor->source);
+        close(sensor->source.fd);
+    }
+
+    if (sensor->enabled_buffer) {
+        sprintf(path, "%s/buffer/enable", sensor->path);
+        write_sysfs(path, "0");
+    }
+
+    if (sensor->enabled_channel) {
+        sprintf(path, "%s/scan_elements/in_illuminance_en", sensor->path);
+        write_sysfs(path, "0");
+    }
+
+    free(sensor->path);
+    free(sensor);
+}
+
+static void light_sensor_ready(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    struct LightSensorBuffer *sensor = source->data;
+
+    // Only the latest sample matters
+    unsigned char samples[BUF_SIZE];
+    ssize_t count;
+    while ((count = read(source->fd, samples, BUF_SIZE)) >= (ssize_t)sensor->sample_size) {
+        ctx->light_sensor_raw = light_sensor_decode(sensor, samples + (count / sensor->sample_size - 1) * sensor->sample_size);
+    }
+
+    if ((events & (EPOLLERR | EPOLLHUP)) || (count == -1 && errno != EAGAIN && errno != EINTR)) {
+        fprintf(stderr, "WARN: Lost ambient light sensor buffer, polling sysfs instead!\n");
+        ctx->light_sensor_buffer = NULL;
+        light_sensor_buffer_close(ctx, sensor);
+    }
+}
+
+// Sensor is busy when another process reads its buffer already, sysfs keeps working then
+static bool light_sensor_buffer_open(struct Context *ctx, const char *base_path, const char *device) {
+    char path[BUF_SIZE], val[BUF_SIZE];
+
+    struct LightSensorBuffer *sensor = calloc(1, sizeof(struct LightSensorBuffer));
+    sensor->source.fd = -1;
+    sensor->source.handler = light_sensor_ready;
+    sensor->source.data = sensor;
+    sprintf(path, "%s/%s", base_path, device);
+    sensor->path = strdup(path);
+
+    sprintf(path, "%s/scan_elements/in_illuminance_en", sensor->path);
+    if (!read_sysfs(path, val, BUF_SIZE)) {
+        goto fail;
+    }
+    if (strcmp(val, "1")) {
+        if (!write_sysfs(path, "1")) {
+            goto fail;
+        }
+        sensor->enabled_channel = true;
+    }
+
+    if (!light_sensor_layout(sensor)) {
+        goto fail;
+    }
+
+    light_sensor_trigger(sensor, base_path, device);
+
+    sprintf(path, "%s/buffer/length", sensor->path);
+    write_sysfs(path, LIGHT_SENSOR_BUFFER_LENGTH);
+
+    sprintf(path, "/dev/%s", device);
+    sensor->source.fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (sensor->source.fd < 0) {
+        goto fail;
+    }
+
+    sprintf(path, "%s/buffer/enable", sensor->path);
+    if (!write_sysfs(path, "1")) {
+        goto fail;
+    }
+    sensor->enabled_buffer = true;
+
+    if (event_add(ctx, &sensor->source, EPOLLIN) == -1) {
+        goto fail;
+    }
+
+    ctx->light_sensor_buffer = sensor;
+    return true;
+
+fail:
+    light_sensor_buffer_close(ctx, sensor);
+    return false;
+}
+
+
+/******************************************************************************
+ * Backlight control
+ */
+
+static double transition_ease(enum Easing easing, double progress) {
+    switch (easing) {
+    case EASING_EASE_OUT:
+        return 1 - pow(1 - progress, 3);
+    case EASING_EASE_IN_OUT:
+        return progress * progress * (3 - 2 * progress);
+    default:
+        return progress;
+    }
+}
+
+static enum Easing read_easing(void) {
+    char *easing = get_env("WLUMA_TRANSITION_EASING", "linear");
+    if (!strcmp(easing, "ease-out")) {
+        return EASING_EASE_OUT;
+    } else if (!strcmp(easing, "ease-in-out")) {
+        return EASING_EASE_IN_OUT;
+    } else if (strcmp(easing, "linear")) {
+        fprintf(stderr, "WARN: Unknown transition easing: %s, using linear!\n", easing);
+    }
+    return EASING_LINEAR;
+}
+
+static void transition_stop(struct Backlight *bl) {
+    timer_arm(&bl->transition_timer, 0, 0);
+    bl->transition_active = false;
+}
+
+static void clock_now(struct Context *ctx, struct timespec *now) {
+    if (ctx->virtual_clock) {
+        *now = ctx->virtual_now;
+    } else {
+        clock_gettime(CLOCK_MONOTONIC, now);
+    }
+}
+
+// Position follows the clock, missed steps are caught up instead of slowing the transition down
+static void transition_advance(struct Context *ctx, struct Backlight *bl) {
+    struct timespec now;
+    clock_now(ctx, &now);
+    long elapsed = (now.tv_sec - bl->transition_started.tv_sec) * 1000000000L + (now.tv_nsec - bl->transition_started.tv_nsec);
+    double progress = fmin((double)elapsed / BACKLIGHT_TRANSITION_DELAY_NS, 1);
+
+    double eased = transition_ease(ctx->transition_easing, progress);
+    backlight_write(bl, bl->transition_from + lround((bl->transition_target - bl->transition_from) * eased));
+
+    if (progress >= 1) {
+        transition_stop(bl);
+    }
+}
+
+static void transition_step(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    struct Backlight *bl = source->data;
+
+    uint64_t expirations = timer_expirations(source);
+    if (expirations > 0 && bl->transition_active && !bl->output->removed) {
+        transition_advance(ctx, bl);
+    }
+}
+
+// Running transition is retargeted from where it is, there is no need to finish the stale one first
+static void transition_start(struct Backlight *bl, int backlight, int target_backlight) {
+    long from = bl->transition_active ? bl->written : read_backlight_raw(bl);
+    long target = lround(target_backlight * bl->max / 100.0);
+    if (from == target) {
+        transition_stop(bl);
+        return;
+    }
+
+    bl->transition_active = true;
+    bl->transition_from = from;
+    bl->transition_target = target;
+    clock_now(bl->output->ctx, &bl->transition_started);
+
+    // No point in stepping faster than the hardware can show, nor faster than anyone can see
+    bl->transition_interval = fmax(BACKLIGHT_TRANSITION_DELAY_NS / labs(target - from), BACKLIGHT_TRANSITION_STEP_NS);
+    timer_arm(&bl->transition_timer, bl->transition_interval, bl->transition_interval);
+}
+
+// Values between the start of a transition and what was written last are intermediate ones, anything else is a user change
+static bool transition_owns(struct Backlight *bl, int backlight) {
+    int from = backlight_pct(bl, bl->transition_from);
+    int written = backlight_pct(bl, bl->written);
+    return backlight >= fmin(from, written) && backlight <= fmax(from, written);
+}
+
+static int predict_backlight(struct Backlight *bl, long lux, int luma) {
+    uint64_t start = stats_now();
+    int backlight = data_lookup(&bl->data, lux, luma);
+    stats_since(&bl->output->ctx->stats, STAT_PREDICT, start);
+    return backlight;
+}
+
+static void update_backlight(struct Backlight *bl, long lux, int luma, int backlight) {
+    if (bl->transition_active) {
+        if (transition_owns(bl, backlight)) {
+            int target_backlight = predict_backlight(bl, lux, luma);
+            if (target_backlight != backlight_pct(bl, bl->transition_target)) {
+                transition_start(bl, backlight, target_backlight);
+                bl->last = target_backlight;
+            }
+            return;
+        }
+
+        // User wins
+        transition_stop(bl);
+    }
+
+    if ((bl->last != backlight) || (bl->data.count == 0 && bl->pendingCountdown == 0)) {
+        if (bl->pendingCountdown == 0) {
+            bl->pendingDataPoint.lux = lux;
+            bl->pendingDataPoint.luma = luma;
+        }
+        bl->pendingDataPoint.backlight = backlight;
+        bl->pendingCountdown = PENDING_COUNTDOWN_RESET;
+    } else if (bl->pendingCountdown > 1) {
+        bl->pendingCountdown--;
+    } else if (bl->pendingCountdown == 1) {
+        bl->pendingCountdown = 0;
+
+        struct Context *ctx = bl->output->ctx;
+        int64_t now = data_now(ctx);
+        struct DataPoint *point = &bl->pendingDataPoint;
+        struct DataStore *store = &bl->data;
+        struct DataPoint merged;
+        uint32_t weight = data_merge(bl, point, now, &merged);
+
+        // Drop points that contradict the new one, then add it
+        for (size_t i = 0; i < store->count;) {
+            if (
+                (store->lux[i] == merged.lux && store->luma[i] == merged.luma) ||
+                (store->lux[i] >  merged.lux && store->luma[i] == merged.luma) ||
+                (store->lux[i] <  merged.lux && store->luma[i] >= merged.luma && store->backlight[i] > merged.backlight) ||
+                (store->lux[i] == merged.lux && store->luma[i] <  merged.luma && store->backlight[i] < merged.backlight) ||
+                (store->lux[i] >  merged.lux && store->luma[i] <= merged.luma && store->backlight[i] < merged.backlight) ||
+                (store->lux[i] == merged.lux && store->luma[i] >  merged.luma && store->backlight[i] > merged.backlight)
+            ) {
+                data_evict(bl, i);
+            } else {
+                i++;
+            }
+        }
+
+        // Dataset stays bounded, the new point isn't a candidate for eviction
+        if (ctx->data_settings.max_points > 0) {
+            data_trim(bl, ctx->data_settings.max_points - 1, now);
+        }
+        journal_push(&bl->journal, DATA_RECORD_ADD, merged.lux, merged.luma, merged.backlight, weight, now);
+        data_add(store, merged.lux, merged.luma, merged.backlight, weight, now);
+        store->lux_max_seen = fmax(fmax(store->lux_max_seen, merged.lux), 1);
+        data_age(bl, &ctx->data_settings, now, DATA_AGE_SCAN);
+
+        data_save(bl);
+
+        data_index(store);
+    } else {
+        int target_backlight = predict_backlight(bl, lux, luma);
+
+        if (backlight != target_backlight) {
+            transition_start(bl, backlight, target_backlight);
+            backlight = target_backlight;
+        }
+    }
+
+    bl->last = backlight;
+}
+
+
+/******************************************************************************
+ * Frame management
+ */
+static void register_frame_listener(struct WaylandOutput *output);
+#ifdef HAVE_IMAGE_COPY
+static void image_buffer_release(struct ImageCopyBuffer *buffer);
+#endif
+
+static bool capture_pending(struct WaylandOutput *output) {
+    return output->frame_callback != NULL || output->copy_frame != NULL || output->image_frame != NULL;
+}
+
+// Held image copy frame doesn't stop the timer, it follows ambient light until the output changes
+static bool capture_armable(struct WaylandOutput *output) {
+    return !capture_pending(output) || output->image_frame != NULL;
+}
+
+// Nobody is looking, or there is nothing to look at
+static bool capture_suspended(struct WaylandOutput *output) {
+    struct Context *ctx = output->ctx;
+    return ctx->paused || ctx->idle || output->power_off;
+}
+
+// Outputs that can capture again start from the shortest delay
+static void capture_resume(struct Context *ctx) {
+    struct WaylandOutput *output;
+    wl_list_for_each(output, ctx->outputs, link) {
+        if (output->active && output->backlight && capture_armable(output) && !capture_suspended(output)) {
+            output->capture_delay = ctx->frame_min_delay;
+            timer_arm(&output->capture_timer, output->capture_delay, 0);
+        }
+    }
+}
+
+// Time from when the compositor presented a frame until it is here
+static void frame_presented(struct Context *ctx, uint64_t now, uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    uint64_t presented = ((((uint64_t)tv_sec_hi << 32) | tv_sec_lo) * 1000000000ULL) + tv_nsec;
+    ctx->stats.frames_captured++;
+#ifdef WLUMA_ALLOC_STATS
+    if (ctx->stats.frames_captured == ALLOC_WARMUP_FRAMES) {
+        ctx->stats.warm_allocs = alloc_count();
+    }
+#endif
+    if (presented > 0 && presented <= now) {
+        stats_add(&ctx->stats, STAT_CAPTURE, now - presented);
+    }
+}
+
+static void frame_free(struct Frame *frame) {
+    if (frame == NULL) {
+        return;
+    }
+
+#ifdef HAVE_IMAGE_COPY
+    if (frame->capture == NULL) {
+        struct ImageCopyBuffer *buffer = wl_container_of(frame, buffer, frame);
+        image_buffer_release(buffer);
+        return;
+    }
+#endif
+
+    zwlr_export_dmabuf_frame_v1_destroy(frame->capture);
+
+    for (uint32_t i = 0; i < frame->num_objects; i++) {
+        close(frame->fds[i]);
+    }
+
+    // Free again for the next frame of the output
+    frame->capture = NULL;
+}
+
+static void trace_write(struct Context *ctx, struct WaylandOutput *output, int luma, double difference, long lux, int backlight);
+static void ipc_publish(struct Context *ctx, struct WaylandOutput *output, int luma, long lux);
+
+// Learns from or acts on a processed frame, shared with replay
+static void luma_processed(struct Context *ctx, struct WaylandOutput *output, int luma, double difference, long lux, int backlight) {
+    struct Backlight *bl = output->backlight;
+
+    struct timespec now;
+    clock_now(ctx, &now);
+    struct LuxFilter *filter = &output->lux_filter;
+    bool initialized = filter->initialized;
+    bool lux_moved = lux_filter_push(filter, &ctx->lux_filter, lux, timespec_ns(&now));
+
+    // Nothing to do while neither the screen, ambient light nor the user changes anything, ask for frames less often
+    bool unchanged = difference < FRAME_CHANGE_THRESHOLD
+        && initialized
+        && !bl->transition_active
+        && bl->pendingCountdown == 0
+        && backlight == bl->last
+        && !lux_moved;
+
+    output->capture_delay = unchanged ? fmin(output->capture_delay * 2, ctx->frame_max_delay) : ctx->frame_min_delay;
+    if (output->active && capture_armable(output)) {
+        timer_arm(&output->capture_timer, output->capture_delay, 0);
+    }
+
+    if (unchanged) {
+        ctx->stats.frames_unchanged++;
+        return;
+    }
+
+    // Track backlight values until lux initialization is complete
+    if (!initialized) {
+        bl->last = backlight;
+    }
+
+    // Set the most appropriate backlight value, unless it is pinned
+    if (bl->pinned) {
+        bl->last = backlight;
+    } else if (filter->initialized) {
+        update_backlight(bl, filter->value, luma, backlight);
+    }
+
+    if (filter->initialized) {
+        ipc_publish(ctx, output, luma, filter->value);
+    }
+}
+
+// Reads sensors along with a frame reduced to luma by either path
+static void luma_ready(struct Context *ctx, struct WaylandOutput *output, int luma, double difference) {
+    struct Backlight *bl = output->backlight;
+
+    // Don't update backlight if there was an error or exit signal
+    if (ctx->quit || ctx->err || bl == NULL) {
+        return;
+    }
+    output->luma = luma;
+    output->luma_valid = true;
+
+    uint64_t start = stats_now();
+    if (ctx->stats.launched && !ctx->stats.first_frame) {
+        ctx->stats.first_frame = start;
+    }
+
+    long lux = read_lux(ctx);
+    stats_since(&ctx->stats, STAT_READ_LUX, start);
+
+    start = stats_now();
+    int backlight = read_backlight_pct(bl);
+    stats_since(&ctx->stats, STAT_READ_BACKLIGHT, start);
+
+    if (ctx->trace_fd != -1) {
+        trace_write(ctx, output, luma, difference, lux, backlight);
+    }
+
+    luma_processed(ctx, output, luma, difference, lux, backlight);
+}
+
+// Frames are dropped on errors, only a lost device is fatal
+static bool vulkan_device_lost(struct Context *ctx) {
+    if (ctx->vulkan->device_lost) {
+        fprintf(stderr, "ERROR: Lost Vulkan device!\n");
+        ctx->err = 1;
+    }
+    return ctx->vulkan->device_lost;
+}
+
+static void frame_processed(struct Context *ctx, struct VulkanSlot *slot) {
+    struct WaylandOutput *output = wl_container_of(slot->output, output, vulkan);
+
+    // GPU is done with the buffer, give it back to the compositor right away
+    double difference;
+    uint64_t start = stats_now();
+    int luma = read_frame_luma_pct_vulkan(ctx->vulkan, slot, &difference);
+    stats_since(&ctx->stats, STAT_READBACK, start);
+    frame_free(release_slot_vulkan(ctx->vulkan, slot));
+
+    // Capture timer is armed already, the next frame gets another try
+    if (luma < 0) {
+        ctx->stats.frames_dropped++;
+        return;
+    }
+
+    luma_ready(ctx, output, luma, difference);
+}
+
+static void submit_processed(struct Context *ctx, struct VulkanSubmit *submit) {
+    stats_since(&ctx->stats, STAT_GPU, timespec_ns(&submit->submitted));
+
+    struct VulkanSlot *slot, *tmp;
+    wl_list_for_each_safe(slot, tmp, &submit->slots, link) {
+        frame_processed(ctx, slot);
+    }
+
+    // Fence that failed to reset is reset again with the next submission
+    release_submit_vulkan(ctx->vulkan, submit);
+}
+
+static void on_fence_signaled(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    struct VulkanSubmit *submit = source->data;
+    if (submit->busy) {
+        submit_processed(ctx, submit);
+    }
+}
+
+static void vulkan_frame_dropped(void *data, struct Frame *frame) {
+    struct Context *ctx = data;
+    ctx->stats.frames_dropped++;
+    frame_free(frame);
+}
+
+static bool vulkan_fence_exported(void *data, struct VulkanSubmit *submit) {
+    struct Context *ctx = data;
+    struct EventSource *source = &ctx->fence_sources[submit - ctx->vulkan->submits];
+    source->fd = submit->fence_fd;
+    source->handler = on_fence_signaled;
+    source->data = submit;
+    return event_add(ctx, source, EPOLLIN) != -1;
+}
+
+static void vulkan_fence_released(void *data, struct VulkanSubmit *submit) {
+    struct Context *ctx = data;
+    event_remove(ctx, &ctx->fence_sources[submit - ctx->vulkan->submits]);
+}
+
+static const struct VulkanListener vulkan_listener = {
+    .frame_dropped  = vulkan_frame_dropped,
+    .fence_exported = vulkan_fence_exported,
+    .fence_released = vulkan_fence_released,
+};
+
+static bool submit_polled(struct VulkanSubmit *submit) {
+    return !(submit->fence_exported && submit->fence_fd >= 0);
+}
+
+static long submit_waited_ns(struct VulkanSubmit *submit, const struct timespec *now) {
+    return (now->tv_sec - submit->submitted.tv_sec) * 1000000000L + (now->tv_nsec - submit->submitted.tv_nsec);
+}
+
+// Fallback for fences that could not be exported as sync fd, fences that take longer than VULKAN_FENCE_MAX_WAIT_NS
+// are reported once and waited for, GPUs stall on resume or reset
+static void poll_submits(struct Context *ctx) {
+    if (ctx->vulkan == NULL) {
+        return;
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    for (int i = 0; i < VULKAN_SUBMITS && !ctx->err; i++) {
+        struct VulkanSubmit *submit = &ctx->vulkan->submits[i];
+        if (!submit->busy) {
+            continue;
+        }
+
+        if (submit_polled(submit) && submit_done_vulkan(ctx->vulkan, submit)) {
+            submit_processed(ctx, submit);
+            continue;
+        }
+
+        if (!submit->overdue && submit_waited_ns(submit, &now) > VULKAN_FENCE_MAX_WAIT_NS) {
+            fprintf(stderr, "WARN: Vulkan fence takes longer than %ld ms, still waiting for it!\n", VULKAN_FENCE_MAX_WAIT_NS / 1000000L);
+            submit->overdue = true;
+        }
+    }
+
+    vulkan_device_lost(ctx);
+}
+
+// Polled fences are checked every VULKAN_FENCE_POLL_MS, exported ones once they are overdue, then only when they signal
+static int submits_timeout(struct Context *ctx) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    int timeout = -1;
+    for (int i = 0; i < VULKAN_SUBMITS && ctx->vulkan; i++) {
+        struct VulkanSubmit *submit = &ctx->vulkan->submits[i];
+        if (!submit->busy) {
+            continue;
+        }
+        if (submit_polled(submit)) {
+            return VULKAN_FENCE_POLL_MS;
+        }
+        if (submit->overdue) {
+            continue;
+        }
+
+        long left = VULKAN_FENCE_MAX_WAIT_NS - submit_waited_ns(submit, &now);
+        int left_ms = left > 0 ? left / 1000000L + 1 : 0;
+        if (timeout == -1 || left_ms < timeout) {
+            timeout = left_ms;
+        }
+    }
+    return timeout;
+}
+
+static void frame_ready(void *data, struct zwlr_export_dmabuf_frame_v1 *frame,
+                        uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    struct WaylandOutput *output = data;
+    struct Context *ctx = output->ctx;
+
+    uint64_t start = stats_now();
+    frame_presented(ctx, start, tv_sec_hi, tv_sec_lo, tv_nsec);
+
+    // Hand the frame over to the GPU, it is processed once the fence signals
+    output->frame_callback = NULL;
+    if (record_frame_vulkan(ctx->vulkan, &output->vulkan, output->frame)) {
+        stats_since(&ctx->stats, STAT_IMPORT, start);
+    } else {
+        ctx->stats.frames_dropped++;
+        frame_free(output->frame);
+    }
+    output->frame = NULL;
+
+    // Wait a bit before asking for the next frame, delay is adjusted once this one is processed
+    timer_arm(&output->capture_timer, output->capture_delay, 0);
+}
+
+static void capture_next_frame(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    struct WaylandOutput *output = source->data;
+    if (timer_expirations(source) == 0 || output->removed || capture_suspended(output)) {
+        return;
+    }
+
+    // Image copy frame is held until the output changes, ambient light is followed meanwhile and re-arms the timer
+    if (output->image_frame && output->luma_valid) {
+        luma_ready(ctx, output, output->luma, 0);
+        return;
+    }
+    if (output->image_frame) {
+        timer_arm(&output->capture_timer, output->capture_delay, 0);
+        return;
+    }
+
+    register_frame_listener(output);
+}
+
+static void frame_start(void *data, struct zwlr_export_dmabuf_frame_v1 *frame,
+        uint32_t width, uint32_t height, uint32_t offset_x, uint32_t offset_y,
+        uint32_t buffer_flags, uint32_t flags, uint32_t format,
+        uint32_t mod_high, uint32_t mod_low, uint32_t num_objects) {
+    struct WaylandOutput *output = data;
+    struct Context *ctx = output->ctx;
+
+    prepare_frame_vulkan(ctx->vulkan, &output->vulkan, width, height);
+
+    // Slots hold at most VULKAN_SLOTS frames, so one of them is always free
+    for (int i = 0; i < EXPORT_FRAMES && output->frame == NULL; i++) {
+        if (output->export_frames[i].capture == NULL) {
+            output->frame = &output->export_frames[i];
+        }
+    }
+
+    // Frames are leaked somewhere if this happens, the capture is retried after the usual delay
+    if (output->frame == NULL) {
+        fprintf(stderr, "WARN: No export frame is free, skipping frame!\n");
+        ctx->stats.frames_dropped++;
+        zwlr_export_dmabuf_frame_v1_destroy(frame);
+        output->frame_callback = NULL;
+        timer_arm(&output->capture_timer, output->capture_delay, 0);
+        return;
+    }
+
+    output->frame->capture = frame;
+    output->frame->width = width;
+    output->frame->height = height;
+    output->frame->format = format;
+    output->frame->modifier = ((uint64_t)mod_high << 32) | mod_low;
+    output->frame->num_objects = num_objects;
+    output->frame->disjoint = false;
+}
+
+static void frame_object(void *data, struct zwlr_export_dmabuf_frame_v1 *frame,
+        uint32_t index, int32_t fd, uint32_t size, uint32_t offset,
+        uint32_t stride, uint32_t plane_index) {
+    struct WaylandOutput *output = data;
+
+    output->frame->fds[index] = fd;
+    output->frame->sizes[index] = size;
+    output->frame->offsets[index] = offset;
+    output->frame->strides[index] = stride;
+    output->frame->plane_indices[index] = plane_index;
+
+    struct stat first, current;
+    if (index > 0 && fstat(output->frame->fds[0], &first) == 0 && fstat(fd, &current) == 0) {
+        output->frame->disjoint = output->frame->disjoint || first.st_ino != current.st_ino;
+    }
+}
+
+static void frame_cancel(void *data, struct zwlr_export_dmabuf_frame_v1 *frame,
+        uint32_t reason) {
+    struct WaylandOutput *output = data;
+    struct Context *ctx = output->ctx;
+
+    if (output->frame) {
+        frame_free(output->frame);
+        output->frame = NULL;
+    } else {
+        zwlr_export_dmabuf_frame_v1_destroy(frame);
+    }
+    output->frame_callback = NULL;
+    ctx->stats.frames_cancelled++;
+
+    if (reason == ZWLR_EXPORT_DMABUF_FRAME_V1_CANCEL_REASON_PERMANENT) {
+        fprintf(stderr, "ERROR: Permanent failure when capturing frame!\n");
+        ctx->err = 1;
+    } else {
+        register_frame_listener(output);
+    }
+}
+
+static const struct zwlr_export_dmabuf_frame_v1_listener frame_listener = {
+    .frame  = frame_start,
+    .object = frame_object,
+    .ready  = frame_ready,
+    .cancel = frame_cancel,
+};
+
+static void register_copy_listener(struct WaylandOutput *output);
+#ifdef HAVE_IMAGE_COPY
+static void image_copy_capture(struct WaylandOutput *output);
+#endif
+
+static void register_frame_listener(struct WaylandOutput *output) {
+    if (output->ctx->vulkan == NULL) {
+        register_copy_listener(output);
+        return;
+    }
+
+#ifdef HAVE_IMAGE_COPY
+    if (output->ctx->gbm && !output->image_stopped) {
+        image_copy_capture(output);
+        return;
+    }
+#endif
+
+    // Image copy was stopped and there is nothing to fall back to
+    if (output->ctx->dmabuf_manager == NULL) {
+        return;
+    }
+
+    output->frame_callback = zwlr_export_dmabuf_manager_v1_capture_output(output->ctx->dmabuf_manager, false, output->output);
+    zwlr_export_dmabuf_frame_v1_add_listener(output->frame_callback, &frame_listener, output);
+}
+
+
+/******************************************************************************
+ * Shared memory capture
+ */
+
+static void shm_buffer_free(struct ShmBuffer *shm) {
+    if (shm->buffer) wl_buffer_destroy(shm->buffer);
+    if (shm->data)   munmap(shm->data, shm->size);
+    *shm = (struct ShmBuffer){ 0 };
+}
+
+static int shm_file_open(void) {
+    struct timespec now;
+    char name[64];
+    for (int i = 0; i < 16; i++) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        snprintf(name, sizeof(name), "/wluma-%d-%ld", getpid(), now.tv_nsec + i);
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+        if (fd != -1) {
+            // Nothing else needs to find the file, it lives on through the fd
+            shm_unlink(name);
+            return fd;
+        }
+        if (errno != EEXIST) {
+            break;
+        }
+    }
+    return -1;
+}
+
+// Buffer is only recreated when shape of the frames changes
+static bool shm_buffer_prepare(struct Context *ctx, struct ShmBuffer *shm,
+        uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+    if (shm->buffer && shm->format == format && shm->width == width && shm->height == height && shm->stride == stride) {
+        return true;
+    }
+    shm_buffer_free(shm);
+
+    size_t size = (size_t)stride * height;
+    int fd = shm_file_open();
+    if (fd == -1 || ftruncate(fd, size) == -1) {
+        fprintf(stderr, "ERROR: Failed to create shared memory buffer!\n");
+        goto fail;
+    }
+
+    shm->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm->data == MAP_FAILED) {
+        shm->data = NULL;
+        fprintf(stderr, "ERROR: Failed to map shared memory buffer!\n");
+        goto fail;
+    }
+    shm->size = size;
+
+    struct wl_shm_pool *pool = wl_shm_create_pool(ctx->shm, fd, size);
+    shm->buffer = wl_shm_pool_create_buffer(pool, 0, width, height, stride, format);
+    wl_shm_pool_destroy(pool);
+    close(fd);
+
+    shm->format = format;
+    shm->width = width;
+    shm->height = height;
+    shm->stride = stride;
+    return true;
+
+fail:
+    if (fd != -1) close(fd);
+    shm_buffer_free(shm);
+    return false;
+}
+
+static bool shm_format_supported(uint32_t format) {
+    return format == WL_SHM_FORMAT_XRGB8888 || format == WL_SHM_FORMAT_ARGB8888
+        || format == WL_SHM_FORMAT_XBGR8888 || format == WL_SHM_FORMAT_ABGR8888;
+}
+
+static void copy_start(struct WaylandOutput *output, struct zwlr_screencopy_frame_v1 *frame) {
+    if (output->shm_usable) {
+        zwlr_screencopy_frame_v1_copy(frame, output->shm.buffer);
+        return;
+    }
+
+    // Frames of this output can't be analyzed for now, the format may change with the mode, ask again after the longest delay
+    zwlr_screencopy_frame_v1_destroy(frame);
+    output->copy_frame = NULL;
+    output->capture_delay = output->ctx->frame_max_delay;
+    timer_arm(&output->capture_timer, output->capture_delay, 0);
+}
+
+static void copy_buffer(void *data, struct zwlr_screencopy_frame_v1 *frame,
+        uint32_t format, uint32_t width, uint32_t height, uint32_t stride) {
+    struct WaylandOutput *output = data;
+    struct Context *ctx = output->ctx;
+
+    output->shm_usable = false;
+    if (!shm_format_supported(format)) {
+        if (!output->shm_unsupported) {
+            fprintf(stderr, "WARN: Unsupported shared memory frame format %08x for output %s, it is not analyzed until that changes!\n",
+                format, output->name ? output->name : "");
+        }
+        output->shm_unsupported = true;
+    } else if (shm_buffer_prepare(ctx, &output->shm, format, width, height, stride)) {
+        output->shm_usable = true;
+        output->shm_unsupported = false;
+    } else {
+        ctx->err = 1;
+    }
+
+    // Before v3 there is no buffer_done event, shared memory is the only kind of buffer
+    if (zwlr_screencopy_frame_v1_get_version(frame) < 3) {
+        copy_start(output, frame);
+    }
+}
+
+static void copy_flags(void *data, struct zwlr_screencopy_frame_v1 *frame, uint32_t flags) {
+}
+
+static void copy_ready(void *data, struct zwlr_screencopy_frame_v1 *frame,
+        uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    struct WaylandOutput *output = data;
+    struct Context *ctx = output->ctx;
+
+    uint64_t start = stats_now();
+    frame_presented(ctx, start, tv_sec_hi, tv_sec_lo, tv_nsec);
+
+    zwlr_screencopy_frame_v1_destroy(frame);
+    output->copy_frame = NULL;
+
+    // Formats were checked once the buffer was offered, byte order is all that differs
+    struct ShmBuffer *shm = &output->shm;
+    bool blue_first = shm->format == WL_SHM_FORMAT_XRGB8888 || shm->format == WL_SHM_FORMAT_ARGB8888;
+    double difference;
+    int luma = luma_pct_cpu(&ctx->settings, &output->luma_cpu, shm->data, shm->width, shm->height, shm->stride, blue_first, &difference);
+    stats_since(&ctx->stats, STAT_READBACK, start);
+
+    // Wait a bit before asking for the next frame, delay is adjusted once this one is processed
+    timer_arm(&output->capture_timer, output->capture_delay, 0);
+
+    luma_ready(ctx, output, luma, difference);
+}
+
+static void copy_failed(void *data, struct zwlr_screencopy_frame_v1 *frame) {
+    struct WaylandOutput *output = data;
+    struct Context *ctx = output->ctx;
+
+    zwlr_screencopy_frame_v1_destroy(frame);
+    output->copy_frame = NULL;
+    ctx->stats.frames_cancelled++;
+
+    // There is no reason given, so don't retry right away
+    timer_arm(&output->capture_timer, output->capture_delay, 0);
+}
+
+static void copy_damage(void *data, struct zwlr_screencopy_frame_v1 *frame,
+        uint32_t x, uint32_t y, uint32_t width, uint32_t height) {
+}
+
+static void copy_linux_dmabuf(void *data, struct zwlr_screencopy_frame_v1 *frame,
+        uint32_t format, uint32_t width, uint32_t height) {
+}
+
+static void copy_buffer_done(void *data, struct zwlr_screencopy_frame_v1 *frame) {
+    copy_start(data, frame);
+}
+
+static const struct zwlr_screencopy_frame_v1_listener copy_listener = {
+    .buffer       = copy_buffer,
+    .flags        = copy_flags,
+    .ready        = copy_ready,
+    .failed       = copy_failed,
+    .damage       = copy_damage,
+    .linux_dmabuf = copy_linux_dmabuf,
+    .buffer_done  = copy_buffer_done,
+};
+
+static void register_copy_listener(struct WaylandOutput *output) {
+    output->shm_usable = false;
+    output->copy_frame = zwlr_screencopy_manager_v1_capture_output(output->ctx->screencopy_manager, false, output->output);
+    zwlr_screencopy_frame_v1_add_listener(output->copy_frame, &copy_listener, output);
+}
+
+
+/******************************************************************************
+ * Image copy capture
+ */
+
+#ifdef HAVE_IMAGE_COPY
+static void image_buffer_destroy(struct ImageCopyBuffer *buffer) {
+    if (buffer->buffer) wl_buffer_destroy(buffer->buffer);
+    if (buffer->frame.num_objects > 0) close(buffer->frame.fds[0]);
+    if (buffer->bo) gbm_bo_destroy(buffer->bo);
+    free(buffer);
+}
+
+// Back from the compositor or the GPU
+static void image_buffer_release(struct ImageCopyBuffer *buffer) {
+    buffer->busy = false;
+    if (buffer->stale) {
+        image_buffer_destroy(buffer);
+    }
+}
+
+// Single plane buffer in the format and with one of the modifiers the session offered
+static struct ImageCopyBuffer* image_buffer_create(struct Context *ctx, struct WaylandOutput *output) {
+    struct ImageCopyBuffer *buffer = calloc(1, sizeof(struct ImageCopyBuffer));
+    struct Frame *frame = &buffer->frame;
+
+    if (output->image_modifier_count > 0) {
+        buffer->bo = gbm_bo_create_with_modifiers2(ctx->gbm, output->image_width, output->image_height, output->image_format,
+            output->image_modifiers, output->image_modifier_count, GBM_BO_USE_RENDERING);
+    } else {
+        buffer->bo = gbm_bo_create(ctx->gbm, output->image_width, output->image_height, output->image_format, GBM_BO_USE_RENDERING);
+    }
+    if (buffer->bo == NULL || gbm_bo_get_plane_count(buffer->bo) != 1) {
+        goto fail;
+    }
+
+    frame->fds[0] = gbm_bo_get_fd_for_plane(buffer->bo, 0);
+    if (frame->fds[0] < 0) {
+        goto fail;
+    }
+
+    frame->capture = NULL;
+    frame->width = output->image_width;
+    frame->height = output->image_height;
+    frame->format = output->image_format;
+    frame->modifier = output->image_modifier_count > 0 ? gbm_bo_get_modifier(buffer->bo) : DRM_FORMAT_MOD_INVALID;
+    frame->num_objects = 1;
+    frame->sizes[0] = lseek(frame->fds[0], 0, SEEK_END);
+    frame->offsets[0] = gbm_bo_get_offset(buffer->bo, 0);
+    frame->strides[0] = gbm_bo_get_stride_for_plane(buffer->bo, 0);
+    frame->plane_indices[0] = 0;
+    frame->disjoint = false;
+
+    struct zwp_linux_buffer_params_v1 *params = zwp_linux_dmabuf_v1_create_params(ctx->linux_dmabuf);
+    zwp_linux_buffer_params_v1_add(params, frame->fds[0], 0, frame->offsets[0], frame->strides[0],
+        frame->modifier >> 32, frame->modifier & 0xffffffff);
+    buffer->buffer = zwp_linux_buffer_params_v1_create_immed(params, frame->width, frame->height, frame->format, 0);
+    zwp_linux_buffer_params_v1_destroy(params);
+    return buffer;
+
+fail:
+    image_buffer_destroy(buffer);
+    return NULL;
+}
+
+// Buffers the GPU still reads are destroyed once it is done with them
+static void image_pool_clear(struct WaylandOutput *output) {
+    for (int i = 0; i < IMAGE_COPY_BUFFERS; i++) {
+        struct ImageCopyBuffer *buffer = output->image_buffers[i];
+        if (buffer && buffer->busy) {
+            buffer->stale = true;
+        } else if (buffer) {
+            image_buffer_destroy(buffer);
+        }
+        output->image_buffers[i] = NULL;
+    }
+}
+
+static void image_offer_clear(struct WaylandOutput *output) {
+    free(output->image_modifiers);
+    output->image_modifiers = NULL;
+    output->image_modifier_count = 0;
+    output->image_format = 0;
+}
+
+static void image_frame_destroy(struct WaylandOutput *output) {
+    if (output->image_frame) {
+        ext_image_copy_capture_frame_v1_destroy(output->image_frame);
+        output->image_frame = NULL;
+    }
+    if (output->image_buffer) {
+        image_buffer_release(output->image_buffer);
+        output->image_buffer = NULL;
+    }
+}
+
+static void image_copy_stop(struct WaylandOutput *output) {
+    image_frame_destroy(output);
+    image_pool_clear(output);
+    image_offer_clear(output);
+    output->image_wanted = false;
+
+    if (output->image_session) {
+        ext_image_copy_capture_session_v1_destroy(output->image_session);
+        output->image_session = NULL;
+    }
+    if (output->image_source) {
+        ext_image_capture_source_v1_destroy(output->image_source);
+        output->image_source = NULL;
+    }
+}
+
+// Export-dmabuf takes over for the rest of the life of the output
+static void image_copy_fall_back(struct WaylandOutput *output) {
+    struct Context *ctx = output->ctx;
+
+    image_copy_stop(output);
+    output->image_stopped = true;
+
+    if (ctx->dmabuf_manager == NULL) {
+        fprintf(stderr, "WARN: Image copy capture of output %s stopped and export-dmabuf is not available, skipping its frames!\n",
+            output->name ? output->name : "");
+        return;
+    }
+
+    if (output->active && output->backlight) {
+        timer_arm(&output->capture_timer, output->capture_delay, 0);
+    }
+}
+
+// Unchanged frames are not analyzed again, and neither are changes outside of the analyzed rectangle
+static bool image_damage_analyzed(struct WaylandOutput *output, uint32_t width, uint32_t height) {
+    struct Context *ctx = output->ctx;
+    if (!output->luma_valid) {
+        return true;
+    }
+    if (!output->image_damaged) {
+        return false;
+    }
+    if (ctx->settings.region_mode != REGION_RECT) {
+        return true;
+    }
+
+    uint32_t region[4];
+    luma_region(&ctx->settings, width, height, region);
+    int32_t *damage = output->image_damage;
+    return damage[0] < (int64_t)region[0] + region[2] && damage[2] > (int64_t)region[0]
+        && damage[1] < (int64_t)region[1] + region[3] && damage[3] > (int64_t)region[1];
+}
+
+static void image_frame_transform(void *data, struct ext_image_copy_capture_frame_v1 *frame, uint32_t transform) {
+}
+
+static void image_frame_damage(void *data, struct ext_image_copy_capture_frame_v1 *frame,
+        int32_t x, int32_t y, int32_t width, int32_t height) {
+    struct WaylandOutput *output = data;
+
+    int32_t box[4] = { x, y, x + width, y + height };
+    for (int i = 0; i < 4; i++) {
+        bool grows = i < 2 ? box[i] < output->image_damage[i] : box[i] > output->image_damage[i];
+        if (!output->image_damaged || grows) {
+            output->image_damage[i] = box[i];
+        }
+    }
+    output->image_damaged = true;
+}
+
+static void image_frame_presentation_time(void *data, struct ext_image_copy_capture_frame_v1 *frame,
+        uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
+    struct WaylandOutput *output = data;
+    output->image_presented[0] = tv_sec_hi;
+    output->image_presented[1] = tv_sec_lo;
+    output->image_presented[2] = tv_nsec;
+}
+
+static void image_frame_ready(void *data, struct ext_image_copy_capture_frame_v1 *frame) {
+    struct WaylandOutput *output = data;
+    struct Context *ctx = output->ctx;
+
+    uint64_t start = stats_now();
+    frame_presented(ctx, start, output->image_presented[0], output->image_presented[1], output->image_presented[2]);
+
+    ext_image_copy_capture_frame_v1_destroy(frame);
+    output->image_frame = NULL;
+    struct Frame *buffer_frame = &output->image_buffer->frame;
+    output->image_buffer = NULL;
+
+    // Wait a bit before asking for the next frame, delay is adjusted once this one is processed
+    timer_arm(&output->capture_timer, output->capture_delay, 0);
+
+    if (!image_damage_analyzed(output, buffer_frame->width, buffer_frame->height)) {
+        frame_free(buffer_frame);
+        luma_ready(ctx, output, output->luma, 0);
+        return;
+    }
+
+    // Hand the frame over to the GPU, it is processed once the fence signals
+    prepare_frame_vulkan(ctx->vulkan, &output->vulkan, buffer_frame->width, buffer_frame->height);
+    if (record_frame_vulkan(ctx->vulkan, &output->vulkan, buffer_frame)) {
+        stats_since(&ctx->stats, STAT_IMPORT, start);
+    } else {
+        ctx->stats.frames_dropped++;
+        frame_free(buffer_frame);
+    }
+}
+
+static void image_frame_failed(void *data, struct ext_image_copy_capture_frame_v1 *frame, uint32_t reason) {
+    struct WaylandOutput *output = data;
+    struct Context *ctx = output->ctx;
+
+    image_frame_destroy(output);
+    ctx->stats.frames_cancelled++;
+
+    // Stopped session tells on its own, new constraints are picked up by the next capture
+    if (reason != EXT_IMAGE_COPY_CAPTURE_FRAME_V1_FAILURE_REASON_STOPPED) {
+        timer_arm(&output->capture_timer, output->capture_delay, 0);
+    }
+}
+
+static const struct ext_image_copy_capture_frame_v1_listener image_frame_listener = {
+    .transform         = image_frame_transform,
+    .damage            = image_frame_damage,
+    .presentation_time = image_frame_presentation_time,
+    .ready             = image_frame_ready,
+    .failed            = image_frame_failed,
+};
+
+static void image_session_buffer_size(void *data, struct ext_image_copy_capture_session_v1 *session, uint32_t width, uint32_t height) {
+    struct WaylandOutput *output = data;
+    output->image_width = width;
+    output->image_height = height;
+}
+
+static void image_session_shm_format(void *data, struct ext_image_copy_capture_session_v1 *session, uint32_t format) {
+}
+
+// Buffers are allocated on the device Vulkan runs on, see image_copy_open
+static void image_session_dmabuf_device(void *data, struct ext_image_copy_capture_session_v1 *session, struct wl_array *device) {
+}
+
+// First format with modifiers Vulkan can import wins, the implicit modifier only when there are none
+static void image_session_dmabuf_format(void *data, struct ext_image_copy_capture_session_v1 *session,
+        uint32_t format, struct wl_array *modifiers) {
+    struct WaylandOutput *output = data;
+    struct Context *ctx = output->ctx;
+    if (output->image_format != 0) {
+        return;
+    }
+
+    uint64_t *usable = malloc(modifiers->size);
+    size_t count = 0;
+    bool implicit = false;
+    uint64_t *modifier;
+    wl_array_for_each(modifier, modifiers) {
+        if (*modifier == DRM_FORMAT_MOD_INVALID) {
+            implicit = frame_format_supported_vulkan(ctx->vulkan, format, *modifier);
+        } else if (frame_format_supported_vulkan(ctx->vulkan, format, *modifier)) {
+            usable[count++] = *modifier;
+        }
+    }
+
+    if (count == 0 && !implicit) {
+        free(usable);
+        return;
+    }
+
+    output->image_format = format;
+    output->image_modifiers = usable;
+    output->image_modifier_count = count;
+}
+
+// Constraints are complete, the pool is allocated from scratch every time they change
+static void image_session_done(void *data, struct ext_image_copy_capture_session_v1 *session) {
+    struct WaylandOutput *output = data;
+    struct Context *ctx = output->ctx;
+
+    image_pool_clear(output);
+    if (output->image_format == 0) {
+        fprintf(stderr, "WARN: Vulkan device can't import any buffer format image copy capture offers for output %s!\n",
+            output->name ? output->name : "");
+        image_copy_fall_back(output);
+        return;
+    }
+
+    bool allocated = true;
+    for (int i = 0; i < IMAGE_COPY_BUFFERS && allocated; i++) {
+        output->image_buffers[i] = image_buffer_create(ctx, output);
+        allocated = output->image_buffers[i] != NULL;
+    }
+    image_offer_clear(output);
+
+    if (!allocated) {
+        fprintf(stderr, "WARN: Failed to allocate buffers for image copy capture of output %s!\n", output->name ? output->name : "");
+        image_copy_fall_back(output);
+        return;
+    }
+
+    if (output->image_wanted) {
+        image_copy_capture(output);
+    }
+}
+
+static void image_session_stopped(void *data, struct ext_image_copy_capture_session_v1 *session) {
+    image_copy_fall_back(data);
+}
+
+static const struct ext_image_copy_capture_session_v1_listener image_session_listener = {
+    .buffer_size   = image_session_buffer_size,
+    .shm_format    = image_session_shm_format,
+    .dmabuf_device = image_session_dmabuf_device,
+    .dmabuf_format = image_session_dmabuf_format,
+    .done          = image_session_done,
+    .stopped       = image_session_stopped,
+};
+
+// Compositor copies the output once it changes, the timer meanwhile repeats the last luma at the current delay
+static void image_copy_capture(struct WaylandOutput *output) {
+    struct Context *ctx = output->ctx;
+
+    if (output->image_session == NULL) {
+        output->image_source = ext_output_image_capture_source_manager_v1_create_source(ctx->image_source_manager, output->output);
+        output->image_session = ext_image_copy_capture_manager_v1_create_session(ctx->image_copy_manager, output->image_source, 0);
+        ext_image_copy_capture_session_v1_add_listener(output->image_session, &image_session_listener, output);
+    }
+
+    // Buffers are allocated once the session tells what it can copy into
+    output->image_wanted = output->image_buffers[0] == NULL;
+    if (output->image_wanted) {
+        return;
+    }
+
+    struct ImageCopyBuffer *buffer = NULL;
+    for (int i = 0; i < IMAGE_COPY_BUFFERS && buffer == NULL; i++) {
+        if (output->image_buffers[i] && !output->image_buffers[i]->busy) {
+            buffer = output->image_buffers[i];
+        }
+    }
+
+    // GPU still reads all of them
+    if (buffer == NULL) {
+        timer_arm(&output->capture_timer, output->capture_delay, 0);
+        return;
+    }
+
+    buffer->busy = true;
+    output->image_buffer = buffer;
+    output->image_damaged = false;
+    memset(output->image_presented, 0, sizeof(output->image_presented));
+
+    // Buffers don't track what they missed since they were filled last, so all of them is damaged
+    output->image_frame = ext_image_copy_capture_session_v1_create_frame(output->image_session);
+    ext_image_copy_capture_frame_v1_add_listener(output->image_frame, &image_frame_listener, output);
+    ext_image_copy_capture_frame_v1_attach_buffer(output->image_frame, buffer->buffer);
+    ext_image_copy_capture_frame_v1_damage_buffer(output->image_frame, 0, 0, buffer->frame.width, buffer->frame.height);
+    ext_image_copy_capture_frame_v1_capture(output->image_frame);
+
+    timer_arm(&output->capture_timer, output->capture_delay, 0);
+}
+
+// Render node of the DRM device, whichever of its nodes was announced
+static int drm_render_node_open(dev_t device) {
+    char path[BUF_SIZE];
+    snprintf(path, sizeof(path), "/sys/dev/char/%u:%u/device/drm", major(device), minor(device));
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return -1;
+    }
+
+    int fd = -1;
+    struct dirent *entry;
+    while (fd == -1 && (entry = readdir(dir)) != NULL) {
+        if (!strncmp(entry->d_name, "renderD", strlen("renderD"))) {
+            snprintf(path, sizeof(path), "%s/%s", DRI_PATH, entry->d_name);
+            fd = open(path, O_RDWR | O_CLOEXEC);
+        }
+    }
+
+    closedir(dir);
+    return fd;
+}
+
+// Image copy needs buffers of our own on the device frames are analyzed on, export-dmabuf is used otherwise
+static void image_copy_open(struct Context *ctx) {
+    if (!ctx->image_copy_manager || !ctx->image_source_manager) {
+        goto fail;
+    }
+
+    ctx->gbm_fd = ctx->linux_dmabuf && ctx->drm_device_known ? drm_render_node_open(ctx->drm_device) : -1;
+    ctx->gbm = ctx->gbm_fd != -1 ? gbm_create_device(ctx->gbm_fd) : NULL;
+    if (ctx->gbm) {
+        return;
+    }
+    fprintf(stderr, "WARN: Failed to open GBM device, capturing frames with export-dmabuf instead of image copy!\n");
+
+fail:
+    if (ctx->gbm_fd > 0)            close(ctx->gbm_fd);
+    if (ctx->image_copy_manager)   ext_image_copy_capture_manager_v1_destroy(ctx->image_copy_manager);
+    if (ctx->image_source_manager) ext_output_image_capture_source_manager_v1_destroy(ctx->image_source_manager);
+    ctx->gbm_fd = -1;
+    ctx->image_copy_manager = NULL;
+    ctx->image_source_manager = NULL;
+}
+#endif
+
+/******************************************************************************
+ * Power and idle
+ */
+
+// Battery counts once nothing else supplies power, batteries of mice and other devices don't
+static enum PowerSource power_supply_read(void) {
+    DIR *dir = opendir(POWER_SUPPLY_BASE_PATH);
+    if (dir == NULL) {
+        return POWER_AC;
+    }
+
+    bool battery = false, online = false;
+    struct dirent *subdir;
+    char val[32];
+    while ((subdir = readdir(dir))) {
+        if (subdir->d_name[0] == '.') {
+            continue;
+        }
+
+        sprintf(buf, "%s/%s/scope", POWER_SUPPLY_BASE_PATH, subdir->d_name);
+        if (read_sysfs(buf, val, sizeof(val)) && !strcmp(val, "Device")) {
+            continue;
+        }
+
+        sprintf(buf, "%s/%s/type", POWER_SUPPLY_BASE_PATH, subdir->d_name);
+        if (read_sysfs(buf, val, sizeof(val)) && !strcmp(val, "Battery")) {
+            battery = true;
+            continue;
+        }
+
+        sprintf(buf, "%s/%s/online", POWER_SUPPLY_BASE_PATH, subdir->d_name);
+        online = online || (read_sysfs(buf, val, sizeof(val)) && strtol(val, NULL, 10) > 0);
+    }
+    closedir(dir);
+
+    return battery && !online ? POWER_BATTERY : POWER_AC;
+}
+
+static void capture_profile_apply(struct Context *ctx) {
+    struct CaptureProfile *profile = &ctx->capture_profiles[ctx->power];
+    ctx->frame_min_delay = profile->min_delay;
+    ctx->frame_max_delay = profile->max_delay;
+
+    struct WaylandOutput *output;
+    wl_list_for_each(output, ctx->outputs, link) {
+        output->capture_delay = fmin(fmax(output->capture_delay, profile->min_delay), profile->max_delay);
+    }
+}
+
+// Kernel announces changes of power supplies along with every other device, only those are looked at
+static void power_uevent(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    bool changed = false;
+    ssize_t len;
+    while ((len = recv(source->fd, buf, BUF_SIZE - 1, 0)) > 0) {
+        buf[len] = 0;
+        for (char *field = buf; field < buf + len; field += strlen(field) + 1) {
+            changed = changed || !strcmp(field, "SUBSYSTEM=power_supply");
+        }
+    }
+
+    enum PowerSource power = changed ? power_supply_read() : ctx->power;
+    if (power != ctx->power) {
+        ctx->power = power;
+        capture_profile_apply(ctx);
+    }
+}
+
+static void idle_idled(void *data, struct ext_idle_notification_v1 *notification) {
+    struct Context *ctx = data;
+    ctx->idle = true;
+}
+
+static void idle_resumed(void *data, struct ext_idle_notification_v1 *notification) {
+    struct Context *ctx = data;
+    ctx->idle = false;
+    capture_resume(ctx);
+}
+
+static const struct ext_idle_notification_v1_listener idle_listener = {
+    .idled   = idle_idled,
+    .resumed = idle_resumed,
+};
+
+static void output_power_mode(void *data, struct zwlr_output_power_v1 *power, uint32_t mode) {
+    struct WaylandOutput *output = data;
+    output->power_off = mode == ZWLR_OUTPUT_POWER_V1_MODE_OFF;
+    if (!output->power_off) {
+        capture_resume(output->ctx);
+    }
+}
+
+// Output doesn't support power management or another client controls it, capture goes on regardless
+static void output_power_failed(void *data, struct zwlr_output_power_v1 *power) {
+    struct WaylandOutput *output = data;
+    zwlr_output_power_v1_destroy(power);
+    output->power = NULL;
+    output->power_off = false;
+    capture_resume(output->ctx);
+}
+
+static const struct zwlr_output_power_v1_listener output_power_listener = {
+    .mode   = output_power_mode,
+    .failed = output_power_failed,
+};
+
+static void output_power_watch(struct Context *ctx, struct WaylandOutput *output) {
+    if (ctx->output_power_manager && output->power == NULL) {
+        output->power = zwlr_output_power_manager_v1_get_output_power(ctx->output_power_manager, output->output);
+        zwlr_output_power_v1_add_listener(output->power, &output_power_listener, output);
+    }
+}
+
+static void output_power_unwatch(struct WaylandOutput *output) {
+    if (output->power) {
+        zwlr_output_power_v1_destroy(output->power);
+        output->power = NULL;
+    }
+    output->power_off = false;
+}
+
+// Neither of these is required, capture just doesn't take a break without them
+static void power_open(struct Context *ctx) {
+    ctx->power = power_supply_read();
+    capture_profile_apply(ctx);
+
+    struct sockaddr_nl addr = { .nl_family = AF_NETLINK, .nl_groups = 1 };
+    ctx->uevent_source.fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+    ctx->uevent_source.handler = power_uevent;
+    if (ctx->uevent_source.fd == -1
+            || bind(ctx->uevent_source.fd, (struct sockaddr *)&addr, sizeof(addr)) == -1
+            || event_add(ctx, &ctx->uevent_source, EPOLLIN) == -1) {
+        fprintf(stderr, "WARN: Failed to watch power supplies, capture rate won't follow them!\n");
+        if (ctx->uevent_source.fd != -1) close(ctx->uevent_source.fd);
+        ctx->uevent_source.fd = 0;
+    }
+
+    if (ctx->idle_notifier && ctx->seat && ctx->idle_timeout > 0) {
+        ctx->idle_notification = ext_idle_notifier_v1_get_idle_notification(ctx->idle_notifier, ctx->idle_timeout, ctx->seat);
+        ext_idle_notification_v1_add_listener(ctx->idle_notification, &idle_listener, ctx);
+    } else if (ctx->idle_timeout > 0) {
+        fprintf(stderr, "WARN: Compositor doesn't support ext-idle-notify, capturing while idle!\n");
+    }
+}
+
+
+/******************************************************************************
+ * Outputs management
+ */
+
+#ifdef HAVE_LOGIND
+static void logind_process(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    while (sd_bus_process(ctx->bus, NULL) > 0);
+}
+
+static bool logind_connect(struct Context *ctx) {
+    if (sd_bus_open_system(&ctx->bus) < 0) {
+        ctx->bus = NULL;
+        return false;
+    }
+
+    ctx->bus_source.fd = sd_bus_get_fd(ctx->bus);
+    ctx->bus_source.handler = logind_process;
+    return ctx->bus_source.fd >= 0 && event_add(ctx, &ctx->bus_source, EPOLLIN) != -1;
+}
+#endif
+
+// Reading the attribute again re-arms the notification, what someone else set is acted upon right away
+static void backlight_changed(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    struct Backlight *bl = source->data;
+    struct WaylandOutput *output = bl->output;
+
+    pread_double(source->fd);
+    long raw = bl->ops->read(bl);
+    if (raw < 0 || raw == bl->raw) {
+        return;
+    }
+    bl->raw = raw;
+
+    // Writes of our own are announced too, once logind applied them they match
+    if (raw != bl->written && output->active && output->luma_valid && !capture_suspended(output)) {
+        luma_ready(ctx, output, output->luma, 0);
+    }
+}
+
+static void backlight_close(struct Context *ctx, struct Backlight *bl) {
+    if (bl->change_source.fd > 0) {
+        event_remove(ctx, &bl->change_source);
+        close(bl->change_source.fd);
+    }
+
+    if (bl->compaction.running) {
+        data_compact_finish(bl);
+    }
+
+    if (bl->compaction.done.fd > 0) {
+        event_remove(ctx, &bl->compaction.done);
+        close(bl->compaction.done.fd);
     }
 
-    unsigned char* rgba;
-    if (vkMapMemory(ctx->vulkan->device, ctx->vulkan->buffer_memory, 0, VK_WHOLE_SIZE, 0, (void *)&rgba) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to map Vulkan buffer memory!\n");
-        goto exit;
+    data_free(&bl->data);
+    journal_free(&bl->journal);
+    free(bl->data_path);
+
+    if (bl->transition_timer.fd > 0) {
+        event_remove(ctx, &bl->transition_timer);
+        close(bl->transition_timer.fd);
+    }
+
+    if (bl->data_fd > 0) close(bl->data_fd);
+    if (bl->raw_fd > 0)  close(bl->raw_fd);
+    if (bl->ddc)         ddc_close(bl->ddc);
+    free(bl->device);
+    free(bl);
+}
+
+// External monitors come with ddc probed already, the backlight takes it over
+static struct Backlight* backlight_open(struct Context *ctx, struct WaylandOutput *output, const char *device, struct DdcMonitor *ddc) {
+    struct Backlight *bl = calloc(1, sizeof(struct Backlight));
+    bl->output = output;
+
+    // Anything but an external monitor is a sysfs backlight device
+    if (ddc) {
+        bl->raw_fd = -1;
+        bl->ddc = ddc;
+        bl->ops = &ddc_backlight_ops;
+        bl->max = ddc_max(bl->ddc);
+        if (bl->max <= 0) {
+            fprintf(stderr, "ERROR: Failed to open DDC/CI monitor: /dev/%s\n", device);
+            goto fail;
+        }
+    } else {
+        sprintf(buf, "%s/%s/max_brightness", ctx->backlight_raw_base_path, device);
+        int fd = open(buf, O_RDONLY);
+        if (fd > 0) {
+            bl->max = pread_double(fd);
+            close(fd);
+        }
+
+        sprintf(buf, "%s/%s/brightness", ctx->backlight_raw_base_path, device);
+        bl->raw_fd = open(buf, O_RDWR);
+        bl->ops = &sysfs_backlight_ops;
+#ifdef HAVE_LOGIND
+        if (bl->raw_fd < 1 && (bl->raw_fd = open(buf, O_RDONLY)) > 0) {
+            if (!ctx->bus && !logind_connect(ctx)) {
+                fprintf(stderr, "ERROR: Failed to connect to logind!\n");
+                goto fail;
+            }
+            bl->ops = &logind_backlight_ops;
+        }
+#endif
+        if (bl->raw_fd < 1 || bl->max <= 0) {
+            fprintf(stderr, "ERROR: Failed to open backlight device: %s\n", device);
+            goto fail;
+        }
+
+        // Some drivers change brightness without telling, reading it with every frame then still notices
+        if (strcmp(get_env("WLUMA_BACKLIGHT_POLL", "0"), "1")) {
+            sprintf(buf, "%s/%s/actual_brightness", ctx->backlight_raw_base_path, device);
+            bl->change_source.fd = open(buf, O_RDONLY | O_CLOEXEC);
+        }
+    }
+    bl->device = strdup(device);
+    bl->written = bl->ops->read(bl);
+    bl->raw = bl->written;
+
+    // Files that can't be watched, such as those of emulated devices, are read with every frame
+    if (bl->change_source.fd > 0) {
+        bl->change_source.handler = backlight_changed;
+        bl->change_source.data = bl;
+        pread_double(bl->change_source.fd);
+        if (event_add(ctx, &bl->change_source, EPOLLPRI) == -1) {
+            close(bl->change_source.fd);
+            bl->change_source.fd = -1;
+        }
     }
 
-    int rgbSum[] = { 0, 0, 0 };
-    int totalPixels = mipWidth * mipHeight;
-    for (int i = 0; i < totalPixels; i++) {
-        rgbSum[0] += rgba[4 * i + 0];
-        rgbSum[1] += rgba[4 * i + 1];
-        rgbSum[2] += rgba[4 * i + 2];
+    // Default backlight keeps the data file it always had, bus numbers of monitors change so they go by output
+    if (strcmp(device, ctx->backlight_device) == 0) {
+        sprintf(buf, "%s/data", ctx->data_dir);
+    } else if (bl->ddc && output->name) {
+        sprintf(buf, "%s/data-ddc-%s", ctx->data_dir, output->name);
+    } else {
+        sprintf(buf, "%s/data-%s", ctx->data_dir, device);
     }
-    int r = rgbSum[0] / totalPixels, g = rgbSum[1] / totalPixels, b = rgbSum[2] / totalPixels;
 
-    result = sqrt(0.241 * (double)(r * r) + 0.691 * (double)(g * g) + 0.068 * (double)(b * b)) / 255.0 * 100.0;
+    char *text_path = strdup(buf);
+    strcat(buf, ".bin");
+    bl->data_path = strdup(buf);
+
+    bl->data_fd = open(bl->data_path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (bl->data_fd == -1) {
+        fprintf(stderr, "ERROR: Failed to open data file!\n");
+        free(text_path);
+        goto fail;
+    }
 
-    vkUnmapMemory(ctx->vulkan->device, ctx->vulkan->buffer_memory);
+    struct stat st;
+    int64_t now = data_now(ctx);
+    bool migrate = false;
+    bool empty = fstat(bl->data_fd, &st) == 0 && st.st_size == 0;
+    if (empty) {
+        // First start with binary data file, points learned by older versions are imported
+        data_import(bl, text_path, now);
+    } else if (!data_load(bl, now, &migrate)) {
+        // Downgrading must not lose what a newer version learned
+        struct DataFileHeader header;
+        if (pread(bl->data_fd, &header, sizeof(header), 0) == sizeof(header)
+                && !memcmp(header.magic, DATA_FILE_MAGIC, sizeof(header.magic)) && header.version > DATA_FILE_VERSION) {
+            fprintf(stderr, "ERROR: Data file %s was written by a newer version of wluma!\n", bl->data_path);
+            free(text_path);
+            goto fail;
+        }
 
-    if (vkResetFences(ctx->vulkan->device, 1, &ctx->vulkan->fence) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to reset Vulkan fence!\n");
-        goto exit;
+        // Unreadable file is kept aside, learning starts over in a fresh one
+        sprintf(buf, "%s.bad", bl->data_path);
+        fprintf(stderr, "WARN: Failed to read data file, moving it to %s and starting from scratch!\n", buf);
+        data_free(&bl->data);
+        close(bl->data_fd);
+        bl->data_fd = -1;
+        if (rename(bl->data_path, buf) == 0) {
+            bl->data_fd = open(bl->data_path, O_RDWR | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+            data_sync_dir(bl->data_path);
+        }
+        if (bl->data_fd == -1) {
+            fprintf(stderr, "ERROR: Failed to replace data file!\n");
+            free(text_path);
+            goto fail;
+        }
+        empty = true;
     }
+    free(text_path);
 
-exit:
-    if (frameImage)       vkDestroyImage(ctx->vulkan->device, frameImage, NULL);
-    if (frameImageMemory) vkFreeMemory(ctx->vulkan->device, frameImageMemory, NULL);
+    // Limits apply to everything learned so far, later learning events only check a few points each
+    data_age(bl, &ctx->data_settings, now, bl->data.count);
+    if (ctx->data_settings.max_points > 0) {
+        data_trim(bl, ctx->data_settings.max_points, now);
+    }
+    data_index(&bl->data);
 
-    return result;
+    if (migrate && !data_rewrite(bl)) {
+        fprintf(stderr, "WARN: Failed to migrate data file!\n");
+        ftruncate(bl->data_fd, 0);
+        empty = true;
+    }
+
+    // Evicted points are missing from a freshly written file already
+    if (empty || migrate) {
+        bl->journal.count = 0;
+    }
+
+    if (empty) {
+        struct DataJournal snapshot = { 0 };
+        data_snapshot(&bl->data, &snapshot);
+        if (!data_write_file(bl->data_fd, &snapshot)) {
+            fprintf(stderr, "WARN: Failed to write data file!\n");
+        }
+        bl->data_records = snapshot.count;
+        journal_free(&snapshot);
+    }
+
+    bl->compaction.fd = -1;
+    bl->compaction.done.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    bl->compaction.done.handler = data_compacted;
+    bl->compaction.done.data = bl;
+    if (bl->compaction.done.fd == -1 || event_add(ctx, &bl->compaction.done, EPOLLIN) == -1) {
+        fprintf(stderr, "ERROR: Failed to watch data file compaction!\n");
+        goto fail;
+    }
+    data_save(bl);
+
+    bl->transition_timer.data = bl;
+    if (timer_add(ctx, &bl->transition_timer, transition_step) == -1) {
+        fprintf(stderr, "ERROR: Failed to create timers!\n");
+        goto fail;
+    }
+
+    return bl;
+
+fail:
+    backlight_close(ctx, bl);
+    return NULL;
 }
 
+static bool output_is_internal(struct WaylandOutput *output) {
+    // Compositors before wl_output v4 don't tell names, assume a single panel
+    if (output->name == NULL) {
+        return true;
+    }
 
-/******************************************************************************
- * Backlight control
- */
+    return !strncmp(output->name, "eDP", 3) || !strncmp(output->name, "LVDS", 4) || !strncmp(output->name, "DSI", 3);
+}
 
-static void update_backlight(struct Context *ctx, long lux, int luma, int backlight) {
-    if ((ctx->backlight_last != backlight) || (ctx->data == NULL && ctx->pendingCountdown == 0)) {
-        if (ctx->pendingCountdown == 0) {
-            ctx->pendingDataPoint.lux = lux;
-            ctx->pendingDataPoint.luma = luma;
-        }
-        ctx->pendingDataPoint.backlight = backlight;
-        ctx->pendingCountdown = PENDING_COUNTDOWN_RESET;
-    } else if (ctx->pendingCountdown > 1) {
-        ctx->pendingCountdown--;
-    } else if (ctx->pendingCountdown == 1) {
-        ctx->pendingCountdown = 0;
-
-        struct DataPoint *new_point = data_add(ctx, ctx->pendingDataPoint.lux, ctx->pendingDataPoint.luma, ctx->pendingDataPoint.backlight);
-        struct DataPoint *elem = ctx->data;
-        while (elem) {
-            if (
-                (elem->lux == ctx->pendingDataPoint.lux && elem->luma == ctx->pendingDataPoint.luma && elem != new_point) ||
-                (elem->lux >  ctx->pendingDataPoint.lux && elem->luma == ctx->pendingDataPoint.luma) ||
-                (elem->lux <  ctx->pendingDataPoint.lux && elem->luma >= ctx->pendingDataPoint.luma && elem->backlight > ctx->pendingDataPoint.backlight) ||
-                (elem->lux == ctx->pendingDataPoint.lux && elem->luma <  ctx->pendingDataPoint.luma && elem->backlight < ctx->pendingDataPoint.backlight) ||
-                (elem->lux >  ctx->pendingDataPoint.lux && elem->luma <= ctx->pendingDataPoint.luma && elem->backlight < ctx->pendingDataPoint.backlight) ||
-                (elem->lux == ctx->pendingDataPoint.lux && elem->luma >  ctx->pendingDataPoint.luma && elem->backlight > ctx->pendingDataPoint.backlight)
-            ) {
-                elem = data_remove(ctx, elem);
-            } else {
-                elem = elem->next;
+// External monitors are controlled over DDC/CI on the i2c bus of their DRM connector, e.g. card0-DP-1/ddc
+static char* output_ddc_device(struct WaylandOutput *output) {
+    if (output->name == NULL || !strcmp(get_env("WLUMA_DDC", "1"), "0")) {
+        return NULL;
+    }
+
+    DIR *dir = opendir(DRM_CONNECTOR_BASE_PATH);
+    if (dir == NULL) {
+        return NULL;
+    }
+
+    char *device = NULL;
+    struct dirent *subdir;
+    while (device == NULL && (subdir = readdir(dir))) {
+        char *connector = strchr(subdir->d_name, '-');
+        if (strncmp(subdir->d_name, "card", 4) || connector == NULL || strcmp(connector + 1, output->name)) {
+            continue;
+        }
+
+        char link[BUF_SIZE];
+        sprintf(buf, "%s/%s/ddc", DRM_CONNECTOR_BASE_PATH, subdir->d_name);
+        ssize_t len = readlink(buf, link, sizeof(link) - 1);
+        if (len > 0) {
+            link[len] = 0;
+            char *bus = strrchr(link, '/');
+            snprintf(buf, BUF_SIZE, "%s", bus ? bus + 1 : link);
+            device = buf;
+        }
+    }
+    closedir(dir);
+    return device;
+}
+
+// WLUMA_BACKLIGHTS maps outputs to backlight devices, e.g. "eDP-1=intel_backlight,DP-1=ddcci5"
+static char* output_backlight_device(struct Context *ctx, struct WaylandOutput *output) {
+    char *mapping = get_env("WLUMA_BACKLIGHTS", NULL);
+    if (mapping && output->name) {
+        size_t name_len = strlen(output->name);
+        for (char *entry = mapping; *entry; entry += strcspn(entry, ","), entry += *entry == ',') {
+            size_t entry_len = strcspn(entry, ",");
+            if (entry_len > name_len && !strncmp(entry, output->name, name_len) && entry[name_len] == '=') {
+                snprintf(buf, BUF_SIZE, "%.*s", (int)(entry_len - name_len - 1), entry + name_len + 1);
+                return buf;
             }
         }
+    }
+
+    if (!output_is_internal(output)) {
+        return output_ddc_device(output);
+    }
+
+    // Only one internal output can drive the default backlight
+    struct WaylandOutput *other;
+    wl_list_for_each(other, ctx->outputs, link) {
+        if (other != output && other->backlight && output_is_internal(other)) {
+            return NULL;
+        }
+    }
 
-        data_save(ctx);
+    return ctx->backlight_device;
+}
 
-        ctx->lux_max_seen = fmax(fmax(ctx->lux_max_seen, ctx->pendingDataPoint.lux), 1);
-    } else {
-        struct DataPoint *nearest = NULL, *nearest2 = NULL, *nearest3 = NULL, *elem = ctx->data;
-        double nearest_dist = 0, nearest2_dist = 0, nearest3_dist = 0;
-        long lux_capped = fmin(lux, ctx->lux_max_seen);
-
-        while (elem) {
-            double dist = sqrt(pow((lux_capped - elem->lux) * 100 / ctx->lux_max_seen, 2) + pow(luma - elem->luma, 2));
-            if (dist < nearest_dist || nearest == NULL) {
-                nearest3_dist = nearest2_dist;
-                nearest3 = nearest2;
-
-                nearest2_dist = nearest_dist;
-                nearest2 = nearest;
-
-                nearest_dist = dist;
-                nearest = elem;
-            } else if (dist < nearest2_dist || nearest2 == NULL) {
-                nearest3_dist = nearest2_dist;
-                nearest3 = nearest2;
-
-                nearest2_dist = dist;
-                nearest2 = elem;
-            } else if (dist < nearest3_dist || nearest3 == NULL) {
-                nearest3_dist = dist;
-                nearest3 = elem;
+static void output_ddc_stop(struct Context *ctx, struct WaylandOutput *output) {
+    if (output->ddc_probe) ddc_close(output->ddc_probe);
+    if (output->ddc_probed.fd > 0) {
+        event_remove(ctx, &output->ddc_probed);
+        close(output->ddc_probed.fd);
+    }
+    free(output->ddc_device);
+    output->ddc_probe = NULL;
+    output->ddc_probed.fd = -1;
+    output->ddc_device = NULL;
+}
+
+static void output_ddc_probed(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    struct WaylandOutput *output = source->data;
+
+    uint64_t done;
+    if (read(source->fd, &done, sizeof(done)) != sizeof(done)) {
+        return;
+    }
+
+    struct DdcMonitor *ddc = output->ddc_probe;
+    char *device = output->ddc_device;
+    output->ddc_probe = NULL;
+    output->ddc_device = NULL;
+    output_ddc_stop(ctx, output);
+
+    output->backlight = backlight_open(ctx, output, device, ddc);
+    free(device);
+    if (output->backlight) {
+        register_frame_listener(output);
+    }
+}
+
+// Monitors take a while to answer, the output goes without a backlight until the worker has probed it
+static void output_ddc_start(struct Context *ctx, struct WaylandOutput *output, const char *device) {
+    output->ddc_device = strdup(device);
+    output->ddc_probed.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    output->ddc_probed.handler = output_ddc_probed;
+    output->ddc_probed.data = output;
+    if (output->ddc_probed.fd == -1 || event_add(ctx, &output->ddc_probed, EPOLLIN) == -1) {
+        fprintf(stderr, "ERROR: Failed to create eventfd!\n");
+        if (output->ddc_probed.fd > 0) close(output->ddc_probed.fd);
+        output->ddc_probed.fd = -1;
+        output_ddc_stop(ctx, output);
+        return;
+    }
+
+    sprintf(buf, "/dev/%s", output->ddc_device);
+    output->ddc_probe = ddc_open(buf, output->ddc_probed.fd);
+    if (output->ddc_probe == NULL) {
+        fprintf(stderr, "ERROR: Failed to open DDC/CI monitor: %s\n", buf);
+        output_ddc_stop(ctx, output);
+    }
+}
+
+static void output_attach(struct Context *ctx, struct WaylandOutput *output) {
+    if (output->active || !output->configured || !ctx->running) {
+        return;
+    }
+
+    if (ctx->vulkan && !init_output_vulkan(ctx->vulkan, &output->vulkan)) {
+        fprintf(stderr, "WARN: Failed to prepare Vulkan objects for output %s!\n", output->name ? output->name : "");
+        return;
+    }
+
+    output->luma_cpu.valid = false;
+    output->luma_valid = false;
+    output->capture_delay = ctx->frame_min_delay;
+    output->capture_timer.data = output;
+    if (timer_add(ctx, &output->capture_timer, capture_next_frame) == -1) {
+        fprintf(stderr, "ERROR: Failed to create timers!\n");
+        ctx->err = 1;
+        return;
+    }
+
+    output->active = true;
+    output_power_watch(ctx, output);
+
+    // i2c buses are external monitors
+    char *device = output_backlight_device(ctx, output);
+    if (device && !strncmp(device, "i2c-", 4)) {
+        output_ddc_start(ctx, output, device);
+    } else if (device) {
+        char *device_name = strdup(device);
+        output->backlight = backlight_open(ctx, output, device_name, NULL);
+        free(device_name);
+    }
+
+    // Frames are only worth capturing when there is a backlight to control
+    if (output->backlight) {
+        register_frame_listener(output);
+    }
+}
+
+static void output_detach(struct Context *ctx, struct WaylandOutput *output) {
+    if (output->active && ctx->vulkan) {
+        // Only work using resources of this output is waited for, frames of other outputs in it are processed as usual
+        bool idle = true;
+        for (int i = 0; i < VULKAN_SUBMITS; i++) {
+            struct VulkanSubmit *submit = &ctx->vulkan->submits[i];
+            if (!submit->busy || !submit_has_output_vulkan(submit, &output->vulkan)) {
+                continue;
             }
-            elem = elem->next;
-        }
-
-        int target_backlight = nearest->backlight;
-        if (nearest2 != NULL && nearest3 != NULL) {
-            struct Vector plane_vec1 = vector_create(nearest, nearest2);
-            struct Vector plane_vec2 = vector_create(nearest, nearest3);
-            struct Vector plane_normal = vector_cross_product(&plane_vec1, &plane_vec2);
-            vector_normalize(&plane_normal);
-
-            struct DataPoint line_point1 = { .lux = lux, .luma = luma, .backlight = 0 };
-            struct DataPoint line_point2 = { .lux = lux, .luma = luma, .backlight = 100 };
-            struct Vector line_direction = vector_create(&line_point1, &line_point2);
-            vector_normalize(&line_direction);
-
-            double plane_line_dot = vector_dot_product(&plane_normal, &line_direction);
-            if (fabs(plane_line_dot) > DBL_EPSILON) {
-                struct Vector plane_point = point_create(nearest);
-                struct Vector line_point = point_create(&line_point1);
-
-                struct Vector line_plane_diff = vector_subtract(&line_point, &plane_point);
-                double scale = vector_dot_product(&plane_normal, &line_plane_diff) / plane_line_dot;
-                struct Vector line_direction_scaled = vector_scale(&line_direction, scale);
-                struct Vector intersection = vector_subtract(&line_point, &line_direction_scaled);
-                target_backlight = fmax(1, fmin(100, round(intersection.z)));
+            if (wait_submit_vulkan(ctx->vulkan, submit, VULKAN_FENCE_MAX_WAIT_NS)) {
+                submit_processed(ctx, submit);
+            } else {
+                idle = false;
             }
         }
 
-        if (backlight != target_backlight) {
-            struct timespec sleep = { 0 };
-            int steps = abs(backlight - target_backlight);
-            for (
-                int step = backlight < target_backlight ? 1 : -1;
-                (step > 0 && backlight <= target_backlight) || (step < 0 && backlight >= target_backlight);
-                backlight += step
-            ) {
-                pwrite_long(ctx->backlight_raw_fd, backlight * ctx->backlight_max / 100);
+        // GPU is stuck, nothing can be freed before all of it is done
+        if (!idle) {
+            vkDeviceWaitIdle(ctx->vulkan->device);
+        }
 
-                sleep.tv_nsec = BACKLIGHT_TRANSITION_DELAY_NS / steps;
-                while (nanosleep(&sleep, &sleep) == -1) {
-                    continue;
-                }
+        for (int i = 0; i < VULKAN_SLOTS; i++) {
+            if (output->vulkan.slots[i].busy) {
+                frame_free(release_slot_vulkan(ctx->vulkan, &output->vulkan.slots[i]));
+            }
+        }
+
+        deinit_output_vulkan(ctx->vulkan, &output->vulkan);
+    }
+
+    if (output->active) {
+        event_remove(ctx, &output->capture_timer);
+        close(output->capture_timer.fd);
+        output->active = false;
+    }
+    output_power_unwatch(output);
+
+    if (output->frame) {
+        frame_free(output->frame);
+    } else if (output->frame_callback) {
+        zwlr_export_dmabuf_frame_v1_destroy(output->frame_callback);
+    }
+    output->frame = NULL;
+    output->frame_callback = NULL;
+
+    if (output->copy_frame) {
+        zwlr_screencopy_frame_v1_destroy(output->copy_frame);
+        output->copy_frame = NULL;
+    }
+    shm_buffer_free(&output->shm);
+#ifdef HAVE_IMAGE_COPY
+    image_copy_stop(output);
+#endif
+
+    output_ddc_stop(ctx, output);
+    if (output->backlight) {
+        backlight_close(ctx, output->backlight);
+        output->backlight = NULL;
+    }
+}
+
+static void output_free(struct WaylandOutput *output) {
+    if (output->version >= WL_OUTPUT_RELEASE_SINCE_VERSION) {
+        wl_output_release(output->output);
+    } else {
+        wl_output_destroy(output->output);
+    }
+
+    free(output->name);
+    free(output);
+}
+
+static void remove_output(struct Context *ctx, struct WaylandOutput *out) {
+    wl_list_remove(&out->link);
+    output_detach(ctx, out);
+
+    // Events of this output might still be pending in the current loop iteration
+    out->removed = true;
+    wl_list_insert(&ctx->removed_outputs, &out->link);
+}
+
+static struct WaylandOutput* find_output(struct Context *ctx, struct wl_output *out, uint32_t id) {
+    struct WaylandOutput *output, *tmp;
+    wl_list_for_each_safe(output, tmp, ctx->outputs, link) {
+        if ((output->output == out) || (output->id == id)) {
+            return output;
+        }
+    }
+    return NULL;
+}
+
+static void output_handle_geometry(void *data, struct wl_output *wl_output,
+        int32_t x, int32_t y, int32_t physical_width, int32_t physical_height,
+        int32_t subpixel, const char *make, const char *model, int32_t transform) {
+}
+
+static void output_handle_mode(void *data, struct wl_output *wl_output,
+        uint32_t flags, int32_t width, int32_t height, int32_t refresh) {
+}
+
+static void output_handle_done(void *data, struct wl_output *wl_output) {
+    struct WaylandOutput *output = data;
+
+    output->configured = true;
+    output_attach(output->ctx, output);
+}
+
+static void output_handle_scale(void *data, struct wl_output *wl_output, int32_t factor) {
+}
+
+static void output_handle_name(void *data, struct wl_output *wl_output, const char *name) {
+    struct WaylandOutput *output = data;
+
+    free(output->name);
+    output->name = strdup(name);
+    output->vulkan.name = output->name;
+}
+
+static void output_handle_description(void *data, struct wl_output *wl_output, const char *description) {
+}
+
+static const struct wl_output_listener output_listener = {
+    .geometry    = output_handle_geometry,
+    .mode        = output_handle_mode,
+    .done        = output_handle_done,
+    .scale       = output_handle_scale,
+    .name        = output_handle_name,
+    .description = output_handle_description,
+};
+
+static void registry_handle_remove(void *data, struct wl_registry *reg, uint32_t id) {
+    struct Context *ctx = data;
+
+    struct WaylandOutput *output = find_output(ctx, NULL, id);
+    if (output) {
+        remove_output(ctx, output);
+    }
+}
+
+static void registry_handle_add(void *data, struct wl_registry *reg, uint32_t id, const char *interface, uint32_t ver) {
+    struct Context *ctx = data;
+
+    if (strcmp(interface, wl_output_interface.name) == 0) {
+        struct WaylandOutput *output = calloc(1, sizeof(struct WaylandOutput));
+
+        output->id = id;
+        output->ctx = ctx;
+        output->version = ver < 4 ? ver : 4;
+        output->output = wl_registry_bind(reg, id, &wl_output_interface, output->version);
+        wl_output_add_listener(output->output, &output_listener, output);
+
+        // Before v2 there is no done event to wait for
+        output->configured = output->version < WL_OUTPUT_DONE_SINCE_VERSION;
+
+        wl_list_insert(ctx->outputs, &output->link);
+        output_attach(ctx, output);
+    }
+
+    if (strcmp(interface, zwlr_export_dmabuf_manager_v1_interface.name) == 0) {
+        ctx->dmabuf_manager = wl_registry_bind(reg, id, &zwlr_export_dmabuf_manager_v1_interface, ver);
+    }
+
+#ifdef HAVE_IMAGE_COPY
+    if (strcmp(interface, ext_output_image_capture_source_manager_v1_interface.name) == 0) {
+        ctx->image_source_manager = wl_registry_bind(reg, id, &ext_output_image_capture_source_manager_v1_interface, 1);
+    }
+
+    if (strcmp(interface, ext_image_copy_capture_manager_v1_interface.name) == 0) {
+        ctx->image_copy_manager = wl_registry_bind(reg, id, &ext_image_copy_capture_manager_v1_interface, 1);
+    }
+#endif
+
+    if (strcmp(interface, zwlr_screencopy_manager_v1_interface.name) == 0) {
+        ctx->screencopy_manager = wl_registry_bind(reg, id, &zwlr_screencopy_manager_v1_interface, ver < 3 ? ver : 3);
+    }
+
+    if (strcmp(interface, wl_shm_interface.name) == 0) {
+        ctx->shm = wl_registry_bind(reg, id, &wl_shm_interface, 1);
+    }
+
+    // Idle notifications are about the first seat, that is the one people sit at
+    if (strcmp(interface, wl_seat_interface.name) == 0 && ctx->seat == NULL) {
+        ctx->seat = wl_registry_bind(reg, id, &wl_seat_interface, 1);
+    }
+
+    if (strcmp(interface, ext_idle_notifier_v1_interface.name) == 0) {
+        ctx->idle_notifier = wl_registry_bind(reg, id, &ext_idle_notifier_v1_interface, 1);
+    }
+
+    // Power control of an output is exclusive to one client, so watching its mode is opt-in
+    if (strcmp(interface, zwlr_output_power_manager_v1_interface.name) == 0 && !strcmp(get_env("WLUMA_OUTPUT_POWER", "0"), "1")) {
+        ctx->output_power_manager = wl_registry_bind(reg, id, &zwlr_output_power_manager_v1_interface, 1);
+    }
+
+    // Only feedback of v4 tells the main device
+    if (strcmp(interface, zwp_linux_dmabuf_v1_interface.name) == 0 && ver >= 4) {
+        ctx->linux_dmabuf = wl_registry_bind(reg, id, &zwp_linux_dmabuf_v1_interface, 4);
+    }
+}
+
+static const struct wl_registry_listener registry_listener = {
+    .global        = registry_handle_add,
+    .global_remove = registry_handle_remove,
+};
+
+static void dmabuf_feedback_main_device(void *data, struct zwp_linux_dmabuf_feedback_v1 *feedback, struct wl_array *device) {
+    struct Context *ctx = data;
+    if (device->size == sizeof(dev_t) && !ctx->drm_device_known) {
+        memcpy(&ctx->drm_device, device->data, sizeof(dev_t));
+        ctx->drm_device_known = true;
+    }
+}
+
+static void dmabuf_feedback_format_table(void *data, struct zwp_linux_dmabuf_feedback_v1 *feedback, int32_t fd, uint32_t size) {
+    close(fd);
+}
+
+static void dmabuf_feedback_done(void *data, struct zwp_linux_dmabuf_feedback_v1 *feedback) {}
+static void dmabuf_feedback_tranche_done(void *data, struct zwp_linux_dmabuf_feedback_v1 *feedback) {}
+static void dmabuf_feedback_tranche_target_device(void *data, struct zwp_linux_dmabuf_feedback_v1 *feedback, struct wl_array *device) {}
+static void dmabuf_feedback_tranche_formats(void *data, struct zwp_linux_dmabuf_feedback_v1 *feedback, struct wl_array *indices) {}
+static void dmabuf_feedback_tranche_flags(void *data, struct zwp_linux_dmabuf_feedback_v1 *feedback, uint32_t flags) {}
+
+static const struct zwp_linux_dmabuf_feedback_v1_listener dmabuf_feedback_listener = {
+    .done                  = dmabuf_feedback_done,
+    .format_table          = dmabuf_feedback_format_table,
+    .main_device           = dmabuf_feedback_main_device,
+    .tranche_done          = dmabuf_feedback_tranche_done,
+    .tranche_target_device = dmabuf_feedback_tranche_target_device,
+    .tranche_formats       = dmabuf_feedback_tranche_formats,
+    .tranche_flags         = dmabuf_feedback_tranche_flags,
+};
+
+
+/******************************************************************************
+ * Record and replay
+ */
+
+static bool trace_open(struct Context *ctx, const char *path) {
+    struct DataFileHeader header = {
+        .magic       = TRACE_FILE_MAGIC,
+        .version     = TRACE_FILE_VERSION,
+        .record_size = sizeof(struct TraceRecord),
+    };
+
+    ctx->trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0600);
+    if (ctx->trace_fd == -1 || !write_all(ctx->trace_fd, &header, sizeof(header))) {
+        fprintf(stderr, "ERROR: Failed to create trace file: %s!\n", path);
+        return false;
+    }
+
+    ctx->trace_started = stats_now();
+    return true;
+}
+
+// Backlight that differs from what wluma set last is a user change, replay needs to tell them apart
+static void trace_write(struct Context *ctx, struct WaylandOutput *output, int luma, double difference, long lux, int backlight) {
+    struct Backlight *bl = output->backlight;
+    bool user = backlight != bl->last && !(bl->transition_active && transition_owns(bl, backlight));
+
+    struct TraceRecord record = {
+        .time_ns    = stats_now() - ctx->trace_started,
+        .lux        = lux,
+        .difference = difference,
+        .luma       = luma,
+        .backlight  = backlight,
+        .output     = output->id,
+        .flags      = user ? TRACE_USER_ADJUSTED : 0,
+    };
+
+    if (!write_all(ctx->trace_fd, &record, sizeof(record))) {
+        fprintf(stderr, "WARN: Failed to write trace file, recording stopped!\n");
+        close(ctx->trace_fd);
+        ctx->trace_fd = -1;
+    }
+}
+
+static long replay_backlight_read(struct Backlight *bl) {
+    return bl->replay_raw;
+}
+
+static bool replay_backlight_write(struct Backlight *bl, long raw) {
+    bl->replay_raw = raw;
+    return true;
+}
+
+static const struct BacklightOps replay_backlight_ops = {
+    .read  = replay_backlight_read,
+    .write = replay_backlight_write,
+};
+
+// Outputs of the trace learn from scratch, raw backlight values are in percent
+static struct WaylandOutput* replay_output(struct Context *ctx, struct wl_list *outputs, uint32_t id, int backlight) {
+    struct WaylandOutput *output;
+    wl_list_for_each(output, outputs, link) {
+        if (output->id == id) {
+            return output;
+        }
+    }
+
+    output = calloc(1, sizeof(struct WaylandOutput));
+    output->ctx = ctx;
+    output->id = id;
+    output->capture_delay = ctx->frame_min_delay;
+
+    struct Backlight *bl = calloc(1, sizeof(struct Backlight));
+    bl->output = output;
+    bl->ops = &replay_backlight_ops;
+    bl->max = 100;
+    bl->raw_fd = -1;
+    bl->data_fd = -1;
+    bl->compaction.fd = -1;
+    bl->compaction.done.fd = -1;
+    bl->transition_timer.fd = -1;
+    bl->replay_raw = backlight;
+    bl->written = backlight;
+
+    output->backlight = bl;
+    wl_list_insert(outputs->prev, &output->link);
+    return output;
+}
+
+// Steps the transition timer would have fired before the next sample
+static void replay_transitions(struct Context *ctx, struct Backlight *bl, uint64_t until_ns) {
+    while (bl->transition_active) {
+        uint64_t started = timespec_ns(&bl->transition_started);
+        uint64_t elapsed = timespec_ns(&ctx->virtual_now) - started;
+        uint64_t next = started + (elapsed / bl->transition_interval + 1) * bl->transition_interval;
+        if (next > until_ns) {
+            return;
+        }
+
+        ctx->virtual_now.tv_sec = next / 1000000000ULL;
+        ctx->virtual_now.tv_nsec = next % 1000000000ULL;
+        transition_advance(ctx, bl);
+    }
+}
+
+// Feeds a trace through learning and prediction, no compositor, GPU or devices involved
+static int replay(struct Context *ctx, const char *path) {
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct DataFileHeader)) {
+        fprintf(stderr, "ERROR: Failed to read trace file: %s!\n", path);
+        if (fd != -1) close(fd);
+        return EXIT_FAILURE;
+    }
+
+    struct DataFileHeader *header = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Failed to read trace file: %s!\n", path);
+        return EXIT_FAILURE;
+    }
+
+    if (memcmp(header->magic, TRACE_FILE_MAGIC, sizeof(header->magic))
+            || header->version != TRACE_FILE_VERSION
+            || header->record_size != sizeof(struct TraceRecord)) {
+        fprintf(stderr, "ERROR: Not a trace file: %s!\n", path);
+        munmap(header, st.st_size);
+        return EXIT_FAILURE;
+    }
+
+    size_t count = (st.st_size - sizeof(struct DataFileHeader)) / sizeof(struct TraceRecord);
+    struct TraceRecord *records = (struct TraceRecord *)(header + 1);
+
+    ctx->transition_easing = read_easing();
+    ctx->lux_filter = read_lux_filter();
+    ctx->data_settings = read_data_settings();
+    ctx->virtual_clock = true;
+    ctx->frame_min_delay = FRAME_REQUEST_DELAY_NS;
+
+    struct wl_list outputs;
+    wl_list_init(&outputs);
+    size_t adjustments = 0;
+    double error = 0;
+
+    uint64_t start = stats_now();
+    for (size_t i = 0; i < count; i++) {
+        struct TraceRecord *record = &records[i];
+        struct WaylandOutput *output = replay_output(ctx, &outputs, record->output, record->backlight);
+        struct Backlight *bl = output->backlight;
+
+        replay_transitions(ctx, bl, record->time_ns);
+        ctx->virtual_now.tv_sec = record->time_ns / 1000000000ULL;
+        ctx->virtual_now.tv_nsec = record->time_ns % 1000000000ULL;
+
+        // User picked this brightness, compare with what wluma would have picked, not counted as a prediction
+        if (record->flags & TRACE_USER_ADJUSTED) {
+            if (bl->data.count > 0 && output->lux_filter.initialized) {
+                error += abs(data_lookup(&bl->data, output->lux_filter.value, record->luma) - record->backlight);
+                adjustments++;
             }
-            backlight = target_backlight;
+            bl->replay_raw = record->backlight;
         }
+
+        luma_processed(ctx, output, record->luma, record->difference, record->lux, read_backlight_pct(bl));
+    }
+    double elapsed = (stats_now() - start) / 1e9;
+
+    struct StatTimer *predict = &ctx->stats.timers[STAT_PREDICT];
+    printf("Replayed %zu samples in %.3fs, %.0f samples/s\n", count, elapsed, elapsed > 0 ? count / elapsed : 0);
+    printf("Predictions: %llu, %.0f/s\n", (unsigned long long)predict->count,
+        predict->total_ns > 0 ? predict->count * 1e9 / predict->total_ns : 0);
+    printf("Backlight writes: %llu\n", (unsigned long long)ctx->stats.timers[STAT_BACKLIGHT_WRITE].count);
+    if (adjustments > 0) {
+        printf("User adjustments: %zu, mean prediction error %.1f%%\n", adjustments, error / adjustments);
+    }
+
+    struct WaylandOutput *output, *tmp;
+    wl_list_for_each_safe(output, tmp, &outputs, link) {
+        printf("Output %u: %zu data points\n", output->id, output->backlight->data.count);
+        backlight_close(ctx, output->backlight);
+        free(output);
     }
 
-    ctx->backlight_last = backlight;
+    munmap(header, st.st_size);
+    return EXIT_SUCCESS;
 }
 
 
 /******************************************************************************
- * Frame management
+ * Control socket
  */
-static void register_frame_listener(struct Context *ctx);
 
-static void frame_free(struct Context *ctx) {
-    if (ctx->frame == NULL) {
+static const char* output_label(struct WaylandOutput *output) {
+    return output->name ? output->name : "unknown";
+}
+
+static void ipc_close(struct Context *ctx, struct IpcClient *client) {
+    if (client->closed) {
         return;
     }
 
-    zwlr_export_dmabuf_frame_v1_destroy(ctx->frame->frame);
+    // Source may still be in the current batch of events, the client is freed once it is dispatched
+    event_remove(ctx, &client->source);
+    close(client->source.fd);
+    client->source.handler = NULL;
+    client->closed = true;
+    ctx->ipc_subscribers -= client->subscribed;
+    ctx->ipc_client_count--;
+}
 
-    for (uint32_t i = 0; i < ctx->frame->num_objects; i++) {
-        close(ctx->frame->fds[i]);
+static void ipc_free_closed(struct Context *ctx) {
+    struct IpcClient *client, *tmp;
+    wl_list_for_each_safe(client, tmp, &ctx->ipc_clients, link) {
+        if (client->closed) {
+            wl_list_remove(&client->link);
+            free(client->out);
+            free(client);
+        }
     }
-
-    free(ctx->frame);
-    ctx->frame = NULL;
 }
 
-static void frame_ready(void *data, struct zwlr_export_dmabuf_frame_v1 *frame,
-                        uint32_t tv_sec_hi, uint32_t tv_sec_lo, uint32_t tv_nsec) {
-    struct Context *ctx = data;
+static void ipc_flush(struct Context *ctx, struct IpcClient *client) {
+    size_t sent = 0;
+    while (sent < client->out_len) {
+        ssize_t count = write(client->source.fd, client->out + sent, client->out_len - sent);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (count == -1) {
+            ipc_close(ctx, client);
+            return;
+        }
+        sent += count;
+    }
 
-    // Compute all necessary values
-    int luma = compute_frame_luma_pct(ctx);
-    frame_free(ctx);
+    memmove(client->out, client->out + sent, client->out_len - sent);
+    client->out_len -= sent;
 
-    long lux = read_lux(ctx);
-    int backlight = read_backlight_pct(ctx);
+    // Rest goes out once the client reads, frames never wait for it
+    event_modify(ctx, &client->source, client->out_len > 0 ? EPOLLIN | EPOLLOUT : EPOLLIN);
+}
 
-    // Don't update backlight if there was an error or exit signal
-    if (ctx->quit || ctx->err) {
+static void ipc_send(struct Context *ctx, struct IpcClient *client, const char *line, size_t len) {
+    if (client->closed) {
         return;
     }
 
-    // Track backlight values until lux initialization is complete
-    if (!ctx->lux_avg_initialized) {
-        ctx->backlight_last = backlight;
+    if (client->out_len + len > IPC_BACKLOG_MAX) {
+        ipc_close(ctx, client);
+        return;
+    }
+
+    if (client->out_len + len > client->out_capacity) {
+        client->out_capacity = fmax(client->out_len + len, client->out_capacity * 2);
+        client->out = realloc(client->out, client->out_capacity);
     }
+    memcpy(client->out + client->out_len, line, len);
+    client->out_len += len;
+
+    ipc_flush(ctx, client);
+}
+
+static void ipc_sendf(struct Context *ctx, struct IpcClient *client, const char *format, ...) {
+    char line[IPC_LINE_MAX];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    ipc_send(ctx, client, line, fmin(len, sizeof(line) - 1));
+}
 
-    ctx->lux_window[ctx->lux_window_next_idx] = lux;
-    ctx->lux_window_next_idx = (ctx->lux_window_next_idx + 1) % AVG_LUX_WINDOW_SIZE;
-    ctx->lux_avg_initialized = ctx->lux_avg_initialized || ctx->lux_window_next_idx == 0;
+static int ipc_format_state(struct WaylandOutput *output, char *line, size_t size) {
+    struct IpcState *state = &output->ipc_state;
+    int len = snprintf(line, size, "state %s luma=%d lux=%ld backlight=%d pinned=%d\n",
+        output_label(output), state->luma, state->lux, state->backlight, state->pinned);
+    return fmin(len, size - 1);
+}
+
+// Sends the state of an output to subscribers when it differs from what they saw last
+static void ipc_publish(struct Context *ctx, struct WaylandOutput *output, int luma, long lux) {
+    struct Backlight *bl = output->backlight;
+    struct IpcState state = {
+        .valid     = true,
+        .luma      = luma,
+        .lux       = lux,
+        .backlight = bl->transition_active ? backlight_pct(bl, bl->transition_target) : bl->last,
+        .pinned    = bl->pinned,
+    };
 
-    // Set the most appropriate backlight value
-    if (ctx->lux_avg_initialized) {
-        update_backlight(ctx, calc_avg_lux(ctx), luma, backlight);
+    struct IpcState *last = &output->ipc_state;
+    if (last->valid && last->luma == state.luma && last->lux == state.lux
+            && last->backlight == state.backlight && last->pinned == state.pinned) {
+        return;
     }
+    *last = state;
 
-    // Sleep a bit before asking for the next frame
-    struct timespec sleep = { .tv_nsec = FRAME_REQUEST_DELAY_NS };
-    while (nanosleep(&sleep, &sleep) == -1) {
-        continue;
+    if (ctx->ipc_subscribers == 0) {
+        return;
     }
 
-    // Ask for the next frame
-    register_frame_listener(ctx);
+    char line[IPC_LINE_MAX];
+    int len = ipc_format_state(output, line, sizeof(line));
+    struct IpcClient *client;
+    wl_list_for_each(client, &ctx->ipc_clients, link) {
+        if (client->subscribed) {
+            ipc_send(ctx, client, line, len);
+        }
+    }
 }
 
-static void frame_start(void *data, struct zwlr_export_dmabuf_frame_v1 *frame,
-        uint32_t width, uint32_t height, uint32_t offset_x, uint32_t offset_y,
-        uint32_t buffer_flags, uint32_t flags, uint32_t format,
-        uint32_t mod_high, uint32_t mod_low, uint32_t num_objects) {
-    struct Context *ctx = data;
+static void ipc_send_states(struct Context *ctx, struct IpcClient *client) {
+    char line[IPC_LINE_MAX];
+    struct WaylandOutput *output;
+    wl_list_for_each(output, ctx->outputs, link) {
+        if (output->backlight && output->ipc_state.valid) {
+            ipc_send(ctx, client, line, ipc_format_state(output, line, sizeof(line)));
+        }
+    }
+}
+
+static void ipc_broadcast(struct Context *ctx, const char *line) {
+    struct IpcClient *client;
+    wl_list_for_each(client, &ctx->ipc_clients, link) {
+        if (client->subscribed) {
+            ipc_send(ctx, client, line, strlen(line));
+        }
+    }
+}
 
-    ctx->frame = malloc(sizeof(struct Frame));
-    ctx->frame->frame = frame;
-    ctx->frame->width = width;
-    ctx->frame->height = height;
-    ctx->frame->num_objects = num_objects;
+static void ipc_pin(struct Backlight *bl, int backlight) {
+    bl->pinned = true;
+    bl->pendingCountdown = 0;
+    if (backlight >= 0) {
+        transition_start(bl, read_backlight_pct(bl), backlight);
+    } else if (bl->transition_active) {
+        transition_stop(bl);
+    }
+}
 
-    init_frame_vulkan(ctx);
+// Whatever the backlight is now is where wluma takes over again, it isn't learned as a preference
+static void ipc_unpin(struct Backlight *bl) {
+    bl->pinned = false;
+    bl->pendingCountdown = 0;
+    bl->last = read_backlight_pct(bl);
 }
 
-static void frame_object(void *data, struct zwlr_export_dmabuf_frame_v1 *frame,
-        uint32_t index, int32_t fd, uint32_t size, uint32_t offset,
-        uint32_t stride, uint32_t plane_index) {
-    struct Context *ctx = data;
+// Applies a command to the outputs it names, * is every output with a backlight
+static int ipc_outputs(struct Context *ctx, const char *name, int backlight, bool pin) {
+    int matched = 0;
+    struct WaylandOutput *output;
+    wl_list_for_each(output, ctx->outputs, link) {
+        if (!output->backlight || (strcmp(name, "*") && strcmp(name, output_label(output)))) {
+            continue;
+        }
+
+        if (pin) {
+            ipc_pin(output->backlight, backlight);
+        } else {
+            ipc_unpin(output->backlight);
+        }
+        matched++;
 
-    ctx->frame->fds[index] = fd;
-    ctx->frame->sizes[index] = size;
+        // Subscribers hear about it right away, even while capture is paused
+        if (output->ipc_state.valid) {
+            ipc_publish(ctx, output, output->ipc_state.luma, output->ipc_state.lux);
+        }
+    }
+    return matched;
 }
 
-static void frame_cancel(void *data, struct zwlr_export_dmabuf_frame_v1 *frame,
-        uint32_t reason) {
-    struct Context *ctx = data;
+static void ipc_command(struct Context *ctx, struct IpcClient *client, char *line) {
+    char *save = NULL;
+    char *command = strtok_r(line, " \t", &save);
+    char *arg1 = command ? strtok_r(NULL, " \t", &save) : NULL;
+    char *arg2 = arg1 ? strtok_r(NULL, " \t", &save) : NULL;
+    char *arg3 = arg2 ? strtok_r(NULL, " \t", &save) : NULL;
 
-    frame_free(ctx);
+    if (command == NULL) {
+        return;
+    }
 
-    if (reason == ZWLR_EXPORT_DMABUF_FRAME_V1_CANCEL_REASON_PERMANENT) {
-        fprintf(stderr, "ERROR: Permanent failure when capturing frame!\n");
-        ctx->err = 1;
+    if (!strcmp(command, "status")) {
+        ipc_send_states(ctx, client);
+        ipc_sendf(ctx, client, "ok %s\n", ctx->paused ? "paused" : "running");
+    } else if (!strcmp(command, "subscribe")) {
+        ipc_send_states(ctx, client);
+        ctx->ipc_subscribers += !client->subscribed;
+        client->subscribed = true;
+        ipc_sendf(ctx, client, "ok\n");
+    } else if (!strcmp(command, "predict") && arg3) {
+        struct WaylandOutput *output, *found = NULL;
+        wl_list_for_each(output, ctx->outputs, link) {
+            if (output->backlight && !strcmp(arg1, output_label(output))) {
+                found = output;
+            }
+        }
+
+        if (found == NULL) {
+            ipc_sendf(ctx, client, "error unknown output\n");
+        } else if (found->backlight->data.count == 0) {
+            ipc_sendf(ctx, client, "error nothing learned yet\n");
+        } else {
+            int luma = fmin(fmax(strtol(arg3, NULL, 10), 0), 100);
+            ipc_sendf(ctx, client, "ok %d\n", predict_backlight(found->backlight, strtol(arg2, NULL, 10), luma));
+        }
+    } else if (!strcmp(command, "pause") || !strcmp(command, "resume")) {
+        bool paused = !strcmp(command, "pause");
+        if (paused != ctx->paused) {
+            ctx->paused = paused;
+            if (!paused) {
+                capture_resume(ctx);
+            }
+            ipc_broadcast(ctx, paused ? "capture paused\n" : "capture running\n");
+        }
+        ipc_sendf(ctx, client, "ok\n");
+    } else if ((!strcmp(command, "pin") || !strcmp(command, "unpin")) && arg1) {
+        bool pin = !strcmp(command, "pin");
+        int backlight = pin && arg2 ? fmin(fmax(strtol(arg2, NULL, 10), 1), 100) : -1;
+        if (ipc_outputs(ctx, arg1, backlight, pin) > 0) {
+            ipc_sendf(ctx, client, "ok\n");
+        } else {
+            ipc_sendf(ctx, client, "error unknown output\n");
+        }
+    } else if (!strcmp(command, "rate") && arg1) {
+        // Shortest delay between frames on the current power source, slowing down while frames don't change is kept
+        struct CaptureProfile *profile = &ctx->capture_profiles[ctx->power];
+        profile->min_delay = fmax(strtol(arg1, NULL, 10), 1) * 1000000L;
+        profile->max_delay = fmax(profile->max_delay, profile->min_delay);
+        capture_profile_apply(ctx);
+        ipc_sendf(ctx, client, "ok\n");
     } else {
-        register_frame_listener(ctx);
+        ipc_sendf(ctx, client, "error unknown command\n");
     }
 }
 
-static const struct zwlr_export_dmabuf_frame_v1_listener frame_listener = {
-    .frame  = frame_start,
-    .object = frame_object,
-    .ready  = frame_ready,
-    .cancel = frame_cancel,
-};
+static void ipc_client_ready(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    struct IpcClient *client = source->data;
 
-static void register_frame_listener(struct Context *ctx) {
-    ctx->frame_callback = zwlr_export_dmabuf_manager_v1_capture_output(ctx->dmabuf_manager, false, ctx->target_output->output);
-    zwlr_export_dmabuf_frame_v1_add_listener(ctx->frame_callback, &frame_listener, ctx);
-}
+    if (events & EPOLLOUT) {
+        ipc_flush(ctx, client);
+    }
 
+    // Commands are lines, a partial one waits for the rest
+    while (!client->closed && (events & (EPOLLIN | EPOLLHUP | EPOLLERR))) {
+        ssize_t count = read(source->fd, client->in + client->in_len, sizeof(client->in) - client->in_len);
+        if (count == -1 && errno == EINTR) {
+            continue;
+        }
+        if (count == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        }
+        if (count <= 0) {
+            ipc_close(ctx, client);
+            break;
+        }
+        client->in_len += count;
 
-/******************************************************************************
- * Outputs management
- */
-static void remove_output(struct WaylandOutput *out) {
-    wl_list_remove(&out->link);
-}
+        char *start = client->in, *end;
+        while (!client->closed && (end = memchr(start, '\n', client->in + client->in_len - start))) {
+            *end = 0;
+            ipc_command(ctx, client, start);
+            start = end + 1;
+        }
 
-static struct WaylandOutput* find_output(struct Context *ctx, struct wl_output *out, uint32_t id) {
-    struct WaylandOutput *output, *tmp;
-    wl_list_for_each_safe(output, tmp, ctx->outputs, link) {
-        if ((output->output == out) || (output->id == id)) {
-            return output;
+        client->in_len -= start - client->in;
+        memmove(client->in, start, client->in_len);
+        if (client->in_len == sizeof(client->in)) {
+            ipc_close(ctx, client);
         }
     }
-    return NULL;
 }
 
-static void registry_handle_remove(void *data, struct wl_registry *reg, uint32_t id) {
-    remove_output(find_output((struct Context*)data, NULL, id));
+static void ipc_accept(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    int fd = accept(source->fd, NULL, NULL);
+    if (fd == -1) {
+        return;
+    }
+
+    if (ctx->ipc_client_count == IPC_MAX_CLIENTS
+            || fcntl(fd, F_SETFL, O_NONBLOCK) == -1 || fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+        close(fd);
+        return;
+    }
+
+    struct IpcClient *client = calloc(1, sizeof(struct IpcClient));
+    client->source.fd = fd;
+    client->source.handler = ipc_client_ready;
+    client->source.data = client;
+    if (event_add(ctx, &client->source, EPOLLIN) == -1) {
+        close(fd);
+        free(client);
+        return;
+    }
+
+    wl_list_insert(&ctx->ipc_clients, &client->link);
+    ctx->ipc_client_count++;
 }
 
-static void registry_handle_add(void *data, struct wl_registry *reg, uint32_t id, const char *interface, uint32_t ver) {
-    struct Context *ctx = data;
+// Socket of an instance that didn't exit cleanly is replaced, one that still answers is left alone
+static bool ipc_open(struct Context *ctx) {
+    wl_list_init(&ctx->ipc_clients);
 
-    if (strcmp(interface, wl_output_interface.name) == 0) {
-        struct WaylandOutput *output = malloc(sizeof(struct WaylandOutput));
+    char *path = getenv("WLUMA_SOCKET");
+    char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (path == NULL && runtime_dir == NULL) {
+        fprintf(stderr, "WARN: XDG_RUNTIME_DIR is not set, control socket is disabled!\n");
+        return false;
+    }
 
-        output->id = id;
-        output->output = wl_registry_bind(reg, id, &wl_output_interface, ver);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int len = path ? snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path)
+        : snprintf(addr.sun_path, sizeof(addr.sun_path), "%s/%s", runtime_dir, IPC_SOCKET_NAME);
+    if (len >= (int)sizeof(addr.sun_path)) {
+        fprintf(stderr, "WARN: Control socket path is too long!\n");
+        return false;
+    }
 
-        wl_list_insert(ctx->outputs, &output->link);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        fprintf(stderr, "WARN: Failed to create control socket!\n");
+        return false;
     }
 
-    if (strcmp(interface, zwlr_export_dmabuf_manager_v1_interface.name) == 0) {
-        ctx->dmabuf_manager = wl_registry_bind(reg, id, &zwlr_export_dmabuf_manager_v1_interface, ver);
+    bool bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (!bound && errno == EADDRINUSE) {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool alive = probe != -1 && connect(probe, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+        if (probe != -1) close(probe);
+
+        if (alive) {
+            fprintf(stderr, "WARN: Control socket is used by another instance: %s!\n", addr.sun_path);
+            close(fd);
+            return false;
+        }
+        unlink(addr.sun_path);
+        bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    }
+
+    ctx->ipc_source.fd = fd;
+    ctx->ipc_source.handler = ipc_accept;
+    if (!bound || listen(fd, IPC_MAX_CLIENTS) == -1 || event_add(ctx, &ctx->ipc_source, EPOLLIN) == -1) {
+        fprintf(stderr, "WARN: Failed to listen on control socket: %s!\n", addr.sun_path);
+        close(fd);
+        ctx->ipc_source.fd = 0;
+        return false;
+    }
+
+    ctx->ipc_path = strdup(addr.sun_path);
+    return true;
+}
+
+static void ipc_shutdown(struct Context *ctx) {
+    if (ctx->ipc_path == NULL) {
+        return;
     }
+
+    struct IpcClient *client;
+    wl_list_for_each(client, &ctx->ipc_clients, link) {
+        ipc_close(ctx, client);
+    }
+    ipc_free_closed(ctx);
+
+    close(ctx->ipc_source.fd);
+    unlink(ctx->ipc_path);
+    free(ctx->ipc_path);
+    ctx->ipc_path = NULL;
 }
 
 
 /******************************************************************************
  * Main loop
  */
-struct Context *quit_ctx = NULL;
+static void on_signal(struct Context *ctx, struct EventSource *source, uint32_t events) {
+    struct signalfd_siginfo info;
+    if (read(source->fd, &info, sizeof(info)) != sizeof(info)) {
+        return;
+    }
 
-static void on_quit_signal(int signal) {
-    printf("\r");
-    quit_ctx->quit = true;
+    if (info.ssi_signo == SIGUSR1) {
+        stats_dump(&ctx->stats);
+    } else {
+        printf("\r");
+        ctx->quit = true;
+    }
 }
 
 static int main_loop(struct Context *ctx) {
-    quit_ctx = ctx;
+    // Signals are delivered through the event loop
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGTERM);
+    sigaddset(&mask, SIGUSR1);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1) {
+        fprintf(stderr, "ERROR: Failed to block signals!\n");
+        return EXIT_FAILURE;
+    }
 
-    if (signal(SIGINT, on_quit_signal) == SIG_ERR) {
+    ctx->signal_source.fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    ctx->signal_source.handler = on_signal;
+    if (ctx->signal_source.fd == -1 || event_add(ctx, &ctx->signal_source, EPOLLIN) == -1) {
         fprintf(stderr, "ERROR: Failed to install signal handler!\n");
         return EXIT_FAILURE;
     }
 
-    register_frame_listener(ctx);
+    // Scripts and status bars can do without it, wluma runs either way
+    ipc_open(ctx);
+    power_open(ctx);
+
+    // Outputs added from now on are attached as soon as they are configured
+    clock_gettime(CLOCK_MONOTONIC, &ctx->stats.started);
+    ctx->running = true;
+    struct WaylandOutput *output;
+    wl_list_for_each(output, ctx->outputs, link) {
+        output_attach(ctx, output);
+    }
 
     // Run capture
-    while (wl_display_dispatch(ctx->display) != -1 && !ctx->err && !ctx->quit);
+    struct epoll_event events[MAX_EVENTS];
+    while (!ctx->err && !ctx->quit) {
+        while (wl_display_prepare_read(ctx->display) != 0) {
+            wl_display_dispatch_pending(ctx->display);
+        }
+
+        // Frames of all outputs that arrived in this tick go into one submission
+        if (ctx->vulkan && (!submit_pending_vulkan(ctx->vulkan) || vulkan_device_lost(ctx))) {
+            ctx->err = 1;
+        }
+        wl_display_flush(ctx->display);
+
+        int timeout = submits_timeout(ctx);
+        int n = epoll_wait(ctx->epoll_fd, events, MAX_EVENTS, timeout);
+        if (n == -1) {
+            wl_display_cancel_read(ctx->display);
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "ERROR: Failed to wait for events!\n");
+            return EXIT_FAILURE;
+        }
+
+        bool wayland_readable = false;
+        for (int i = 0; i < n; i++) {
+            wayland_readable = wayland_readable || events[i].data.ptr == &ctx->wayland_source;
+        }
+
+        if (wayland_readable) {
+            if (wl_display_read_events(ctx->display) == -1) {
+                fprintf(stderr, "ERROR: Lost connection to Wayland display!\n");
+                return EXIT_FAILURE;
+            }
+        } else {
+            wl_display_cancel_read(ctx->display);
+        }
+
+        // Handlers run first, Wayland events may destroy sources that are still in this batch
+        for (int i = 0; i < n && !ctx->err; i++) {
+            struct EventSource *source = events[i].data.ptr;
+            if (source->handler) {
+                source->handler(ctx, source, events[i].events);
+            }
+        }
+
+        if (wl_display_dispatch_pending(ctx->display) == -1) {
+            fprintf(stderr, "ERROR: Failed to dispatch Wayland events!\n");
+            return EXIT_FAILURE;
+        }
+
+        poll_submits(ctx);
+
+        struct WaylandOutput *tmp;
+        wl_list_for_each_safe(output, tmp, &ctx->removed_outputs, link) {
+            wl_list_remove(&output->link);
+            output_free(output);
+        }
+        ipc_free_closed(ctx);
+    }
 
     return ctx->err;
 }
@@ -919,41 +4636,69 @@ static int main_loop(struct Context *ctx) {
 /******************************************************************************
  * Initialize Wayland client and Vulkan API
  */
+static void* vulkan_instance_thread(void *arg) {
+    init_instance_vulkan(arg);
+    return NULL;
+}
+
+static void vulkan_instance_wait(struct Context *ctx) {
+    if (ctx->vulkan_thread_running) {
+        pthread_join(ctx->vulkan_thread, NULL);
+        ctx->vulkan_thread_running = false;
+    }
+}
+
 static int init(struct Context *ctx, int argc, char *argv[]) {
     int fd;
     DIR *dir;
     struct dirent *subdir;
-    char *light_sensor_raw_base_path = get_env("WLUMA_AMBIENT_LIGHT_SENSOR_BASE_PATH", "/sys/bus/iio/devices");
+    char *light_sensor_raw_base_path = get_env("WLUMA_AMBIENT_LIGHT_SENSOR_BASE_PATH", LIGHT_SENSOR_BASE_PATH);
+
+    ctx->stats.launched = stats_now();
+
+    if (argc == 3 && !strcmp(argv[1], "--record")) {
+        if (!trace_open(ctx, argv[2])) {
+            return EXIT_FAILURE;
+        }
+    } else if (argc > 1) {
+        fprintf(stderr, "ERROR: Usage: wluma [--record TRACE | --replay TRACE]!\n");
+        return EXIT_FAILURE;
+    }
 
-    char *backlight_raw_base_path = "/sys/class/backlight";
-    dir = opendir(backlight_raw_base_path);
+    // Drivers load while sysfs is scanned and the compositor answers, the device is picked once it is known
+    ctx->vulkan = calloc(1, sizeof(struct Vulkan));
+    ctx->vulkan_thread_running = pthread_create(&ctx->vulkan_thread, NULL, vulkan_instance_thread, ctx->vulkan) == 0;
+
+    ctx->backlight_raw_base_path = "/sys/class/backlight";
+    dir = opendir(ctx->backlight_raw_base_path);
     if (dir == NULL) {
-        fprintf(stderr, "ERROR: Failed to open backlight device base dir: %s\n", backlight_raw_base_path);
+        fprintf(stderr, "ERROR: Failed to open backlight device base dir: %s\n", ctx->backlight_raw_base_path);
         return EXIT_FAILURE;
     }
 
+    // Outputs open their backlight devices once attached, internal panel gets the first usable one
     while ((subdir = readdir(dir))) {
         if (subdir->d_name[0] == '.') {
             continue;
         }
 
-        sprintf(buf, "%s/%s/max_brightness", backlight_raw_base_path, subdir->d_name);
+        sprintf(buf, "%s/%s/brightness", ctx->backlight_raw_base_path, subdir->d_name);
+#ifdef HAVE_LOGIND
+        // logind changes brightness of devices that can't be written directly
         fd = open(buf, O_RDONLY);
+#else
+        fd = open(buf, O_RDWR);
+#endif
         if (fd > 0) {
-            ctx->backlight_max = pread_double(fd);
             close(fd);
-
-            sprintf(buf, "%s/%s/brightness", backlight_raw_base_path, subdir->d_name);
-            ctx->backlight_raw_fd = open(buf, O_RDWR);
-            if (ctx->backlight_raw_fd > 0) {
-                break;
-            }
+            ctx->backlight_device = strdup(subdir->d_name);
+            break;
         }
     }
     closedir(dir);
 
-    if (ctx->backlight_raw_fd < 1) {
-        fprintf(stderr, "ERROR: Failed to find backlight device file in base dir: %s\n", backlight_raw_base_path);
+    if (ctx->backlight_device == NULL) {
+        fprintf(stderr, "ERROR: Failed to find backlight device file in base dir: %s\n", ctx->backlight_raw_base_path);
         return EXIT_FAILURE;
     }
 
@@ -996,6 +4741,7 @@ static int init(struct Context *ctx, int argc, char *argv[]) {
                 sprintf(buf, "%s/%s/in_illuminance_raw", light_sensor_raw_base_path, subdir->d_name);
                 ctx->light_sensor_raw_fd = open(buf, O_RDONLY);
                 if (ctx->light_sensor_raw_fd > 0) {
+                    ctx->light_sensor_device = strdup(subdir->d_name);
                     break;
                 }
             }
@@ -1008,6 +4754,54 @@ static int init(struct Context *ctx, int argc, char *argv[]) {
         return EXIT_FAILURE;
     }
 
+    ctx->transition_easing = read_easing();
+    ctx->lux_filter = read_lux_filter();
+    ctx->data_settings = read_data_settings();
+
+    // Applied to Vulkan once it is created
+    struct LumaSettings settings = { .region_mode = REGION_FULL, .statistic = LUMA_MEAN };
+
+    char *region = get_env("WLUMA_REGION", "full");
+    if (!strcmp(region, "center")) {
+        settings.region_mode = REGION_CENTER_WEIGHTED;
+    } else if (sscanf(region, "%lf,%lf,%lf,%lf", &settings.region[0], &settings.region[1], &settings.region[2], &settings.region[3]) == 4) {
+        if (settings.region[0] < 0 || settings.region[1] < 0 || settings.region[2] <= 0 || settings.region[3] <= 0
+                || settings.region[0] + settings.region[2] > 1 || settings.region[1] + settings.region[3] > 1) {
+            fprintf(stderr, "WARN: Region must be within the frame: %s, using full frame!\n", region);
+        } else {
+            settings.region_mode = REGION_RECT;
+        }
+    } else if (strcmp(region, "full")) {
+        fprintf(stderr, "WARN: Unknown region: %s, using full frame!\n", region);
+    }
+
+    char *statistic = get_env("WLUMA_LUMA", "mean");
+    char percentileSuffix;
+    if (!strcmp(statistic, "median")) {
+        settings.statistic = LUMA_PERCENTILE;
+        settings.percentile = 0.5;
+    } else if (!strcmp(statistic, "mode")) {
+        settings.statistic = LUMA_MODE;
+    } else if (sscanf(statistic, "p%lf%c", &settings.percentile, &percentileSuffix) == 1 && settings.percentile >= 0 && settings.percentile <= 100) {
+        settings.statistic = LUMA_PERCENTILE;
+        settings.percentile /= 100.0;
+    } else if (strcmp(statistic, "mean")) {
+        fprintf(stderr, "WARN: Unknown luma statistic: %s, using mean!\n", statistic);
+    }
+
+    long battery_delay = fmax(strtol(get_env("WLUMA_BATTERY_FRAME_DELAY_MS", BATTERY_FRAME_DELAY_MS), NULL, 10), 1) * 1000000L;
+    ctx->capture_profiles[POWER_AC] = (struct CaptureProfile) {
+        .min_delay = FRAME_REQUEST_DELAY_NS,
+        .max_delay = fmax(strtol(get_env("WLUMA_MAX_FRAME_DELAY_MS", FRAME_MAX_DELAY_MS), NULL, 10) * 1000000L, FRAME_REQUEST_DELAY_NS),
+    };
+    ctx->capture_profiles[POWER_BATTERY] = (struct CaptureProfile) {
+        .min_delay = battery_delay,
+        .max_delay = fmax(strtol(get_env("WLUMA_BATTERY_MAX_FRAME_DELAY_MS", BATTERY_MAX_FRAME_DELAY_MS), NULL, 10) * 1000000L, battery_delay),
+    };
+    ctx->frame_min_delay = ctx->capture_profiles[POWER_AC].min_delay;
+    ctx->frame_max_delay = ctx->capture_profiles[POWER_AC].max_delay;
+    ctx->idle_timeout = fmax(strtol(get_env("WLUMA_IDLE_TIMEOUT_MS", IDLE_TIMEOUT_MS), NULL, 10), 0);
+
     char *data_dir = get_env("XDG_DATA_HOME", NULL);
     if (data_dir == NULL) {
         data_dir = get_env("HOME", NULL);
@@ -1021,16 +4815,22 @@ static int init(struct Context *ctx, int argc, char *argv[]) {
         sprintf(buf, "%s/wluma", data_dir);
     }
     mkdir(buf, 0700);
-
-    strcat(buf, "/data");
-    ctx->data_fd = open(buf, O_RDWR | O_CREAT | O_DSYNC, 0600);
-    if (ctx->data_fd == -1) {
-        fprintf(stderr, "ERROR: Failed to open data file!\n");
-        return EXIT_FAILURE;
-    }
-
-    if (!data_load(ctx)) {
-        fprintf(stderr, "WARN: Failed to read data file, starting from scratch!\n");
+    ctx->data_dir = strdup(buf);
+
+    // Compiled pipelines are only a cache, run without one when there is no place for it
+    char *cache_dir = get_env("XDG_CACHE_HOME", NULL);
+    char *home_dir = get_env("HOME", NULL);
+    if (cache_dir || home_dir) {
+        if (cache_dir) {
+            sprintf(buf, "%s/wluma", cache_dir);
+        } else {
+            sprintf(buf, "%s/.cache", home_dir);
+            mkdir(buf, 0700);
+            sprintf(buf, "%s/.cache/wluma", home_dir);
+        }
+        mkdir(buf, 0700);
+        strcat(buf, "/pipeline-cache");
+        ctx->pipeline_cache_path = strdup(buf);
     }
 
     ctx->display = wl_display_connect(NULL);
@@ -1041,196 +4841,154 @@ static int init(struct Context *ctx, int argc, char *argv[]) {
 
     ctx->outputs = malloc(sizeof(struct wl_list));
     wl_list_init(ctx->outputs);
+    wl_list_init(&ctx->removed_outputs);
 
+    // Listener stays registered to track outputs that come and go
     struct wl_registry *registry = wl_display_get_registry(ctx->display);
+    wl_registry_add_listener(registry, &registry_listener, ctx);
 
-    struct wl_registry_listener listener = {
-        .global = registry_handle_add,
-        .global_remove = registry_handle_remove,
-    };
-    wl_registry_add_listener(registry, &listener, ctx);
-
+    // Second roundtrip receives properties of the bound outputs
+    wl_display_roundtrip(ctx->display);
     wl_display_roundtrip(ctx->display);
-    wl_display_dispatch(ctx->display);
 
     if (wl_list_empty(ctx->outputs)) {
         fprintf(stderr, "ERROR: Failed to retrieve any output!\n");
         return EXIT_FAILURE;
     }
 
-    if (!ctx->dmabuf_manager) {
-        fprintf(stderr, "ERROR: Failed to initialize DMA-BUF manager!\n");
-        return EXIT_FAILURE;
-    }
-
-    ctx->vulkan = malloc(sizeof(struct Vulkan));
-
-    VkApplicationInfo appInfo = {
-        .sType              = VK_STRUCTURE_TYPE_APPLICATION_INFO,
-        .pApplicationName   = "wluma",
-        .applicationVersion = VK_MAKE_VERSION(1, 2, 2),
-        .pEngineName        = "No Engine",
-        .engineVersion      = VK_MAKE_VERSION(1, 0, 0),
-        .apiVersion         = VK_API_VERSION_1_0,
-    };
-
-    VkInstanceCreateInfo instanceCreateInfo = {
-        .sType             = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
-        .pApplicationInfo  = &appInfo,
-    };
-
-    if (vkCreateInstance(&instanceCreateInfo, NULL, &ctx->vulkan->instance) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to initialize Vulkan instance!\n");
-        return EXIT_FAILURE;
-    }
-
-    VkPhysicalDevice physicalDevice;
-    uint32_t deviceCount;
-    if (vkEnumeratePhysicalDevices(ctx->vulkan->instance, &deviceCount, NULL) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to retrieve Vulkan physical device!\n");
-        return EXIT_FAILURE;
-    }
-
-    if (deviceCount == 0) {
-        fprintf(stderr, "ERROR: No physical device that supports Vulkan!\n");
-        return EXIT_FAILURE;
-    }
-
-    VkPhysicalDevice *physicalDevices = calloc(deviceCount, sizeof(VkPhysicalDevice));
-    if (vkEnumeratePhysicalDevices(ctx->vulkan->instance, &deviceCount, physicalDevices) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to retrieve Vulkan physical device!\n");
-        return EXIT_FAILURE;
+    // Explicitly configured DRM node wins over the one of the compositor
+    char *drm_device = get_env("WLUMA_DRM_DEVICE", NULL);
+    struct stat drm_device_stat;
+    if (drm_device) {
+        if (stat(drm_device, &drm_device_stat) == 0 && S_ISCHR(drm_device_stat.st_mode)) {
+            ctx->drm_device = drm_device_stat.st_rdev;
+            ctx->drm_device_known = true;
+        } else {
+            fprintf(stderr, "WARN: Failed to find DRM device: %s!\n", drm_device);
+        }
     }
-    // TODO handle multiple physical devices
-    physicalDevice = physicalDevices[0];
-    free(physicalDevices);
-
-    float queuePriority = 1.0f;
-    VkDeviceQueueCreateInfo queueCreateInfo = {
-        .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-        .queueFamilyIndex = 0,
-        .queueCount       = 1,
-        .pQueuePriorities = &queuePriority,
-    };
-
-    VkDeviceCreateInfo deviceCreateInfo = {
-        .sType                = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-        .pQueueCreateInfos    = &queueCreateInfo,
-        .queueCreateInfoCount = 1,
-    };
 
-    if (vkCreateDevice(physicalDevice, &deviceCreateInfo, NULL, &ctx->vulkan->device) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to initialize Vulkan logical device!\n");
-        return EXIT_FAILURE;
+    if (ctx->linux_dmabuf && (ctx->dmabuf_manager || ctx->image_copy_manager)) {
+        struct zwp_linux_dmabuf_feedback_v1 *feedback = zwp_linux_dmabuf_v1_get_default_feedback(ctx->linux_dmabuf);
+        zwp_linux_dmabuf_feedback_v1_add_listener(feedback, &dmabuf_feedback_listener, ctx);
+        wl_display_roundtrip(ctx->display);
+        zwp_linux_dmabuf_feedback_v1_destroy(feedback);
     }
 
-    vkGetDeviceQueue(ctx->vulkan->device, 0, 0, &ctx->vulkan->queue);
-
-    VkCommandPoolCreateInfo poolInfo = {
-        .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-        .queueFamilyIndex = 0,
-        .flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
-    };
+#ifdef HAVE_IMAGE_COPY
+    image_copy_open(ctx);
+#endif
 
-    if (vkCreateCommandPool(ctx->vulkan->device, &poolInfo, NULL, &ctx->vulkan->command_pool) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to create Vulkan command pool!\n");
-        return EXIT_FAILURE;
+    // Buffers of image copy capture are created through it
+    if (ctx->linux_dmabuf && !ctx->gbm) {
+        zwp_linux_dmabuf_v1_destroy(ctx->linux_dmabuf);
+        ctx->linux_dmabuf = NULL;
     }
 
-    VkCommandBufferAllocateInfo cmdBufferAllocInfo = {
-        .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-        .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-        .commandPool        = ctx->vulkan->command_pool,
-        .commandBufferCount = 1,
-    };
-
-    if (vkAllocateCommandBuffers(ctx->vulkan->device, &cmdBufferAllocInfo, &ctx->vulkan->command_buffer) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to allocate Vulkan command buffer!\n");
-        return EXIT_FAILURE;
+    // Frames are analyzed on the GPU when possible, otherwise copied into shared memory for the CPU
+    vulkan_instance_wait(ctx);
+    ctx->settings = settings;
+    ctx->vulkan->settings = settings;
+    ctx->vulkan->listener = &vulkan_listener;
+    ctx->vulkan->listener_data = ctx;
+    ctx->vulkan->pipeline_cache_path = ctx->pipeline_cache_path;
+    if ((!ctx->dmabuf_manager && !ctx->gbm) || !init_vulkan(ctx->vulkan, ctx->drm_device_known, ctx->drm_device)) {
+        deinit_vulkan(ctx->vulkan);
+        free(ctx->vulkan);
+        ctx->vulkan = NULL;
     }
 
-    VkBufferCreateInfo bufferInfo = {
-        .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-        .size        = 4 * 500, // 1 byte per RGBA * 500 pixels (should be more than enough)
-        .usage       = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
-        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
-    };
-
-    if (vkCreateBuffer(ctx->vulkan->device, &bufferInfo, NULL, &ctx->vulkan->buffer) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to create Vulkan buffer!\n");
-        return EXIT_FAILURE;
+    if (!ctx->vulkan) {
+        if (!ctx->screencopy_manager || !ctx->shm) {
+            fprintf(stderr, "ERROR: Failed to initialize DMA-BUF manager or Vulkan, and screencopy is not available either!\n");
+            return EXIT_FAILURE;
+        }
+        fprintf(stderr, "WARN: Failed to initialize DMA-BUF manager or Vulkan, analyzing frames on the CPU!\n");
     }
 
-    VkMemoryRequirements bufferMemoryRequirements;
-    vkGetBufferMemoryRequirements(ctx->vulkan->device, ctx->vulkan->buffer, &bufferMemoryRequirements);
-
-    VkMemoryAllocateInfo bufferMemoryAllocateInfo = {
-        .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-        .allocationSize  = bufferMemoryRequirements.size,
-        .memoryTypeIndex = 0,
-    };
-
-    if (vkAllocateMemory(ctx->vulkan->device, &bufferMemoryAllocateInfo, NULL, &ctx->vulkan->buffer_memory) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to allocate memory for Vulkan buffer!\n");
+    ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ctx->epoll_fd == -1) {
+        fprintf(stderr, "ERROR: Failed to create epoll instance!\n");
         return EXIT_FAILURE;
     }
 
-    if (vkBindBufferMemory(ctx->vulkan->device, ctx->vulkan->buffer, ctx->vulkan->buffer_memory, 0) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to bind allocated memory for Vulkan buffer!\n");
+    ctx->wayland_source.fd = wl_display_get_fd(ctx->display);
+    if (event_add(ctx, &ctx->wayland_source, EPOLLIN) == -1) {
+        fprintf(stderr, "ERROR: Failed to watch Wayland display!\n");
         return EXIT_FAILURE;
     }
 
-    VkFenceCreateInfo fenceInfo = {
-        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
-    };
-
-    if (vkCreateFence(ctx->vulkan->device, &fenceInfo, NULL, &ctx->vulkan->fence) != VK_SUCCESS) {
-        fprintf(stderr, "ERROR: Failed to create Vulkan fence!\n");
-        return EXIT_FAILURE;
+    // Real sensors push new samples on their own, raw value can't be read anymore once the buffer is enabled
+    ctx->light_sensor_raw = pread_double(ctx->light_sensor_raw_fd);
+    if (!strcmp(light_sensor_raw_base_path, LIGHT_SENSOR_BASE_PATH)) {
+        light_sensor_buffer_open(ctx, light_sensor_raw_base_path, ctx->light_sensor_device);
     }
 
     return EXIT_SUCCESS;
 }
 
 static void deinit(struct Context *ctx) {
-    struct DataPoint *elem = ctx->data;
-    while (elem) {
-        elem = data_remove(ctx, elem);
+    vulkan_instance_wait(ctx);
+    if (ctx->vulkan) {
+        finish_vulkan(ctx->vulkan);
     }
 
     if (ctx->outputs) {
         struct WaylandOutput *output, *tmp_o;
         wl_list_for_each_safe(output, tmp_o, ctx->outputs, link) {
-            remove_output(output);
+            wl_list_remove(&output->link);
+            output_detach(ctx, output);
+            output_free(output);
+        }
+
+        wl_list_for_each_safe(output, tmp_o, &ctx->removed_outputs, link) {
+            wl_list_remove(&output->link);
+            output_free(output);
         }
 
         free(ctx->outputs);
     }
 
-    if (ctx->dmabuf_manager) zwlr_export_dmabuf_manager_v1_destroy(ctx->dmabuf_manager);
-
-    if (ctx->vulkan_frame) {
-        if (ctx->vulkan_frame->image)        vkDestroyImage(ctx->vulkan->device, ctx->vulkan_frame->image, NULL);
-        if (ctx->vulkan_frame->image_memory) vkFreeMemory(ctx->vulkan->device, ctx->vulkan_frame->image_memory, NULL);
-
-        free(ctx->vulkan_frame);
+    if (ctx->dmabuf_manager)     zwlr_export_dmabuf_manager_v1_destroy(ctx->dmabuf_manager);
+    if (ctx->screencopy_manager) zwlr_screencopy_manager_v1_destroy(ctx->screencopy_manager);
+    if (ctx->shm)                wl_shm_destroy(ctx->shm);
+
+#ifdef HAVE_IMAGE_COPY
+    if (ctx->image_copy_manager)   ext_image_copy_capture_manager_v1_destroy(ctx->image_copy_manager);
+    if (ctx->image_source_manager) ext_output_image_capture_source_manager_v1_destroy(ctx->image_source_manager);
+    if (ctx->gbm)                  gbm_device_destroy(ctx->gbm);
+#endif
+    if (ctx->linux_dmabuf)         zwp_linux_dmabuf_v1_destroy(ctx->linux_dmabuf);
+    if (ctx->gbm_fd > 0)           close(ctx->gbm_fd);
+
+    if (ctx->idle_notification)    ext_idle_notification_v1_destroy(ctx->idle_notification);
+    if (ctx->idle_notifier)        ext_idle_notifier_v1_destroy(ctx->idle_notifier);
+    if (ctx->seat)                 wl_seat_destroy(ctx->seat);
+    if (ctx->output_power_manager) zwlr_output_power_manager_v1_destroy(ctx->output_power_manager);
+
+    if (ctx->vulkan) {
+        deinit_vulkan(ctx->vulkan);
+        free(ctx->vulkan);
     }
 
-    if (ctx->vulkan_frame) {
-        if (ctx->vulkan->fence)          vkDestroyFence(ctx->vulkan->device, ctx->vulkan->fence, NULL);
-        if (ctx->vulkan->buffer)         vkDestroyBuffer(ctx->vulkan->device, ctx->vulkan->buffer, NULL);
-        if (ctx->vulkan->buffer_memory)  vkFreeMemory(ctx->vulkan->device, ctx->vulkan->buffer_memory, NULL);
-        if (ctx->vulkan->command_buffer) vkFreeCommandBuffers(ctx->vulkan->device, ctx->vulkan->command_pool, 1, &ctx->vulkan->command_buffer);
-        if (ctx->vulkan->command_pool)   vkDestroyCommandPool(ctx->vulkan->device, ctx->vulkan->command_pool, NULL);
-        if (ctx->vulkan->device)         vkDestroyDevice(ctx->vulkan->device, NULL);
-        if (ctx->vulkan->instance)       vkDestroyInstance(ctx->vulkan->instance, NULL);
+    if (ctx->light_sensor_buffer) light_sensor_buffer_close(ctx, ctx->light_sensor_buffer);
 
-        free(ctx->vulkan);
-    }
+#ifdef HAVE_LOGIND
+    if (ctx->bus) sd_bus_flush_close_unref(ctx->bus);
+#endif
 
-    close(ctx->data_fd);
-    close(ctx->backlight_raw_fd);
+    ipc_shutdown(ctx);
+
+    if (ctx->trace_fd > 0)         close(ctx->trace_fd);
+    if (ctx->signal_source.fd > 0) close(ctx->signal_source.fd);
+    if (ctx->uevent_source.fd > 0) close(ctx->uevent_source.fd);
+    if (ctx->epoll_fd > 0)         close(ctx->epoll_fd);
     close(ctx->light_sensor_raw_fd);
+
+    free(ctx->backlight_device);
+    free(ctx->light_sensor_device);
+    free(ctx->data_dir);
+    free(ctx->pipeline_cache_path);
 }
 
 
@@ -1240,19 +4998,18 @@ static void deinit(struct Context *ctx) {
 
 int main(int argc, char *argv[]) {
     int err = EXIT_SUCCESS;
-    struct Context ctx = { 0 };
+    struct Context ctx = { .trace_fd = -1 };
+
+    // Replay needs none of what init sets up
+    if (argc == 3 && !strcmp(argv[1], "--replay")) {
+        return replay(&ctx, argv[2]);
+    }
 
     err = init(&ctx, argc, argv);
     if (err) {
         goto exit;
     }
 
-    // TODO handle multiple outputs
-    struct WaylandOutput *o, *tmp_o;
-    wl_list_for_each_safe(o, tmp_o, ctx.outputs, link) {
-        ctx.target_output = o;
-    }
-
     err = main_loop(&ctx);
     if (err) {
         goto exit;
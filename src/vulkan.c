@@ -0,0 +1,1960 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <drm_fourcc.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "vulkan.h"
+
+static const uint32_t luma_comp_spv[] =
+#include "luma.comp.spv.h"
+;
+
+// Vulkan format reading the channels of a DRM fourcc in the right order
+struct FrameFormat {
+    uint32_t fourcc;
+    VkFormat format;
+    enum FrameTransfer transfer;
+};
+
+static const struct FrameFormat frame_formats[] = {
+    { DRM_FORMAT_XRGB8888,      VK_FORMAT_B8G8R8A8_UNORM,           TRANSFER_SRGB   },
+    { DRM_FORMAT_ARGB8888,      VK_FORMAT_B8G8R8A8_UNORM,           TRANSFER_SRGB   },
+    { DRM_FORMAT_XBGR8888,      VK_FORMAT_R8G8B8A8_UNORM,           TRANSFER_SRGB   },
+    { DRM_FORMAT_ABGR8888,      VK_FORMAT_R8G8B8A8_UNORM,           TRANSFER_SRGB   },
+    { DRM_FORMAT_XRGB2101010,   VK_FORMAT_A2R10G10B10_UNORM_PACK32, TRANSFER_SRGB   },
+    { DRM_FORMAT_ARGB2101010,   VK_FORMAT_A2R10G10B10_UNORM_PACK32, TRANSFER_SRGB   },
+    { DRM_FORMAT_XBGR2101010,   VK_FORMAT_A2B10G10R10_UNORM_PACK32, TRANSFER_SRGB   },
+    { DRM_FORMAT_ABGR2101010,   VK_FORMAT_A2B10G10R10_UNORM_PACK32, TRANSFER_SRGB   },
+    { DRM_FORMAT_XBGR16161616F, VK_FORMAT_R16G16B16A16_SFLOAT,      TRANSFER_LINEAR },
+    { DRM_FORMAT_ABGR16161616F, VK_FORMAT_R16G16B16A16_SFLOAT,      TRANSFER_LINEAR },
+};
+
+// Matches the Result buffer in shader/luma.comp
+struct LumaResult {
+    uint32_t sum_r;
+    uint32_t sum_g;
+    uint32_t sum_b;
+    uint32_t weight;
+    uint32_t done;
+
+    float mean_r;
+    float mean_g;
+    float mean_b;
+    float luma;
+
+    float difference;
+
+    uint32_t histogram_sum[LUMA_HISTOGRAM_BINS];
+    uint32_t histogram[LUMA_HISTOGRAM_BINS];
+};
+
+// Matches the Thumbnail buffer in shader/luma.comp
+struct LumaThumbnail {
+    uint32_t sum[THUMBNAIL_SIZE * THUMBNAIL_SIZE];
+    uint32_t weight[THUMBNAIL_SIZE * THUMBNAIL_SIZE];
+
+    float previous[THUMBNAIL_SIZE * THUMBNAIL_SIZE];
+    uint32_t valid;
+};
+
+// Matches the Region push constants in shader/luma.comp
+struct RegionPush {
+    int32_t offset[2];
+    int32_t extent[2];
+};
+
+// Mip chain of the blit path, sized after the frames of its output
+struct VulkanFrame {
+    uint32_t width;
+    uint32_t height;
+    uint32_t mip_levels;
+    VkImage image;
+    VkDeviceMemory image_memory;
+
+    // Slots still using it, freed once the last one is done after frames got resized
+    int in_flight;
+    bool stale;
+
+    uint32_t readback_width;
+    uint32_t readback_height;
+
+    // Readback of the previous frame, NULL until there is one
+    unsigned char *readback_previous;
+};
+
+
+/******************************************************************************
+ * Memory
+ */
+
+// Preferred properties are given up when no memory type has them, required ones never are
+static bool find_memory_type_vulkan(struct Vulkan *vk, uint32_t typeBits,
+        VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred, uint32_t *index) {
+    VkMemoryPropertyFlags wanted[] = { required | preferred, required };
+    for (int w = 0; w < 2; w++) {
+        for (uint32_t i = 0; i < vk->memory_properties.memoryTypeCount; i++) {
+            VkMemoryPropertyFlags flags = vk->memory_properties.memoryTypes[i].propertyFlags;
+            if ((typeBits & (1u << i)) && (flags & wanted[w]) == wanted[w]) {
+                *index = i;
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static bool allocate_memory_vulkan(struct Vulkan *vk, const VkMemoryRequirements *requirements,
+        VkMemoryPropertyFlags required, VkMemoryPropertyFlags preferred, VkDeviceMemory *memory, VkMemoryPropertyFlags *flags) {
+    uint32_t index;
+    if (!find_memory_type_vulkan(vk, requirements->memoryTypeBits, required, preferred, &index)) {
+        return false;
+    }
+
+    VkMemoryAllocateInfo memoryAllocateInfo = {
+        .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+        .allocationSize  = requirements->size,
+        .memoryTypeIndex = index,
+    };
+
+    if (vkAllocateMemory(vk->device, &memoryAllocateInfo, NULL, memory) != VK_SUCCESS) {
+        return false;
+    }
+
+    if (flags) {
+        *flags = vk->memory_properties.memoryTypes[index].propertyFlags;
+    }
+    return true;
+}
+
+// Host only sees what the GPU wrote into memory that isn't coherent once it's invalidated
+static bool invalidate_memory_vulkan(struct Vulkan *vk, VkDeviceMemory memory, bool coherent) {
+    VkMappedMemoryRange range = {
+        .sType  = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+        .memory = memory,
+        .offset = 0,
+        .size   = VK_WHOLE_SIZE,
+    };
+    return coherent || vkInvalidateMappedMemoryRanges(vk->device, 1, &range) == VK_SUCCESS;
+}
+
+static bool flush_memory_vulkan(struct Vulkan *vk, VkDeviceMemory memory, bool coherent) {
+    VkMappedMemoryRange range = {
+        .sType  = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
+        .memory = memory,
+        .offset = 0,
+        .size   = VK_WHOLE_SIZE,
+    };
+    return coherent || vkFlushMappedMemoryRanges(vk->device, 1, &range) == VK_SUCCESS;
+}
+
+
+/******************************************************************************
+ * Frame import
+ */
+static void import_cache_clear(struct Vulkan *vk, struct VulkanOutput *output);
+
+static void destroy_frame_vulkan(struct Vulkan *vk, struct VulkanFrame *vulkan_frame) {
+    if (vulkan_frame->image)        vkDestroyImage(vk->device, vulkan_frame->image, NULL);
+    if (vulkan_frame->image_memory) vkFreeMemory(vk->device, vulkan_frame->image_memory, NULL);
+
+    free(vulkan_frame->readback_previous);
+    free(vulkan_frame);
+}
+
+static void release_frame_vulkan(struct Vulkan *vk, struct VulkanFrame *vulkan_frame) {
+    vulkan_frame->in_flight--;
+    if (vulkan_frame->stale && vulkan_frame->in_flight == 0) {
+        destroy_frame_vulkan(vk, vulkan_frame);
+    }
+}
+
+void prepare_frame_vulkan(struct Vulkan *vk, struct VulkanOutput *output, uint32_t width, uint32_t height) {
+    // Output mode has changed, none of the imported buffers will come back
+    if (output->import_cache_width && (output->import_cache_width != width || output->import_cache_height != height)) {
+        import_cache_clear(vk, output);
+    }
+    output->import_cache_width = width;
+    output->import_cache_height = height;
+
+    // Compute path reads the frame directly, no need for the intermediate mip chain
+    if (vk->compute) {
+        return;
+    }
+
+    if (output->vulkan_frame) {
+        if (output->vulkan_frame->width == width && output->vulkan_frame->height == height) {
+            return;
+        }
+
+        // Mode change or rotation, slots still using the old mip chain let go of it once they're done
+        if (output->vulkan_frame->in_flight > 0) {
+            output->vulkan_frame->stale = true;
+        } else {
+            destroy_frame_vulkan(vk, output->vulkan_frame);
+        }
+        output->vulkan_frame = NULL;
+    }
+
+    struct VulkanFrame *vulkan_frame = calloc(1, sizeof(struct VulkanFrame));
+    vulkan_frame->width = width;
+    vulkan_frame->height = height;
+    vulkan_frame->mip_levels = floor(log2(fmax(width, height)));
+
+    VkImageCreateInfo imageInfo = {
+        .sType         = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .imageType     = VK_IMAGE_TYPE_2D,
+        .format        = VK_FORMAT_R8G8B8A8_UNORM, // blit converts frames of any format, readback is always RGBA
+        .extent.width  = width / 2,
+        .extent.height = height / 2,
+        .extent.depth  = 1,
+        .mipLevels     = vulkan_frame->mip_levels,
+        .arrayLayers   = 1,
+        .tiling        = VK_IMAGE_TILING_OPTIMAL,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED,
+        .usage         = VK_IMAGE_USAGE_TRANSFER_DST_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+        .sharingMode   = VK_SHARING_MODE_EXCLUSIVE,
+        .samples       = VK_SAMPLE_COUNT_1_BIT,
+    };
+
+    if (vkCreateImage(vk->device, &imageInfo, NULL, &vulkan_frame->image) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create Vulkan image!\n");
+        goto fail;
+    }
+
+    VkMemoryRequirements imageMemoryRequirements;
+    vkGetImageMemoryRequirements(vk->device, vulkan_frame->image, &imageMemoryRequirements);
+
+    // Only the GPU touches the mip chain
+    if (!allocate_memory_vulkan(vk, &imageMemoryRequirements, 0, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &vulkan_frame->image_memory, NULL)) {
+        fprintf(stderr, "ERROR: Failed to allocate memory for Vulkan image!\n");
+        goto fail;
+    }
+
+    if (vkBindImageMemory(vk->device, vulkan_frame->image, vulkan_frame->image_memory, 0) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to bind allocated memory for Vulkan image!\n");
+        goto fail;
+    }
+
+    output->vulkan_frame = vulkan_frame;
+    return;
+
+fail:
+    destroy_frame_vulkan(vk, vulkan_frame);
+}
+
+static void import_cache_evict(struct Vulkan *vk, struct VulkanOutput *output, struct ImportedImage *entry) {
+    if (entry->descriptor_set) vkFreeDescriptorSets(vk->device, output->descriptor_pool, 1, &entry->descriptor_set);
+    if (entry->view)           vkDestroyImageView(vk->device, entry->view, NULL);
+    if (entry->image)          vkDestroyImage(vk->device, entry->image, NULL);
+    for (uint32_t i = 0; i < entry->memory_count; i++) {
+        vkFreeMemory(vk->device, entry->memory[i], NULL);
+    }
+
+    memset(entry, 0, sizeof(struct ImportedImage));
+}
+
+static void import_cache_clear(struct Vulkan *vk, struct VulkanOutput *output) {
+    for (int i = 0; i < IMPORT_CACHE_SIZE; i++) {
+        if (output->import_cache[i].in_flight) {
+            // Still used by GPU, evicted once released
+            output->import_cache[i].stale = true;
+        } else {
+            import_cache_evict(vk, output, &output->import_cache[i]);
+        }
+    }
+}
+
+static void import_release(struct Vulkan *vk, struct VulkanOutput *output, struct ImportedImage *entry) {
+    entry->in_flight--;
+    if (entry->stale && entry->in_flight == 0) {
+        import_cache_evict(vk, output, entry);
+    }
+}
+
+static bool import_key_equal(struct ImportKey *a, struct ImportKey *b) {
+    return a->dev == b->dev && a->ino == b->ino
+        && a->width == b->width && a->height == b->height
+        && a->format == b->format && a->modifier == b->modifier;
+}
+
+static const struct FrameFormat* find_frame_format(uint32_t fourcc) {
+    for (size_t i = 0; i < sizeof(frame_formats) / sizeof(frame_formats[0]); i++) {
+        if (frame_formats[i].fourcc == fourcc) {
+            return &frame_formats[i];
+        }
+    }
+    return NULL;
+}
+
+static bool modifier_supported_vulkan(struct Vulkan *vk, struct Frame *frame, VkFormat format) {
+    VkFormatFeatureFlags requiredFeatures = vk->compute
+        ? VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT
+        : VK_FORMAT_FEATURE_BLIT_SRC_BIT;
+
+    // Implicit modifier is as good as it always was
+    if (frame->modifier == DRM_FORMAT_MOD_INVALID) {
+        VkFormatProperties formatProperties;
+        vkGetPhysicalDeviceFormatProperties(vk->physical_device, format, &formatProperties);
+        return frame->num_objects == 1 && (formatProperties.optimalTilingFeatures & requiredFeatures) == requiredFeatures;
+    }
+
+    if (!vk->modifiers) {
+        return false;
+    }
+
+    VkDrmFormatModifierPropertiesListEXT modifierList = {
+        .sType = VK_STRUCTURE_TYPE_DRM_FORMAT_MODIFIER_PROPERTIES_LIST_EXT,
+    };
+    VkFormatProperties2 formatProperties = {
+        .sType = VK_STRUCTURE_TYPE_FORMAT_PROPERTIES_2,
+        .pNext = &modifierList,
+    };
+    vkGetPhysicalDeviceFormatProperties2(vk->physical_device, format, &formatProperties);
+
+    modifierList.pDrmFormatModifierProperties = calloc(modifierList.drmFormatModifierCount, sizeof(VkDrmFormatModifierPropertiesEXT));
+    vkGetPhysicalDeviceFormatProperties2(vk->physical_device, format, &formatProperties);
+
+    if (frame->disjoint) {
+        requiredFeatures |= VK_FORMAT_FEATURE_DISJOINT_BIT;
+    }
+
+    bool found = false;
+    for (uint32_t i = 0; i < modifierList.drmFormatModifierCount && !found; i++) {
+        VkDrmFormatModifierPropertiesEXT *properties = &modifierList.pDrmFormatModifierProperties[i];
+        found = properties->drmFormatModifier == frame->modifier
+            && properties->drmFormatModifierPlaneCount == frame->num_objects
+            && (properties->drmFormatModifierTilingFeatures & requiredFeatures) == requiredFeatures;
+    }
+    free(modifierList.pDrmFormatModifierProperties);
+
+    if (!found) {
+        return false;
+    }
+
+    // Listed modifier might still not be importable from a DMA-BUF
+    VkPhysicalDeviceImageDrmFormatModifierInfoEXT modifierInfo = {
+        .sType             = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_DRM_FORMAT_MODIFIER_INFO_EXT,
+        .drmFormatModifier = frame->modifier,
+        .sharingMode       = VK_SHARING_MODE_EXCLUSIVE,
+    };
+    VkPhysicalDeviceExternalImageFormatInfo externalInfo = {
+        .sType      = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_IMAGE_FORMAT_INFO,
+        .pNext      = &modifierInfo,
+        .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+    };
+    VkPhysicalDeviceImageFormatInfo2 imageFormatInfo = {
+        .sType  = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_IMAGE_FORMAT_INFO_2,
+        .pNext  = &externalInfo,
+        .format = format,
+        .type   = VK_IMAGE_TYPE_2D,
+        .tiling = VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT,
+        .usage  = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+        .flags  = VK_IMAGE_CREATE_ALIAS_BIT | (frame->disjoint ? VK_IMAGE_CREATE_DISJOINT_BIT : 0),
+    };
+
+    VkExternalImageFormatProperties externalProperties = {
+        .sType = VK_STRUCTURE_TYPE_EXTERNAL_IMAGE_FORMAT_PROPERTIES,
+    };
+    VkImageFormatProperties2 imageFormatProperties = {
+        .sType = VK_STRUCTURE_TYPE_IMAGE_FORMAT_PROPERTIES_2,
+        .pNext = &externalProperties,
+    };
+
+    if (vkGetPhysicalDeviceImageFormatProperties2(vk->physical_device, &imageFormatInfo, &imageFormatProperties) != VK_SUCCESS) {
+        return false;
+    }
+
+    return externalProperties.externalMemoryProperties.externalMemoryFeatures & VK_EXTERNAL_MEMORY_FEATURE_IMPORTABLE_BIT;
+}
+
+// Blit path reduces frames as they are, linear ones would come out darker than on the compute path which encodes them
+static bool transfer_supported(struct Vulkan *vk, const struct FrameFormat *frame_format) {
+    return vk->compute || frame_format->transfer == TRANSFER_SRGB;
+}
+
+bool frame_format_supported_vulkan(struct Vulkan *vk, uint32_t fourcc, uint64_t modifier) {
+    const struct FrameFormat *frame_format = find_frame_format(fourcc);
+    struct Frame frame = {
+        .format      = fourcc,
+        .modifier    = modifier,
+        .num_objects = 1,
+    };
+    return frame_format && transfer_supported(vk, frame_format) && modifier_supported_vulkan(vk, &frame, frame_format->format);
+}
+
+static bool import_supported(struct Vulkan *vk, struct VulkanOutput *output, struct Frame *frame) {
+    if (output->import_checked && output->import_format == frame->format && output->import_modifier == frame->modifier) {
+        return output->import_supported;
+    }
+
+    output->import_checked = true;
+    output->import_format = frame->format;
+    output->import_modifier = frame->modifier;
+    output->frame_format = find_frame_format(frame->format);
+    if (output->frame_format == NULL) {
+        fprintf(stderr, "WARN: Frames of output %s have unsupported format 0x%08x, skipping them!\n",
+            output->name ? output->name : "", frame->format);
+        output->import_supported = false;
+        return false;
+    }
+
+    if (!transfer_supported(vk, output->frame_format)) {
+        fprintf(stderr, "WARN: Frames of output %s have linear format 0x%08x that only the compute path can analyze, skipping them!\n",
+            output->name ? output->name : "", frame->format);
+        output->import_supported = false;
+        return false;
+    }
+
+    output->import_supported = modifier_supported_vulkan(vk, frame, output->frame_format->format);
+    if (!output->import_supported) {
+        fprintf(stderr, "WARN: Vulkan device can't import frames of output %s with modifier 0x%016lx, skipping them! "
+            "Running the compositor with WLR_DRM_NO_MODIFIERS=1 avoids this.\n",
+            output->name ? output->name : "", (unsigned long)frame->modifier);
+    }
+
+    return output->import_supported;
+}
+
+static struct ImportedImage* import_frame(struct Vulkan *vk, struct VulkanOutput *output, struct Frame *frame) {
+    struct stat st;
+    if (fstat(frame->fds[0], &st) == -1) {
+        fprintf(stderr, "ERROR: Failed to stat DMA-BUF fd!\n");
+        return NULL;
+    }
+
+    struct ImportKey key = {
+        .dev      = st.st_dev,
+        .ino      = st.st_ino,
+        .width    = frame->width,
+        .height   = frame->height,
+        .format   = frame->format,
+        .modifier = frame->modifier,
+    };
+
+    output->frame_counter++;
+
+    // Buffers that compositor stopped sending us are most likely gone
+    struct ImportedImage *entry = NULL, *lru = NULL;
+    for (int i = 0; i < IMPORT_CACHE_SIZE; i++) {
+        struct ImportedImage *elem = &output->import_cache[i];
+        if (elem->in_flight) {
+            if (!elem->stale && import_key_equal(&elem->key, &key)) {
+                entry = elem;
+            }
+            continue;
+        }
+
+        if (elem->image && import_key_equal(&elem->key, &key)) {
+            entry = elem;
+        } else if (elem->image && output->frame_counter - elem->last_used > IMPORT_CACHE_MAX_IDLE_FRAMES) {
+            import_cache_evict(vk, output, elem);
+        }
+
+        if (lru == NULL || elem->last_used < lru->last_used) {
+            lru = elem;
+        }
+    }
+
+    if (entry) {
+        entry->last_used = output->frame_counter;
+        entry->in_flight++;
+        return entry;
+    }
+
+    if (!import_supported(vk, output, frame)) {
+        return NULL;
+    }
+
+    // There are always more cache entries than slots in flight
+    entry = lru;
+    import_cache_evict(vk, output, entry);
+
+    // Implicit modifier is left to the driver, explicit one comes with the layout of every plane
+    bool explicitModifier = frame->modifier != DRM_FORMAT_MOD_INVALID;
+    VkSubresourceLayout planeLayouts[4] = { 0 };
+    for (uint32_t i = 0; i < frame->num_objects; i++) {
+        planeLayouts[frame->plane_indices[i]].offset   = frame->offsets[i];
+        planeLayouts[frame->plane_indices[i]].rowPitch = frame->strides[i];
+    }
+
+    VkImageDrmFormatModifierExplicitCreateInfoEXT modifierInfo = {
+        .sType                       = VK_STRUCTURE_TYPE_IMAGE_DRM_FORMAT_MODIFIER_EXPLICIT_CREATE_INFO_EXT,
+        .drmFormatModifier           = frame->modifier,
+        .drmFormatModifierPlaneCount = frame->num_objects,
+        .pPlaneLayouts               = planeLayouts,
+    };
+
+    VkExternalMemoryImageCreateInfo frameImageMemoryInfo = {
+        .sType       = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_IMAGE_CREATE_INFO,
+        .pNext       = explicitModifier ? &modifierInfo : NULL,
+        .handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+    };
+
+    VkImageCreateInfo frameImageInfo = {
+        .sType         = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO,
+        .pNext         = &frameImageMemoryInfo,
+        .imageType     = VK_IMAGE_TYPE_2D,
+        .format        = output->frame_format->format,
+        .extent.width  = frame->width,
+        .extent.height = frame->height,
+        .extent.depth  = 1,
+        .mipLevels     = 1,
+        .arrayLayers   = 1,
+        .flags         = VK_IMAGE_CREATE_ALIAS_BIT | (frame->disjoint ? VK_IMAGE_CREATE_DISJOINT_BIT : 0),
+        .tiling        = explicitModifier ? VK_IMAGE_TILING_DRM_FORMAT_MODIFIER_EXT : VK_IMAGE_TILING_OPTIMAL,
+        .initialLayout = VK_IMAGE_LAYOUT_UNDEFINED, // specs say so
+        .usage         = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+        .sharingMode   = VK_SHARING_MODE_EXCLUSIVE,
+        .samples       = VK_SAMPLE_COUNT_1_BIT,
+    };
+
+    if (vkCreateImage(vk->device, &frameImageInfo, NULL, &entry->image) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create Vulkan frame image!\n");
+        goto fail;
+    }
+
+    // Planes of the same buffer share the memory, disjoint ones get memory of their own
+    VkBindImageMemoryInfo bindInfos[4];
+    VkBindImagePlaneMemoryInfo planeInfos[4];
+    uint32_t memoryCount = frame->disjoint ? frame->num_objects : 1;
+    for (uint32_t i = 0; i < memoryCount; i++) {
+        // Memory type has to suit both the image, or its plane, and the DMA-BUF
+        VkImagePlaneMemoryRequirementsInfo planeRequirementsInfo = {
+            .sType       = VK_STRUCTURE_TYPE_IMAGE_PLANE_MEMORY_REQUIREMENTS_INFO,
+            .planeAspect = VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT << frame->plane_indices[i],
+        };
+        VkImageMemoryRequirementsInfo2 requirementsInfo = {
+            .sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_REQUIREMENTS_INFO_2,
+            .pNext = frame->disjoint ? &planeRequirementsInfo : NULL,
+            .image = entry->image,
+        };
+        VkMemoryRequirements2 requirements = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_REQUIREMENTS_2,
+        };
+        vkGetImageMemoryRequirements2(vk->device, &requirementsInfo, &requirements);
+
+        uint32_t typeBits = requirements.memoryRequirements.memoryTypeBits;
+        VkMemoryFdPropertiesKHR fdProperties = {
+            .sType = VK_STRUCTURE_TYPE_MEMORY_FD_PROPERTIES_KHR,
+        };
+        if (vk->get_memory_fd_properties && vk->get_memory_fd_properties(vk->device,
+                VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT, frame->fds[i], &fdProperties) == VK_SUCCESS) {
+            typeBits &= fdProperties.memoryTypeBits;
+        }
+
+        uint32_t memoryTypeIndex;
+        if (!find_memory_type_vulkan(vk, typeBits, 0, 0, &memoryTypeIndex)) {
+            fprintf(stderr, "ERROR: Failed to find memory type for Vulkan frame image!\n");
+            goto fail;
+        }
+
+        VkImportMemoryFdInfoKHR idesc = {
+            .sType      = VK_STRUCTURE_TYPE_IMPORT_MEMORY_FD_INFO_KHR,
+            .handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_DMA_BUF_BIT_EXT,
+            .fd         = dup(frame->fds[i]),
+        };
+        VkMemoryAllocateInfo alloc_info = {
+            .sType           = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+            .pNext           = &idesc,
+            .allocationSize  = frame->sizes[i],
+            .memoryTypeIndex = memoryTypeIndex,
+        };
+
+        if (vkAllocateMemory(vk->device, &alloc_info, NULL, &entry->memory[i]) != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: Failed to allocate memory for Vulkan frame image!\n");
+            close(idesc.fd);
+            goto fail;
+        }
+        entry->memory_count++;
+
+        planeInfos[i] = (VkBindImagePlaneMemoryInfo) {
+            .sType       = VK_STRUCTURE_TYPE_BIND_IMAGE_PLANE_MEMORY_INFO,
+            .planeAspect = VK_IMAGE_ASPECT_MEMORY_PLANE_0_BIT_EXT << frame->plane_indices[i],
+        };
+        bindInfos[i] = (VkBindImageMemoryInfo) {
+            .sType        = VK_STRUCTURE_TYPE_BIND_IMAGE_MEMORY_INFO,
+            .pNext        = frame->disjoint ? &planeInfos[i] : NULL,
+            .image        = entry->image,
+            .memory       = entry->memory[i],
+            .memoryOffset = 0,
+        };
+    }
+
+    if (vkBindImageMemory2(vk->device, memoryCount, bindInfos) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to bind allocated memory for Vulkan frame image!\n");
+        goto fail;
+    }
+
+    if (vk->compute) {
+        VkImageViewCreateInfo viewInfo = {
+            .sType                           = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO,
+            .image                           = entry->image,
+            .viewType                        = VK_IMAGE_VIEW_TYPE_2D,
+            .format                          = frameImageInfo.format,
+            .subresourceRange.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+            .subresourceRange.baseMipLevel   = 0,
+            .subresourceRange.levelCount     = 1,
+            .subresourceRange.baseArrayLayer = 0,
+            .subresourceRange.layerCount     = 1,
+        };
+
+        if (vkCreateImageView(vk->device, &viewInfo, NULL, &entry->view) != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: Failed to create Vulkan frame image view!\n");
+            goto fail;
+        }
+
+        VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
+            .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+            .descriptorPool     = output->descriptor_pool,
+            .descriptorSetCount = 1,
+            .pSetLayouts        = &vk->image_set_layout,
+        };
+
+        if (vkAllocateDescriptorSets(vk->device, &descriptorSetAllocateInfo, &entry->descriptor_set) != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: Failed to allocate Vulkan descriptor set!\n");
+            goto fail;
+        }
+
+        VkDescriptorImageInfo descriptorImageInfo = {
+            .sampler     = vk->sampler,
+            .imageView   = entry->view,
+            .imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        };
+
+        VkWriteDescriptorSet descriptorWrite = {
+            .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+            .dstSet          = entry->descriptor_set,
+            .dstBinding      = 0,
+            .descriptorCount = 1,
+            .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+            .pImageInfo      = &descriptorImageInfo,
+        };
+
+        vkUpdateDescriptorSets(vk->device, 1, &descriptorWrite, 0, NULL);
+    }
+
+    entry->key = key;
+    entry->last_used = output->frame_counter;
+    entry->in_flight++;
+    return entry;
+
+fail:
+    import_cache_evict(vk, output, entry);
+    return NULL;
+}
+
+
+/******************************************************************************
+ * Luma
+ */
+static void region_rect(struct Vulkan *vk, struct Frame *frame, VkOffset2D *offset, VkExtent2D *extent) {
+    uint32_t region[4];
+    luma_region(&vk->settings, frame->width, frame->height, region);
+    *offset = (VkOffset2D) { region[0], region[1] };
+    *extent = (VkExtent2D) { region[2], region[3] };
+}
+
+static void record_luma_blit(struct Vulkan *vk, struct VulkanOutput *output, struct VulkanSlot *slot, struct Frame *frame, struct ImportedImage *frame_image) {
+    VkImageMemoryBarrier frameImageBarrier = {
+        .sType                           = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .oldLayout                       = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout                       = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        .srcQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED,
+        .image                           = frame_image->image,
+        .subresourceRange.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.baseMipLevel   = 0,
+        .subresourceRange.layerCount     = 1,
+        .subresourceRange.levelCount     = 1,
+        .srcAccessMask                   = 0,
+        .dstAccessMask                   = VK_ACCESS_TRANSFER_READ_BIT,
+    };
+
+    // Another slot might still be reading the same buffer
+    vkCmdPipelineBarrier(slot->command_buffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+        0, NULL,
+        0, NULL,
+        1, &frameImageBarrier);
+
+    VkImageMemoryBarrier imageBarrier = {
+        .sType                           = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .oldLayout                       = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout                       = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        .srcQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED,
+        .image                           = output->vulkan_frame->image,
+        .subresourceRange.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.baseMipLevel   = 0,
+        .subresourceRange.layerCount     = 1,
+        .subresourceRange.levelCount     = output->vulkan_frame->mip_levels,
+        .srcAccessMask                   = 0,
+        .dstAccessMask                   = VK_ACCESS_TRANSFER_WRITE_BIT,
+    };
+
+    // Mip chain is shared by all slots, wait until previous slot is done with it
+    vkCmdPipelineBarrier(slot->command_buffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+        0, NULL,
+        0, NULL,
+        1, &imageBarrier);
+
+    // Only the region is blitted, it ends up in the top left corner of the mip chain
+    VkOffset2D regionOffset;
+    VkExtent2D regionExtent;
+    region_rect(vk, frame, &regionOffset, &regionExtent);
+    uint32_t mipWidth  = regionExtent.width > 1 ? regionExtent.width / 2 : 1;
+    uint32_t mipHeight = regionExtent.height > 1 ? regionExtent.height / 2 : 1;
+
+    VkImageBlit blit = {
+        .srcOffsets[0]                 = { regionOffset.x, regionOffset.y, 0 },
+        .srcOffsets[1]                 = { regionOffset.x + regionExtent.width, regionOffset.y + regionExtent.height, 1 },
+        .srcSubresource.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+        .srcSubresource.mipLevel       = 0,
+        .srcSubresource.baseArrayLayer = 0,
+        .srcSubresource.layerCount     = 1,
+        .dstOffsets[0]                 = { 0, 0, 0 },
+        .dstOffsets[1]                 = { mipWidth, mipHeight, 1 },
+        .dstSubresource.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+        .dstSubresource.mipLevel       = 0,
+        .dstSubresource.baseArrayLayer = 0,
+        .dstSubresource.layerCount     = 1,
+    };
+
+    vkCmdBlitImage(slot->command_buffer,
+        frame_image->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        output->vulkan_frame->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+        1, &blit,
+        VK_FILTER_LINEAR);
+
+    imageBarrier.subresourceRange.levelCount = 1;
+    uint32_t targetMipLevel = output->vulkan_frame->mip_levels - LAST_MIP_LEVEL;
+
+    for (uint32_t i = 1; i <= targetMipLevel; i++) {
+        imageBarrier.subresourceRange.baseMipLevel = i - 1;
+        imageBarrier.oldLayout                     = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        imageBarrier.newLayout                     = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        imageBarrier.srcAccessMask                 = VK_ACCESS_TRANSFER_WRITE_BIT;
+        imageBarrier.dstAccessMask                 = VK_ACCESS_TRANSFER_READ_BIT;
+
+        vkCmdPipelineBarrier(slot->command_buffer,
+            VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+            0, NULL,
+            0, NULL,
+            1, &imageBarrier);
+
+        blit.srcOffsets[0] = (VkOffset3D) { 0, 0, 0 };
+        blit.srcOffsets[1] = (VkOffset3D) { mipWidth, mipHeight, 1 };
+        blit.dstOffsets[1] = (VkOffset3D) { mipWidth > 1 ? mipWidth / 2 : 1, mipHeight > 1 ? mipHeight / 2 : 1, 1 };
+        blit.srcSubresource.mipLevel = i - 1;
+        blit.dstSubresource.mipLevel = i;
+
+        vkCmdBlitImage(slot->command_buffer,
+            output->vulkan_frame->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            output->vulkan_frame->image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            1, &blit,
+            VK_FILTER_LINEAR);
+
+        if (mipWidth > 1)  mipWidth /= 2;
+        if (mipHeight > 1) mipHeight /= 2;
+    }
+
+    imageBarrier.subresourceRange.baseMipLevel = targetMipLevel;
+    imageBarrier.oldLayout                     = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+    imageBarrier.newLayout                     = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+    imageBarrier.srcAccessMask                 = VK_ACCESS_TRANSFER_WRITE_BIT;
+    imageBarrier.dstAccessMask                 = VK_ACCESS_TRANSFER_READ_BIT;
+
+    vkCmdPipelineBarrier(slot->command_buffer,
+        VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+        0, NULL,
+        0, NULL,
+        1, &imageBarrier);
+
+    VkBufferImageCopy region = {
+        .bufferOffset                    = 0,
+        .bufferRowLength                 = 0,
+        .bufferImageHeight               = 0,
+        .imageSubresource.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+        .imageSubresource.mipLevel       = targetMipLevel,
+        .imageSubresource.baseArrayLayer = 0,
+        .imageSubresource.layerCount     = 1,
+        .imageOffset                     = { 0, 0, 0 },
+        .imageExtent                     = { mipWidth, mipHeight, 1 },
+    };
+
+    vkCmdCopyImageToBuffer(slot->command_buffer, output->vulkan_frame->image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, slot->buffer, 1, &region);
+
+    output->vulkan_frame->readback_width  = mipWidth;
+    output->vulkan_frame->readback_height = mipHeight;
+
+    slot->vulkan_frame = output->vulkan_frame;
+    slot->vulkan_frame->in_flight++;
+
+}
+
+static int read_luma_blit(struct Vulkan *vk, struct VulkanSlot *slot, double *difference) {
+    if (!invalidate_memory_vulkan(vk, slot->buffer_memory, slot->buffer_coherent)) {
+        fprintf(stderr, "ERROR: Failed to invalidate Vulkan buffer memory!\n");
+        return -1;
+    }
+    const unsigned char *rgba = slot->buffer_data;
+    struct VulkanFrame *vulkan_frame = slot->vulkan_frame;
+
+    double rgbSum[] = { 0, 0, 0 }, weightSum = 0;
+    uint32_t histogram[LUMA_HISTOGRAM_BINS] = { 0 };
+    int width = vulkan_frame->readback_width, height = vulkan_frame->readback_height;
+    int totalPixels = width * height;
+    for (int i = 0; i < totalPixels; i++) {
+        double weight = luma_region_weight(&vk->settings, (i % width + 0.5) / width, (i / width + 0.5) / height);
+        rgbSum[0] += weight * rgba[4 * i + 0];
+        rgbSum[1] += weight * rgba[4 * i + 1];
+        rgbSum[2] += weight * rgba[4 * i + 2];
+        weightSum += weight;
+
+        double pixelLuma = sqrt(0.241 * rgba[4 * i + 0] * rgba[4 * i + 0] + 0.691 * rgba[4 * i + 1] * rgba[4 * i + 1] + 0.068 * rgba[4 * i + 2] * rgba[4 * i + 2]) / 255.0;
+        histogram[(int)fmin(pixelLuma * LUMA_HISTOGRAM_BINS, LUMA_HISTOGRAM_BINS - 1)] += round(weight * 255.0);
+    }
+    double r = rgbSum[0] / weightSum, g = rgbSum[1] / weightSum, b = rgbSum[2] / weightSum;
+
+    // The readback is tiny already, compare it with the previous one as is
+    unsigned char *previous = vulkan_frame->readback_previous;
+    if (previous == NULL) {
+        previous = vulkan_frame->readback_previous = malloc(4 * totalPixels);
+        *difference = 100.0;
+    } else {
+        int maxDifference = 0;
+        for (int i = 0; i < 4 * totalPixels; i++) {
+            maxDifference = fmax(maxDifference, abs(rgba[i] - previous[i]));
+        }
+        *difference = maxDifference / 255.0 * 100.0;
+    }
+    if (previous) {
+        memcpy(previous, rgba, 4 * totalPixels);
+    }
+
+    if (vk->settings.statistic != LUMA_MEAN) {
+        return luma_histogram_pct(&vk->settings, histogram);
+    }
+    return sqrt(0.241 * r * r + 0.691 * g * g + 0.068 * b * b) / 255.0 * 100.0;
+}
+
+static void record_luma_compute(struct Vulkan *vk, struct VulkanOutput *output, struct VulkanSlot *slot, struct Frame *frame, struct ImportedImage *frame_image) {
+    VkImageMemoryBarrier frameImageBarrier = {
+        .sType                           = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER,
+        .oldLayout                       = VK_IMAGE_LAYOUT_UNDEFINED,
+        .newLayout                       = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+        .srcQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex             = VK_QUEUE_FAMILY_IGNORED,
+        .image                           = frame_image->image,
+        .subresourceRange.aspectMask     = VK_IMAGE_ASPECT_COLOR_BIT,
+        .subresourceRange.baseArrayLayer = 0,
+        .subresourceRange.baseMipLevel   = 0,
+        .subresourceRange.layerCount     = 1,
+        .subresourceRange.levelCount     = 1,
+        .srcAccessMask                   = 0,
+        .dstAccessMask                   = VK_ACCESS_SHADER_READ_BIT,
+    };
+
+    // Accumulator is reset by the previous dispatch in this slot, make sure it's visible
+    VkBufferMemoryBarrier resultBarrier = {
+        .sType               = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+        .srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED,
+        .buffer              = slot->result_buffer,
+        .offset              = 0,
+        .size                = VK_WHOLE_SIZE,
+        .srcAccessMask       = VK_ACCESS_SHADER_WRITE_BIT,
+        .dstAccessMask       = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT,
+    };
+
+    // Thumbnail is shared with the other slots of the output, previous frame must be done with it
+    VkBufferMemoryBarrier bufferBarriers[] = { resultBarrier, resultBarrier };
+    bufferBarriers[1].buffer = output->thumbnail_buffer;
+
+    vkCmdPipelineBarrier(slot->command_buffer,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+        0, NULL,
+        2, bufferBarriers,
+        1, &frameImageBarrier);
+
+    vkCmdBindPipeline(slot->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, vk->pipelines[output->frame_format->transfer]);
+    VkDescriptorSet descriptorSets[] = { frame_image->descriptor_set, slot->result_descriptor_set };
+    vkCmdBindDescriptorSets(slot->command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE,
+        vk->pipeline_layout, 0, 2, descriptorSets, 0, NULL);
+
+    VkOffset2D regionOffset;
+    VkExtent2D regionExtent;
+    region_rect(vk, frame, &regionOffset, &regionExtent);
+    struct RegionPush region = {
+        .offset = { regionOffset.x, regionOffset.y },
+        .extent = { regionExtent.width, regionExtent.height },
+    };
+    vkCmdPushConstants(slot->command_buffer, vk->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(region), &region);
+
+    // Every workgroup covers 64x64 pixels of the region, see shader/luma.comp
+    vkCmdDispatch(slot->command_buffer, (regionExtent.width + 63) / 64, (regionExtent.height + 63) / 64, 1);
+
+    resultBarrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+    resultBarrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+
+    vkCmdPipelineBarrier(slot->command_buffer,
+        VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0,
+        0, NULL,
+        1, &resultBarrier,
+        0, NULL);
+}
+
+static int read_luma_compute(struct Vulkan *vk, struct VulkanSlot *slot, double *difference) {
+    if (!invalidate_memory_vulkan(vk, slot->result_buffer_memory, slot->result_coherent)) {
+        fprintf(stderr, "ERROR: Failed to invalidate Vulkan result buffer memory!\n");
+        return -1;
+    }
+
+    const struct LumaResult *luma_result = slot->result_data;
+    *difference = luma_result->difference;
+    return vk->settings.statistic == LUMA_MEAN ? luma_result->luma : luma_histogram_pct(&vk->settings, luma_result->histogram);
+}
+
+
+/******************************************************************************
+ * Submissions
+ */
+bool record_frame_vulkan(struct Vulkan *vk, struct VulkanOutput *output, struct Frame *frame) {
+    struct VulkanSlot *slot = NULL;
+    for (int i = 0; i < VULKAN_SLOTS; i++) {
+        if (!output->slots[i].busy) {
+            slot = &output->slots[i];
+            break;
+        }
+    }
+
+    if (slot == NULL) {
+        if (!vk->warned_slots_busy) {
+            fprintf(stderr, "WARN: All Vulkan slots are busy, skipping frames!\n");
+            vk->warned_slots_busy = true;
+        }
+        return false;
+    }
+
+    if (!vk->compute && output->vulkan_frame == NULL) {
+        fprintf(stderr, "ERROR: Vulkan objects were not prepared, skipping frame!\n");
+        return false;
+    }
+
+    struct ImportedImage *frame_image = import_frame(vk, output, frame);
+    if (frame_image == NULL) {
+        return false;
+    }
+
+    VkCommandBufferBeginInfo commandBufferBeginInfo = {
+        .sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+        .flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+    };
+
+    if (vkBeginCommandBuffer(slot->command_buffer, &commandBufferBeginInfo) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to begin Vulkan command buffer!\n");
+        goto fail;
+    }
+
+    if (vk->timestamps) {
+        vkCmdResetQueryPool(slot->command_buffer, slot->query_pool, 0, 2);
+        vkCmdWriteTimestamp(slot->command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, slot->query_pool, 0);
+    }
+
+    if (vk->compute) {
+        record_luma_compute(vk, output, slot, frame, frame_image);
+    } else {
+        record_luma_blit(vk, output, slot, frame, frame_image);
+    }
+
+    if (vk->timestamps) {
+        vkCmdWriteTimestamp(slot->command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, slot->query_pool, 1);
+    }
+
+    if (vkEndCommandBuffer(slot->command_buffer) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to end Vulkan command buffer!\n");
+        goto fail;
+    }
+
+    // Submitted along with frames of other outputs at the end of this tick
+    slot->busy = true;
+    slot->image = frame_image;
+    slot->frame = frame;
+    wl_list_insert(vk->pending.prev, &slot->link);
+
+    return true;
+
+fail:
+    import_release(vk, output, frame_image);
+    return false;
+}
+
+struct Frame* release_slot_vulkan(struct Vulkan *vk, struct VulkanSlot *slot) {
+    wl_list_remove(&slot->link);
+    import_release(vk, slot->output, slot->image);
+    if (slot->vulkan_frame) {
+        release_frame_vulkan(vk, slot->vulkan_frame);
+        slot->vulkan_frame = NULL;
+    }
+
+    struct Frame *frame = slot->frame;
+    slot->image = NULL;
+    slot->frame = NULL;
+    slot->busy = false;
+    return frame;
+}
+
+// Frames of the slots that didn't make it to the GPU go back to the application
+static void drop_slot_vulkan(struct Vulkan *vk, struct VulkanSlot *slot) {
+    struct Frame *frame = release_slot_vulkan(vk, slot);
+    if (frame && vk->listener) {
+        vk->listener->frame_dropped(vk->listener_data, frame);
+    }
+}
+
+bool release_submit_vulkan(struct Vulkan *vk, struct VulkanSubmit *submit) {
+    bool ok = true;
+    if (submit->fence_fd >= 0) {
+        if (vk->listener) {
+            vk->listener->fence_released(vk->listener_data, submit);
+        }
+        close(submit->fence_fd);
+        submit->fence_fd = -1;
+    }
+
+    submit->fence_signaled = !submit->fence_exported && vkResetFences(vk->device, 1, &submit->fence) != VK_SUCCESS;
+    if (submit->fence_signaled) {
+        fprintf(stderr, "WARN: Failed to reset Vulkan fence!\n");
+        ok = false;
+    }
+
+    submit->busy = false;
+    return ok;
+}
+
+bool submit_pending_vulkan(struct Vulkan *vk) {
+    bool ok = true;
+    while (!wl_list_empty(&vk->pending)) {
+        struct VulkanSubmit *submit = NULL;
+        for (int i = 0; i < VULKAN_SUBMITS; i++) {
+            if (!vk->submits[i].busy) {
+                submit = &vk->submits[i];
+                break;
+            }
+        }
+
+        if (submit == NULL) {
+            fprintf(stderr, "WARN: All Vulkan submissions are busy, skipping frames!\n");
+            break;
+        }
+
+        VkCommandBuffer commandBuffers[VULKAN_BATCH_SIZE];
+        uint32_t commandBufferCount = 0;
+        struct VulkanSlot *slot, *tmp;
+        wl_list_for_each_safe(slot, tmp, &vk->pending, link) {
+            if (commandBufferCount == VULKAN_BATCH_SIZE) {
+                break;
+            }
+            commandBuffers[commandBufferCount++] = slot->command_buffer;
+            wl_list_remove(&slot->link);
+            wl_list_insert(submit->slots.prev, &slot->link);
+        }
+
+        VkSubmitInfo submitInfo = {
+            .sType              = VK_STRUCTURE_TYPE_SUBMIT_INFO,
+            .commandBufferCount = commandBufferCount,
+            .pCommandBuffers    = commandBuffers,
+        };
+
+        // Fence that failed to reset earlier gets another try, the frames are dropped if it still fails
+        if (submit->fence_signaled) {
+            submit->fence_signaled = vkResetFences(vk->device, 1, &submit->fence) != VK_SUCCESS;
+        }
+
+        VkResult result = VK_SUCCESS;
+        if (submit->fence_signaled || (result = vkQueueSubmit(vk->queue, 1, &submitInfo, submit->fence)) != VK_SUCCESS) {
+            vk->device_lost = vk->device_lost || result == VK_ERROR_DEVICE_LOST;
+            fprintf(stderr, "ERROR: Failed to submit Vulkan queue!\n");
+            wl_list_for_each_safe(slot, tmp, &submit->slots, link) {
+                drop_slot_vulkan(vk, slot);
+            }
+            continue;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &submit->submitted);
+        submit->busy = true;
+        submit->overdue = false;
+
+        // Exporting sync fd resets the fence, fd is -1 if work is already done
+        submit->fence_exported = false;
+        submit->fence_fd = -1;
+        if (vk->sync_fd) {
+            VkFenceGetFdInfoKHR fenceGetFdInfo = {
+                .sType      = VK_STRUCTURE_TYPE_FENCE_GET_FD_INFO_KHR,
+                .fence      = submit->fence,
+                .handleType = VK_EXTERNAL_FENCE_HANDLE_TYPE_SYNC_FD_BIT,
+            };
+
+            if (vk->get_fence_fd(vk->device, &fenceGetFdInfo, &submit->fence_fd) == VK_SUCCESS) {
+                submit->fence_exported = true;
+                if (submit->fence_fd >= 0 && vk->listener && !vk->listener->fence_exported(vk->listener_data, submit)) {
+                    fprintf(stderr, "ERROR: Failed to watch Vulkan fence!\n");
+                    ok = false;
+                }
+            } else {
+                submit->fence_fd = -1;
+            }
+        }
+    }
+
+    // Frames that didn't fit are dropped, outputs ask for new ones anyway
+    struct VulkanSlot *slot, *tmp;
+    wl_list_for_each_safe(slot, tmp, &vk->pending, link) {
+        drop_slot_vulkan(vk, slot);
+    }
+
+    return ok;
+}
+
+bool submit_done_vulkan(struct Vulkan *vk, struct VulkanSubmit *submit) {
+    if (submit->fence_exported) {
+        return submit->fence_fd == -1;
+    }
+
+    VkResult result = vkGetFenceStatus(vk->device, submit->fence);
+    vk->device_lost = vk->device_lost || result == VK_ERROR_DEVICE_LOST;
+    return result == VK_SUCCESS;
+}
+
+bool submit_has_output_vulkan(struct VulkanSubmit *submit, struct VulkanOutput *output) {
+    struct VulkanSlot *slot;
+    wl_list_for_each(slot, &submit->slots, link) {
+        if (slot->output == output) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Exported fences were reset by the export, their sync fd is waited for instead
+bool wait_submit_vulkan(struct Vulkan *vk, struct VulkanSubmit *submit, uint64_t timeout_ns) {
+    if (submit->fence_exported) {
+        struct pollfd pfd = { .fd = submit->fence_fd, .events = POLLIN };
+        return submit->fence_fd == -1 || poll(&pfd, 1, timeout_ns / 1000000) == 1;
+    }
+
+    VkResult result = vkWaitForFences(vk->device, 1, &submit->fence, VK_TRUE, timeout_ns);
+    vk->device_lost = vk->device_lost || result == VK_ERROR_DEVICE_LOST;
+    return result == VK_SUCCESS;
+}
+
+int read_frame_luma_pct_vulkan(struct Vulkan *vk, struct VulkanSlot *slot, double *difference) {
+    return vk->compute ? read_luma_compute(vk, slot, difference) : read_luma_blit(vk, slot, difference);
+}
+
+bool read_gpu_time_vulkan(struct Vulkan *vk, struct VulkanSlot *slot, uint64_t *ns) {
+    uint64_t timestamps[2];
+    if (!vk->timestamps || vkGetQueryPoolResults(vk->device, slot->query_pool, 0, 2, sizeof(timestamps), timestamps,
+            sizeof(uint64_t), VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT) != VK_SUCCESS) {
+        return false;
+    }
+
+    *ns = (timestamps[1] - timestamps[0]) * vk->timestamp_period;
+    return true;
+}
+
+
+/******************************************************************************
+ * Initialization
+ */
+static void deinit_compute_vulkan(struct Vulkan *vk) {
+    for (int i = 0; i < TRANSFER_COUNT; i++) {
+        if (vk->pipelines[i]) vkDestroyPipeline(vk->device, vk->pipelines[i], NULL);
+        vk->pipelines[i] = VK_NULL_HANDLE;
+    }
+    if (vk->pipeline_layout)   vkDestroyPipelineLayout(vk->device, vk->pipeline_layout, NULL);
+    if (vk->image_set_layout)  vkDestroyDescriptorSetLayout(vk->device, vk->image_set_layout, NULL);
+    if (vk->result_set_layout) vkDestroyDescriptorSetLayout(vk->device, vk->result_set_layout, NULL);
+    if (vk->sampler)           vkDestroySampler(vk->device, vk->sampler, NULL);
+
+    vk->pipeline_layout = VK_NULL_HANDLE;
+    vk->image_set_layout = VK_NULL_HANDLE;
+    vk->result_set_layout = VK_NULL_HANDLE;
+    vk->sampler = VK_NULL_HANDLE;
+    vk->compute = false;
+}
+
+// Shader expects zeroed accumulators in its storage buffers, mapping is kept when asked for
+static bool init_storage_buffer_vulkan(struct Vulkan *vk, VkDeviceSize size, VkMemoryPropertyFlags preferred,
+        VkBuffer *buffer, VkDeviceMemory *memory, void **mapped, bool *coherent) {
+    VkBufferCreateInfo bufferInfo = {
+        .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size        = size,
+        .usage       = VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+
+    if (vkCreateBuffer(vk->device, &bufferInfo, NULL, buffer) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create Vulkan storage buffer!\n");
+        return false;
+    }
+
+    VkMemoryRequirements bufferMemoryRequirements;
+    vkGetBufferMemoryRequirements(vk->device, *buffer, &bufferMemoryRequirements);
+
+    VkMemoryPropertyFlags flags;
+    if (!allocate_memory_vulkan(vk, &bufferMemoryRequirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT, preferred, memory, &flags)) {
+        fprintf(stderr, "ERROR: Failed to allocate memory for Vulkan storage buffer!\n");
+        return false;
+    }
+    bool isCoherent = flags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+    if (vkBindBufferMemory(vk->device, *buffer, *memory, 0) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to bind allocated memory for Vulkan storage buffer!\n");
+        return false;
+    }
+
+    void *data;
+    if (vkMapMemory(vk->device, *memory, 0, VK_WHOLE_SIZE, 0, &data) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to map Vulkan storage buffer memory!\n");
+        return false;
+    }
+    memset(data, 0, size);
+
+    if (!flush_memory_vulkan(vk, *memory, isCoherent)) {
+        fprintf(stderr, "ERROR: Failed to flush Vulkan storage buffer memory!\n");
+        vkUnmapMemory(vk->device, *memory);
+        return false;
+    }
+
+    if (mapped) {
+        *mapped = data;
+        *coherent = isCoherent;
+    } else {
+        vkUnmapMemory(vk->device, *memory);
+    }
+    return true;
+}
+
+static bool init_slot_compute_vulkan(struct Vulkan *vk, struct VulkanOutput *output, struct VulkanSlot *slot) {
+    // Result is read by the host after every dispatch
+    if (!init_storage_buffer_vulkan(vk, sizeof(struct LumaResult), VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+            &slot->result_buffer, &slot->result_buffer_memory, &slot->result_data, &slot->result_coherent)) {
+        return false;
+    }
+
+    VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {
+        .sType              = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+        .descriptorPool     = output->descriptor_pool,
+        .descriptorSetCount = 1,
+        .pSetLayouts        = &vk->result_set_layout,
+    };
+
+    if (vkAllocateDescriptorSets(vk->device, &descriptorSetAllocateInfo, &slot->result_descriptor_set) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to allocate Vulkan descriptor set!\n");
+        return false;
+    }
+
+    VkDescriptorBufferInfo descriptorBufferInfos[] = {
+        { .buffer = slot->result_buffer,      .offset = 0, .range = VK_WHOLE_SIZE },
+        { .buffer = output->thumbnail_buffer, .offset = 0, .range = VK_WHOLE_SIZE },
+    };
+
+    VkWriteDescriptorSet descriptorWrite = {
+        .sType           = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
+        .dstSet          = slot->result_descriptor_set,
+        .dstBinding      = 0,
+        .descriptorCount = 2,
+        .descriptorType  = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
+        .pBufferInfo     = descriptorBufferInfos,
+    };
+
+    vkUpdateDescriptorSets(vk->device, 1, &descriptorWrite, 0, NULL);
+
+    return true;
+}
+
+// Frames are sampled with linear filtering, see shader/luma.comp
+static bool has_compute_format_support(VkPhysicalDevice physicalDevice) {
+    VkFormatProperties formatProperties;
+    vkGetPhysicalDeviceFormatProperties(physicalDevice, VK_FORMAT_R8G8B8A8_UNORM, &formatProperties);
+    VkFormatFeatureFlags requiredFeatures = VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT;
+    return (formatProperties.optimalTilingFeatures & requiredFeatures) == requiredFeatures;
+}
+
+// Drivers check the header of cached data themselves and ignore data of other devices or driver versions
+static size_t load_pipeline_cache_vulkan(struct Vulkan *vk) {
+    void *data = NULL;
+    size_t size = 0;
+
+    int fd = vk->pipeline_cache_path ? open(vk->pipeline_cache_path, O_RDONLY | O_CLOEXEC) : -1;
+    struct stat st;
+    if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+        data = malloc(st.st_size);
+        if (data && read(fd, data, st.st_size) == st.st_size) {
+            size = st.st_size;
+        }
+    }
+    if (fd != -1) close(fd);
+
+    VkPipelineCacheCreateInfo pipelineCacheInfo = {
+        .sType           = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+        .initialDataSize = size,
+        .pInitialData    = size > 0 ? data : NULL,
+    };
+
+    // Pipelines still compile without a cache
+    if (vkCreatePipelineCache(vk->device, &pipelineCacheInfo, NULL, &vk->pipeline_cache) != VK_SUCCESS) {
+        vk->pipeline_cache = VK_NULL_HANDLE;
+        size = 0;
+    }
+    free(data);
+    return size;
+}
+
+// Written next to the old file and renamed over it, so a crash never leaves a truncated cache behind
+static void save_pipeline_cache_vulkan(struct Vulkan *vk, size_t cachedSize) {
+    size_t size;
+    if (vk->pipeline_cache == VK_NULL_HANDLE || vk->pipeline_cache_path == NULL
+            || vkGetPipelineCacheData(vk->device, vk->pipeline_cache, &size, NULL) != VK_SUCCESS || size == cachedSize) {
+        return;
+    }
+
+    void *data = malloc(size);
+    if (data == NULL || vkGetPipelineCacheData(vk->device, vk->pipeline_cache, &size, data) != VK_SUCCESS) {
+        free(data);
+        return;
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s.tmp", vk->pipeline_cache_path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    bool written = fd != -1 && write(fd, data, size) == (ssize_t)size;
+    if (fd != -1) close(fd);
+    free(data);
+
+    if (!written || rename(path, vk->pipeline_cache_path) != 0) {
+        fprintf(stderr, "WARN: Failed to save Vulkan pipeline cache: %s!\n", vk->pipeline_cache_path);
+        unlink(path);
+    }
+}
+
+static bool init_compute_vulkan(struct Vulkan *vk, VkPhysicalDevice physicalDevice, uint32_t queueFamilyIndex) {
+    uint32_t queueFamilyCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, NULL);
+    VkQueueFamilyProperties *queueFamilies = calloc(queueFamilyCount, sizeof(VkQueueFamilyProperties));
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies);
+    bool hasCompute = queueFamilyIndex < queueFamilyCount && (queueFamilies[queueFamilyIndex].queueFlags & VK_QUEUE_COMPUTE_BIT);
+    free(queueFamilies);
+
+    if (!hasCompute || !has_compute_format_support(physicalDevice)) {
+        return false;
+    }
+
+    VkSamplerCreateInfo samplerInfo = {
+        .sType                   = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO,
+        .magFilter               = VK_FILTER_LINEAR,
+        .minFilter               = VK_FILTER_LINEAR,
+        .mipmapMode              = VK_SAMPLER_MIPMAP_MODE_NEAREST,
+        .addressModeU            = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeV            = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .addressModeW            = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE,
+        .borderColor             = VK_BORDER_COLOR_FLOAT_TRANSPARENT_BLACK,
+        .unnormalizedCoordinates = VK_FALSE,
+    };
+
+    if (vkCreateSampler(vk->device, &samplerInfo, NULL, &vk->sampler) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create Vulkan sampler!\n");
+        goto fail;
+    }
+
+    VkDescriptorSetLayoutBinding imageBinding = {
+        .binding         = 0,
+        .descriptorType  = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER,
+        .descriptorCount = 1,
+        .stageFlags      = VK_SHADER_STAGE_COMPUTE_BIT,
+    };
+
+    VkDescriptorSetLayoutCreateInfo imageSetLayoutInfo = {
+        .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 1,
+        .pBindings    = &imageBinding,
+    };
+
+    if (vkCreateDescriptorSetLayout(vk->device, &imageSetLayoutInfo, NULL, &vk->image_set_layout) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create Vulkan descriptor set layout!\n");
+        goto fail;
+    }
+
+    // Result of the slot and thumbnail of the output
+    VkDescriptorSetLayoutBinding resultBindings[] = {
+        { .binding = 0, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+        { .binding = 1, .descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, .descriptorCount = 1, .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT },
+    };
+
+    VkDescriptorSetLayoutCreateInfo resultSetLayoutInfo = {
+        .sType        = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+        .bindingCount = 2,
+        .pBindings    = resultBindings,
+    };
+
+    if (vkCreateDescriptorSetLayout(vk->device, &resultSetLayoutInfo, NULL, &vk->result_set_layout) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create Vulkan descriptor set layout!\n");
+        goto fail;
+    }
+
+    VkPushConstantRange pushConstantRange = {
+        .stageFlags = VK_SHADER_STAGE_COMPUTE_BIT,
+        .offset     = 0,
+        .size       = sizeof(struct RegionPush),
+    };
+
+    VkDescriptorSetLayout setLayouts[] = { vk->image_set_layout, vk->result_set_layout };
+    VkPipelineLayoutCreateInfo pipelineLayoutInfo = {
+        .sType                  = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+        .setLayoutCount         = 2,
+        .pSetLayouts            = setLayouts,
+        .pushConstantRangeCount = 1,
+        .pPushConstantRanges    = &pushConstantRange,
+    };
+
+    if (vkCreatePipelineLayout(vk->device, &pipelineLayoutInfo, NULL, &vk->pipeline_layout) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create Vulkan pipeline layout!\n");
+        goto fail;
+    }
+
+    VkShaderModuleCreateInfo shaderModuleInfo = {
+        .sType    = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+        .codeSize = sizeof(luma_comp_spv),
+        .pCode    = luma_comp_spv,
+    };
+
+    VkShaderModule shaderModule;
+    if (vkCreateShaderModule(vk->device, &shaderModuleInfo, NULL, &shaderModule) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create Vulkan shader module!\n");
+        goto fail;
+    }
+
+    // Shader is specialized per transfer function, formats need no per pixel branching
+    VkBool32 constants[TRANSFER_COUNT][2];
+    VkSpecializationMapEntry specializationEntries[] = {
+        { .constantID = 0, .offset = 0,                .size = sizeof(VkBool32) }, // linear
+        { .constantID = 1, .offset = sizeof(VkBool32), .size = sizeof(VkBool32) }, // center weighted
+    };
+    VkSpecializationInfo specializationInfos[TRANSFER_COUNT];
+    VkComputePipelineCreateInfo pipelineInfos[TRANSFER_COUNT];
+    for (int i = 0; i < TRANSFER_COUNT; i++) {
+        constants[i][0] = i == TRANSFER_LINEAR;
+        constants[i][1] = vk->settings.region_mode == REGION_CENTER_WEIGHTED;
+        specializationInfos[i] = (VkSpecializationInfo) {
+            .mapEntryCount = 2,
+            .pMapEntries   = specializationEntries,
+            .dataSize      = sizeof(constants[i]),
+            .pData         = constants[i],
+        };
+        pipelineInfos[i] = (VkComputePipelineCreateInfo) {
+            .sType                     = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+            .stage.sType               = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+            .stage.stage               = VK_SHADER_STAGE_COMPUTE_BIT,
+            .stage.module              = shaderModule,
+            .stage.pName               = "main",
+            .stage.pSpecializationInfo = &specializationInfos[i],
+            .layout                    = vk->pipeline_layout,
+        };
+    }
+
+    size_t cachedSize = load_pipeline_cache_vulkan(vk);
+    VkResult pipelineResult = vkCreateComputePipelines(vk->device, vk->pipeline_cache, TRANSFER_COUNT, pipelineInfos, NULL, vk->pipelines);
+    vkDestroyShaderModule(vk->device, shaderModule, NULL);
+    if (pipelineResult != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create Vulkan compute pipeline!\n");
+        goto fail;
+    }
+    save_pipeline_cache_vulkan(vk, cachedSize);
+
+    vk->compute = true;
+    return true;
+
+fail:
+    deinit_compute_vulkan(vk);
+    return false;
+}
+
+
+static bool init_slot_vulkan(struct Vulkan *vk, struct VulkanOutput *output, struct VulkanSlot *slot) {
+    VkCommandBufferAllocateInfo cmdBufferAllocInfo = {
+        .sType              = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+        .level              = VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+        .commandPool        = vk->command_pool,
+        .commandBufferCount = 1,
+    };
+
+    if (vkAllocateCommandBuffers(vk->device, &cmdBufferAllocInfo, &slot->command_buffer) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to allocate Vulkan command buffer!\n");
+        return false;
+    }
+
+    VkBufferCreateInfo bufferInfo = {
+        .sType       = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+        .size        = 4 * 500, // 1 byte per RGBA * 500 pixels (should be more than enough)
+        .usage       = VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        .sharingMode = VK_SHARING_MODE_EXCLUSIVE,
+    };
+
+    if (vkCreateBuffer(vk->device, &bufferInfo, NULL, &slot->buffer) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create Vulkan buffer!\n");
+        return false;
+    }
+
+    VkMemoryRequirements bufferMemoryRequirements;
+    vkGetBufferMemoryRequirements(vk->device, slot->buffer, &bufferMemoryRequirements);
+
+    // Cached memory keeps host reads of the readback fast on discrete GPUs
+    VkMemoryPropertyFlags bufferMemoryFlags;
+    if (!allocate_memory_vulkan(vk, &bufferMemoryRequirements, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
+            VK_MEMORY_PROPERTY_HOST_CACHED_BIT, &slot->buffer_memory, &bufferMemoryFlags)) {
+        fprintf(stderr, "ERROR: Failed to allocate memory for Vulkan buffer!\n");
+        return false;
+    }
+    slot->buffer_coherent = bufferMemoryFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT;
+
+    if (vkBindBufferMemory(vk->device, slot->buffer, slot->buffer_memory, 0) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to bind allocated memory for Vulkan buffer!\n");
+        return false;
+    }
+
+    if (vkMapMemory(vk->device, slot->buffer_memory, 0, VK_WHOLE_SIZE, 0, (void *)&slot->buffer_data) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to map Vulkan buffer memory!\n");
+        return false;
+    }
+
+    if (vk->compute && !init_slot_compute_vulkan(vk, output, slot)) {
+        return false;
+    }
+
+    VkQueryPoolCreateInfo queryPoolInfo = {
+        .sType      = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+        .queryType  = VK_QUERY_TYPE_TIMESTAMP,
+        .queryCount = 2,
+    };
+
+    if (vk->timestamps && vkCreateQueryPool(vk->device, &queryPoolInfo, NULL, &slot->query_pool) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create Vulkan query pool!\n");
+        return false;
+    }
+
+    slot->output = output;
+    wl_list_init(&slot->link);
+
+    return true;
+}
+
+void deinit_output_vulkan(struct Vulkan *vk, struct VulkanOutput *output) {
+    import_cache_clear(vk, output);
+
+    // Slots are released by now, nothing holds the mip chain anymore
+    if (output->vulkan_frame) {
+        destroy_frame_vulkan(vk, output->vulkan_frame);
+        output->vulkan_frame = NULL;
+    }
+
+    for (int i = 0; i < VULKAN_SLOTS; i++) {
+        struct VulkanSlot *slot = &output->slots[i];
+        if (slot->result_buffer)        vkDestroyBuffer(vk->device, slot->result_buffer, NULL);
+        if (slot->result_buffer_memory) vkFreeMemory(vk->device, slot->result_buffer_memory, NULL);
+        if (slot->buffer)               vkDestroyBuffer(vk->device, slot->buffer, NULL);
+        if (slot->buffer_memory)        vkFreeMemory(vk->device, slot->buffer_memory, NULL);
+        if (slot->command_buffer)       vkFreeCommandBuffers(vk->device, vk->command_pool, 1, &slot->command_buffer);
+        if (slot->query_pool)           vkDestroyQueryPool(vk->device, slot->query_pool, NULL);
+
+        memset(slot, 0, sizeof(struct VulkanSlot));
+    }
+
+    if (output->thumbnail_buffer)        vkDestroyBuffer(vk->device, output->thumbnail_buffer, NULL);
+    if (output->thumbnail_buffer_memory) vkFreeMemory(vk->device, output->thumbnail_buffer_memory, NULL);
+    output->thumbnail_buffer = VK_NULL_HANDLE;
+    output->thumbnail_buffer_memory = VK_NULL_HANDLE;
+
+    if (output->descriptor_pool) vkDestroyDescriptorPool(vk->device, output->descriptor_pool, NULL);
+    output->descriptor_pool = VK_NULL_HANDLE;
+}
+
+bool init_output_vulkan(struct Vulkan *vk, struct VulkanOutput *output) {
+    if (vk->compute) {
+        // One descriptor set per imported frame image and one per slot
+        VkDescriptorPoolSize poolSizes[] = {
+            { .type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER, .descriptorCount = IMPORT_CACHE_SIZE },
+            { .type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,         .descriptorCount = 2 * VULKAN_SLOTS },
+        };
+
+        VkDescriptorPoolCreateInfo descriptorPoolInfo = {
+            .sType         = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+            .flags         = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
+            .maxSets       = IMPORT_CACHE_SIZE + VULKAN_SLOTS,
+            .poolSizeCount = 2,
+            .pPoolSizes    = poolSizes,
+        };
+
+        if (vkCreateDescriptorPool(vk->device, &descriptorPoolInfo, NULL, &output->descriptor_pool) != VK_SUCCESS) {
+            fprintf(stderr, "ERROR: Failed to create Vulkan descriptor pool!\n");
+            goto fail;
+        }
+
+        // Thumbnail only ever goes back to the GPU
+        if (!init_storage_buffer_vulkan(vk, sizeof(struct LumaThumbnail), VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                &output->thumbnail_buffer, &output->thumbnail_buffer_memory, NULL, NULL)) {
+            goto fail;
+        }
+    }
+
+    for (int i = 0; i < VULKAN_SLOTS; i++) {
+        if (!init_slot_vulkan(vk, output, &output->slots[i])) {
+            goto fail;
+        }
+    }
+
+    return true;
+
+fail:
+    deinit_output_vulkan(vk, output);
+    return false;
+}
+
+static bool has_device_extension(VkPhysicalDevice physicalDevice, const char *name) {
+    uint32_t extensionCount;
+    if (vkEnumerateDeviceExtensionProperties(physicalDevice, NULL, &extensionCount, NULL) != VK_SUCCESS) {
+        return false;
+    }
+
+    VkExtensionProperties *extensions = calloc(extensionCount, sizeof(VkExtensionProperties));
+    if (vkEnumerateDeviceExtensionProperties(physicalDevice, NULL, &extensionCount, extensions) != VK_SUCCESS) {
+        extensionCount = 0;
+    }
+
+    bool found = false;
+    for (uint32_t i = 0; i < extensionCount && !found; i++) {
+        found = strcmp(extensions[i].extensionName, name) == 0;
+    }
+
+    free(extensions);
+    return found;
+}
+
+static bool drm_device_matches(VkPhysicalDevice physicalDevice, dev_t device) {
+    VkPhysicalDeviceDrmPropertiesEXT drmProperties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DRM_PROPERTIES_EXT,
+    };
+    VkPhysicalDeviceProperties2 properties = {
+        .sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2,
+        .pNext = &drmProperties,
+    };
+    vkGetPhysicalDeviceProperties2(physicalDevice, &properties);
+
+    // Compositors name either the primary or the render node
+    return (drmProperties.hasPrimary && makedev(drmProperties.primaryMajor, drmProperties.primaryMinor) == device)
+        || (drmProperties.hasRender && makedev(drmProperties.renderMajor, drmProperties.renderMinor) == device);
+}
+
+// Device of the compositor avoids waking up another GPU and copying frames between them, integrated GPU is the best guess otherwise
+static VkPhysicalDevice pick_physical_device_vulkan(VkPhysicalDevice *physicalDevices, uint32_t deviceCount, bool drm_device_known, dev_t drm_device) {
+    VkPhysicalDevice picked = VK_NULL_HANDLE;
+    bool pickedIntegrated = false;
+
+    for (uint32_t i = 0; i < deviceCount; i++) {
+        VkPhysicalDevice physicalDevice = physicalDevices[i];
+        if (!has_device_extension(physicalDevice, VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME) ||
+            !has_device_extension(physicalDevice, VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME)) {
+            continue;
+        }
+
+        if (drm_device_known && has_device_extension(physicalDevice, VK_EXT_PHYSICAL_DEVICE_DRM_EXTENSION_NAME) &&
+            drm_device_matches(physicalDevice, drm_device)) {
+            return physicalDevice;
+        }
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        bool integrated = properties.deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU;
+        if (picked == VK_NULL_HANDLE || (integrated && !pickedIntegrated)) {
+            picked = physicalDevice;
+            pickedIntegrated = integrated;
+        }
+    }
+
+    if (drm_device_known && picked != VK_NULL_HANDLE) {
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(picked, &properties);
+        fprintf(stderr, "WARN: Failed to find Vulkan device of DRM node %u:%u, using %s!\n",
+            major(drm_device), minor(drm_device), properties.deviceName);
+    }
+
+    return picked;
+}
+
+// Dedicated compute queue stays out of the way of graphics work, blit fallback needs a graphics queue though
+static bool pick_queue_family_vulkan(VkPhysicalDevice physicalDevice, uint32_t *queueFamilyIndex, bool *dedicated) {
+    uint32_t queueFamilyCount;
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, NULL);
+    VkQueueFamilyProperties *queueFamilies = calloc(queueFamilyCount, sizeof(VkQueueFamilyProperties));
+    vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies);
+
+    bool found = false;
+    *dedicated = false;
+    for (uint32_t i = 0; i < queueFamilyCount && has_compute_format_support(physicalDevice); i++) {
+        VkQueueFlags flags = queueFamilies[i].queueFlags;
+        if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT)) {
+            *queueFamilyIndex = i;
+            *dedicated = found = true;
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < queueFamilyCount && !found; i++) {
+        if (queueFamilies[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+            *queueFamilyIndex = i;
+            found = true;
+        }
+    }
+
+    free(queueFamilies);
+    return found;
+}
+
+static bool init_submit_vulkan(struct Vulkan *vk, struct VulkanSubmit *submit) {
+    VkExportFenceCreateInfo exportFenceInfo = {
+        .sType       = VK_STRUCTURE_TYPE_EXPORT_FENCE_CREATE_INFO,
+        .handleTypes = VK_EXTERNAL_FENCE_HANDLE_TYPE_SYNC_FD_BIT,
+    };
+
+    VkFenceCreateInfo fenceInfo = {
+        .sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO,
+        .pNext = vk->sync_fd ? &exportFenceInfo : NULL,
+    };
+
+    if (vkCreateFence(vk->device, &fenceInfo, NULL, &submit->fence) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create Vulkan fence!\n");
+        return false;
+    }
+
+    submit->fence_fd = -1;
+    wl_list_init(&submit->slots);
+
+    return true;
+}
+
+bool init_instance_vulkan(struct Vulkan *vk) {
+    VkApplicationInfo appInfo = {
+        .sType              = VK_STRUCTURE_TYPE_APPLICATION_INFO,
+        .pApplicationName   = "wluma",
+        .applicationVersion = VK_MAKE_VERSION(1, 2, 2),
+        .pEngineName        = "No Engine",
+        .engineVersion      = VK_MAKE_VERSION(1, 0, 0),
+        .apiVersion         = VK_API_VERSION_1_1,
+    };
+
+    VkInstanceCreateInfo instanceCreateInfo = {
+        .sType             = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+        .pApplicationInfo  = &appInfo,
+    };
+
+    if (vkCreateInstance(&instanceCreateInfo, NULL, &vk->instance) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to initialize Vulkan instance!\n");
+        return false;
+    }
+
+    // First enumeration is what initializes the drivers
+    uint32_t deviceCount;
+    if (vkEnumeratePhysicalDevices(vk->instance, &deviceCount, NULL) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to retrieve Vulkan physical device!\n");
+        return false;
+    }
+
+    if (deviceCount == 0) {
+        fprintf(stderr, "ERROR: No physical device that supports Vulkan!\n");
+        return false;
+    }
+
+    vk->physical_devices = calloc(deviceCount, sizeof(VkPhysicalDevice));
+    if (vkEnumeratePhysicalDevices(vk->instance, &deviceCount, vk->physical_devices) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to retrieve Vulkan physical device!\n");
+        return false;
+    }
+    vk->physical_device_count = deviceCount;
+    return true;
+}
+
+bool init_vulkan(struct Vulkan *vk, bool drm_device_known, dev_t drm_device) {
+    if (vk->instance == VK_NULL_HANDLE && !init_instance_vulkan(vk)) {
+        return false;
+    }
+
+    if (vk->physical_devices == NULL) {
+        return false;
+    }
+
+    VkPhysicalDevice physicalDevice = pick_physical_device_vulkan(vk->physical_devices, vk->physical_device_count, drm_device_known, drm_device);
+    free(vk->physical_devices);
+    vk->physical_devices = NULL;
+
+    if (physicalDevice == VK_NULL_HANDLE) {
+        fprintf(stderr, "ERROR: No physical device that can import DMA-BUFs!\n");
+        return false;
+    }
+
+    bool dedicatedQueue;
+    if (!pick_queue_family_vulkan(physicalDevice, &vk->queue_family_index, &dedicatedQueue)) {
+        fprintf(stderr, "ERROR: Failed to find Vulkan queue family!\n");
+        return false;
+    }
+
+    // Timestamps are only written on request, e.g. by benchmarks
+    if (vk->timestamps) {
+        uint32_t queueFamilyCount;
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, NULL);
+        VkQueueFamilyProperties *queueFamilies = calloc(queueFamilyCount, sizeof(VkQueueFamilyProperties));
+        vkGetPhysicalDeviceQueueFamilyProperties(physicalDevice, &queueFamilyCount, queueFamilies);
+        vk->timestamps = queueFamilies[vk->queue_family_index].timestampValidBits > 0;
+        free(queueFamilies);
+
+        VkPhysicalDeviceProperties properties;
+        vkGetPhysicalDeviceProperties(physicalDevice, &properties);
+        vk->timestamp_period = properties.limits.timestampPeriod;
+    }
+
+    float queuePriority = 1.0f;
+    VkDeviceQueueCreateInfo queueCreateInfo = {
+        .sType            = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
+        .queueFamilyIndex = vk->queue_family_index,
+        .queueCount       = 1,
+        .pQueuePriorities = &queuePriority,
+    };
+
+    // Frames are imported as DMA-BUF, fences exported as sync fd can be waited on in the event loop
+    const char *deviceExtensions[5];
+    uint32_t deviceExtensionCount = 0;
+    deviceExtensions[deviceExtensionCount++] = VK_KHR_EXTERNAL_MEMORY_FD_EXTENSION_NAME;
+    deviceExtensions[deviceExtensionCount++] = VK_EXT_EXTERNAL_MEMORY_DMA_BUF_EXTENSION_NAME;
+
+    // Explicit modifiers let compositors keep compression and tiling on,
+    // on Vulkan 1.1 the modifier extension depends on image format list, which only became core in 1.2
+    vk->physical_device = physicalDevice;
+    vk->modifiers = has_device_extension(physicalDevice, VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME)
+        && has_device_extension(physicalDevice, VK_KHR_IMAGE_FORMAT_LIST_EXTENSION_NAME);
+    if (vk->modifiers) {
+        deviceExtensions[deviceExtensionCount++] = VK_EXT_IMAGE_DRM_FORMAT_MODIFIER_EXTENSION_NAME;
+        deviceExtensions[deviceExtensionCount++] = VK_KHR_IMAGE_FORMAT_LIST_EXTENSION_NAME;
+    }
+
+    if (has_device_extension(physicalDevice, VK_KHR_EXTERNAL_FENCE_FD_EXTENSION_NAME)) {
+        VkPhysicalDeviceExternalFenceInfo externalFenceInfo = {
+            .sType      = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_FENCE_INFO,
+            .handleType = VK_EXTERNAL_FENCE_HANDLE_TYPE_SYNC_FD_BIT,
+        };
+        VkExternalFenceProperties externalFenceProperties = {
+            .sType = VK_STRUCTURE_TYPE_EXTERNAL_FENCE_PROPERTIES,
+        };
+        vkGetPhysicalDeviceExternalFenceProperties(physicalDevice, &externalFenceInfo, &externalFenceProperties);
+        vk->sync_fd = externalFenceProperties.externalFenceFeatures & VK_EXTERNAL_FENCE_FEATURE_EXPORTABLE_BIT;
+        if (vk->sync_fd) {
+            deviceExtensions[deviceExtensionCount++] = VK_KHR_EXTERNAL_FENCE_FD_EXTENSION_NAME;
+        }
+    }
+
+    VkDeviceCreateInfo deviceCreateInfo = {
+        .sType                   = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+        .pQueueCreateInfos       = &queueCreateInfo,
+        .queueCreateInfoCount    = 1,
+        .enabledExtensionCount   = deviceExtensionCount,
+        .ppEnabledExtensionNames = deviceExtensions,
+    };
+
+    if (vkCreateDevice(physicalDevice, &deviceCreateInfo, NULL, &vk->device) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to initialize Vulkan logical device!\n");
+        return false;
+    }
+
+    if (vk->sync_fd) {
+        vk->get_fence_fd = (PFN_vkGetFenceFdKHR)vkGetDeviceProcAddr(vk->device, "vkGetFenceFdKHR");
+        vk->sync_fd = vk->get_fence_fd != NULL;
+    }
+
+    // Memory types are picked per resource, imported DMA-BUFs tell which ones they can live in
+    vkGetPhysicalDeviceMemoryProperties(physicalDevice, &vk->memory_properties);
+    vk->get_memory_fd_properties = (PFN_vkGetMemoryFdPropertiesKHR)vkGetDeviceProcAddr(vk->device, "vkGetMemoryFdPropertiesKHR");
+
+    vkGetDeviceQueue(vk->device, vk->queue_family_index, 0, &vk->queue);
+
+    VkCommandPoolCreateInfo poolInfo = {
+        .sType            = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+        .queueFamilyIndex = vk->queue_family_index,
+        .flags            = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+    };
+
+    if (vkCreateCommandPool(vk->device, &poolInfo, NULL, &vk->command_pool) != VK_SUCCESS) {
+        fprintf(stderr, "ERROR: Failed to create Vulkan command pool!\n");
+        return false;
+    }
+
+    wl_list_init(&vk->pending);
+    for (int i = 0; i < VULKAN_SUBMITS; i++) {
+        if (!init_submit_vulkan(vk, &vk->submits[i])) {
+            return false;
+        }
+    }
+
+    if (!init_compute_vulkan(vk, physicalDevice, vk->queue_family_index)) {
+        if (dedicatedQueue) {
+            fprintf(stderr, "ERROR: Failed to initialize Vulkan compute path!\n");
+            return false;
+        }
+        fprintf(stderr, "WARN: Vulkan compute path is not available, falling back to blit!\n");
+    }
+
+    return true;
+}
+
+void finish_vulkan(struct Vulkan *vk) {
+    if (vk->device == VK_NULL_HANDLE) {
+        return;
+    }
+
+    vkDeviceWaitIdle(vk->device);
+
+    for (int i = 0; i < VULKAN_SUBMITS; i++) {
+        struct VulkanSubmit *submit = &vk->submits[i];
+        if (submit->busy) {
+            struct VulkanSlot *slot, *tmp;
+            wl_list_for_each_safe(slot, tmp, &submit->slots, link) {
+                drop_slot_vulkan(vk, slot);
+            }
+            release_submit_vulkan(vk, submit);
+        }
+    }
+}
+
+void deinit_vulkan(struct Vulkan *vk) {
+    deinit_compute_vulkan(vk);
+
+    for (int i = 0; i < VULKAN_SUBMITS; i++) {
+        if (vk->submits[i].fence) vkDestroyFence(vk->device, vk->submits[i].fence, NULL);
+    }
+
+    if (vk->pipeline_cache) vkDestroyPipelineCache(vk->device, vk->pipeline_cache, NULL);
+    if (vk->command_pool)   vkDestroyCommandPool(vk->device, vk->command_pool, NULL);
+    if (vk->device)         vkDestroyDevice(vk->device, NULL);
+    if (vk->instance)       vkDestroyInstance(vk->instance, NULL);
+
+    free(vk->physical_devices);
+    vk->physical_devices = NULL;
+}
@@ -0,0 +1,254 @@
+#ifndef WLUMA_VULKAN_H
+#define WLUMA_VULKAN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+#include <vulkan/vulkan.h>
+#include <wayland-util.h>
+
+#include "luma.h"
+
+// Turns DMA-BUF frames into luma values on the GPU, shared by wluma and its benchmarks
+
+#define LAST_MIP_LEVEL                4
+#define IMPORT_CACHE_SIZE             4
+#define IMPORT_CACHE_MAX_IDLE_FRAMES  16
+#define VULKAN_SLOTS                  2 // per output, must be less than IMPORT_CACHE_SIZE
+#define VULKAN_SUBMITS                4
+#define VULKAN_BATCH_SIZE             8
+
+struct VulkanOutput;
+struct VulkanSubmit;
+
+struct Frame {
+    // Capture object the frame came from, owned by the application
+    void *capture;
+
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint64_t modifier;
+    uint32_t num_objects;
+
+    uint32_t sizes[4];
+    int32_t  fds[4];
+    uint32_t offsets[4];
+    uint32_t strides[4];
+    uint32_t plane_indices[4];
+
+    // Objects are separate buffers rather than planes of the same one
+    bool disjoint;
+};
+
+// Calls back into the application, which owns frames and the event loop
+struct VulkanListener {
+    // Frame of a slot that was dropped without being processed
+    void (*frame_dropped)(void *data, struct Frame *frame);
+
+    // Fence of the submission was exported as sync fd, it becomes readable once the work is done
+    bool (*fence_exported)(void *data, struct VulkanSubmit *submit);
+
+    // Sync fd of the submission is about to be closed
+    void (*fence_released)(void *data, struct VulkanSubmit *submit);
+};
+
+// Resources of a single in-flight frame
+struct VulkanSlot {
+    bool busy;
+    VkCommandBuffer command_buffer;
+    struct VulkanOutput *output;
+
+    // Link in the pending list or in the list of its submission
+    struct wl_list link;
+
+    // Frame and its imported image are held until GPU is done with them
+    struct Frame *frame;
+    struct ImportedImage *image;
+
+    // Blit path readback, mip chain it was copied from is held along with the frame
+    VkBuffer buffer;
+    VkDeviceMemory buffer_memory;
+    struct VulkanFrame *vulkan_frame;
+
+    // Compute path result
+    VkBuffer result_buffer;
+    VkDeviceMemory result_buffer_memory;
+    VkDescriptorSet result_descriptor_set;
+
+    // Readback memory stays mapped for as long as the slot lives
+    unsigned char *buffer_data;
+    bool buffer_coherent;
+    void *result_data;
+    bool result_coherent;
+
+    // Timestamps around the recorded work, only when requested
+    VkQueryPool query_pool;
+};
+
+// Slots of all outputs recorded in the same tick share one queue submission
+struct VulkanSubmit {
+    bool busy;
+    VkFence fence;
+    bool fence_exported;
+    struct timespec submitted;
+    struct wl_list slots;
+
+    // Sync fd of the fence, -1 when fence has to be polled
+    int fence_fd;
+
+    // Fence failed to reset, it is reset again before the next submission
+    bool fence_signaled;
+
+    // Set by the application once it warned about a fence that takes too long
+    bool overdue;
+};
+
+enum FrameTransfer {
+    TRANSFER_SRGB,
+    TRANSFER_LINEAR,
+    TRANSFER_COUNT,
+};
+
+struct Vulkan {
+    // Set by the application before init_vulkan
+    struct LumaSettings settings;
+    const struct VulkanListener *listener;
+    void *listener_data;
+    bool timestamps;
+
+    // Compiled pipelines are kept here across runs, NULL to always compile them
+    const char *pipeline_cache_path;
+
+    VkInstance instance;
+    VkDevice device;
+    VkQueue queue;
+
+    // Nothing can be submitted anymore once the device is lost
+    bool device_lost;
+    uint32_t queue_family_index;
+    VkPhysicalDevice physical_device;
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    PFN_vkGetMemoryFdPropertiesKHR get_memory_fd_properties;
+
+    // Frames with explicit DRM format modifiers can be imported
+    bool modifiers;
+    VkCommandPool command_pool;
+    struct VulkanSubmit submits[VULKAN_SUBMITS];
+
+    // Slots recorded but not yet submitted
+    struct wl_list pending;
+
+    // Frames skipped for lack of a free slot are only reported once
+    bool warned_slots_busy;
+
+    // Fence completion is exported as sync fd when supported
+    bool sync_fd;
+    PFN_vkGetFenceFdKHR get_fence_fd;
+
+    // Nanoseconds per timestamp tick, timestamps are turned off when the queue has none
+    float timestamp_period;
+
+    // Compute path, blit is used as a fallback on devices that can't run it
+    bool compute;
+    VkSampler sampler;
+    VkDescriptorSetLayout image_set_layout;
+    VkDescriptorSetLayout result_set_layout;
+    VkPipelineLayout pipeline_layout;
+    VkPipeline pipelines[TRANSFER_COUNT];
+    VkPipelineCache pipeline_cache;
+
+    // Devices found along with the instance, until init_vulkan picks one
+    VkPhysicalDevice *physical_devices;
+    uint32_t physical_device_count;
+};
+
+struct ImportKey {
+    dev_t dev;
+    ino_t ino;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint64_t modifier;
+};
+
+struct ImportedImage {
+    struct ImportKey key;
+    VkImage image;
+    VkDeviceMemory memory[4];
+    uint32_t memory_count;
+    uint64_t last_used;
+    int in_flight;
+    bool stale;
+
+    // Only used by compute path
+    VkImageView view;
+    VkDescriptorSet descriptor_set;
+};
+
+struct VulkanOutput {
+    // Used in warnings only
+    const char *name;
+
+    // Vulkan structs for processing frames, might be reused
+    struct VulkanFrame *vulkan_frame;
+    VkDescriptorPool descriptor_pool;
+    struct VulkanSlot slots[VULKAN_SLOTS];
+
+    // Previous frame, compared with the current one to detect static content
+    VkBuffer thumbnail_buffer;
+    VkDeviceMemory thumbnail_buffer_memory;
+
+    // DMA-BUFs imported into Vulkan, compositors cycle through just a few of them
+    struct ImportedImage import_cache[IMPORT_CACHE_SIZE];
+    uint32_t import_cache_width;
+    uint32_t import_cache_height;
+    uint64_t frame_counter;
+
+    // Whether frames with this format and modifier can be imported, checked once
+    bool import_checked;
+    bool import_supported;
+    uint32_t import_format;
+    uint64_t import_modifier;
+    const struct FrameFormat *frame_format;
+};
+
+// Loads the drivers, safe to run on another thread while the device of the compositor is not known yet
+bool init_instance_vulkan(struct Vulkan *vk);
+
+// Device of the compositor is preferred when known, creates the instance unless done already
+bool init_vulkan(struct Vulkan *vk, bool drm_device_known, dev_t drm_device);
+void deinit_vulkan(struct Vulkan *vk);
+
+// Waits for the GPU, frames still in flight are dropped
+void finish_vulkan(struct Vulkan *vk);
+
+bool init_output_vulkan(struct Vulkan *vk, struct VulkanOutput *output);
+void deinit_output_vulkan(struct Vulkan *vk, struct VulkanOutput *output);
+
+// Whether single plane frames of this format and modifier can be imported, for buffers the application allocates
+bool frame_format_supported_vulkan(struct Vulkan *vk, uint32_t fourcc, uint64_t modifier);
+
+// Called once the size of the next frame of the output is known
+void prepare_frame_vulkan(struct Vulkan *vk, struct VulkanOutput *output, uint32_t width, uint32_t height);
+
+// Frame is owned by a slot on success, slots are submitted by submit_pending_vulkan
+bool record_frame_vulkan(struct Vulkan *vk, struct VulkanOutput *output, struct Frame *frame);
+struct Frame* release_slot_vulkan(struct Vulkan *vk, struct VulkanSlot *slot);
+
+bool submit_pending_vulkan(struct Vulkan *vk);
+bool submit_done_vulkan(struct Vulkan *vk, struct VulkanSubmit *submit);
+
+// Lets an output that goes away wait only for the submissions holding its frames, false if the fence didn't signal in time
+bool submit_has_output_vulkan(struct VulkanSubmit *submit, struct VulkanOutput *output);
+bool wait_submit_vulkan(struct Vulkan *vk, struct VulkanSubmit *submit, uint64_t timeout_ns);
+bool release_submit_vulkan(struct Vulkan *vk, struct VulkanSubmit *submit);
+
+// Difference is the largest change since previous frame of the output, in percent
+int read_frame_luma_pct_vulkan(struct Vulkan *vk, struct VulkanSlot *slot, double *difference);
+
+// Time the GPU spent on the slot, requires timestamps
+bool read_gpu_time_vulkan(struct Vulkan *vk, struct VulkanSlot *slot, uint64_t *ns);
+
+#endif